@@ -0,0 +1,125 @@
+#pragma once
+
+#include "vec3.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+** An axis aligned bounding box
+*/
+struct aabb
+{
+    struct vec3 min;
+    struct vec3 max;
+};
+
+static inline struct aabb aabb_empty(void)
+{
+    return (struct aabb){
+        .min = {INFINITY, INFINITY, INFINITY},
+        .max = {-INFINITY, -INFINITY, -INFINITY},
+    };
+}
+
+static inline bool aabb_is_empty(const struct aabb *box)
+{
+    return box->min.x > box->max.x;
+}
+
+static inline void aabb_add_point(struct aabb *box, const struct vec3 *point)
+{
+    vec3_update_min_components(&box->min, point);
+    vec3_update_max_components(&box->max, point);
+}
+
+static inline void aabb_add(struct aabb *box, const struct aabb *other)
+{
+    vec3_update_min_components(&box->min, &other->min);
+    vec3_update_max_components(&box->max, &other->max);
+}
+
+static inline void aabb_grow(struct aabb *box, double margin)
+{
+    struct vec3 offset = {margin, margin, margin};
+    box->min = vec3_sub(&box->min, &offset);
+    box->max = vec3_add(&box->max, &offset);
+}
+
+static inline bool aabb_overlap(const struct aabb *a, const struct aabb *b)
+{
+    return a->min.x <= b->max.x && b->min.x <= a->max.x
+           && a->min.y <= b->max.y && b->min.y <= a->max.y
+           && a->min.z <= b->max.z && b->min.z <= a->max.z;
+}
+
+/*
+** Returns whether moving along direction, for any positive distance, makes
+** the box overlap the other one.
+*/
+static inline bool aabb_sweep_overlap(const struct aabb *box,
+                                      const struct vec3 *direction,
+                                      const struct aabb *other)
+{
+    const double *box_min = &box->min.x;
+    const double *box_max = &box->max.x;
+    const double *dir = &direction->x;
+    const double *other_min = &other->min.x;
+    const double *other_max = &other->max.x;
+
+    double t_min = 0;
+    double t_max = INFINITY;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (dir[axis] == 0)
+        {
+            if (box_min[axis] > other_max[axis]
+                || other_min[axis] > box_max[axis])
+                return false;
+            continue;
+        }
+
+        // the distances at which the box enters and leaves the other one
+        double t1 = (other_min[axis] - box_max[axis]) / dir[axis];
+        double t2 = (other_max[axis] - box_min[axis]) / dir[axis];
+        t_min = fmax(t_min, fmin(t1, t2));
+        t_max = fmin(t_max, fmax(t1, t2));
+    }
+    return t_min <= t_max;
+}
+
+static inline struct aabb aabb_lerp(const struct aabb *a, const struct aabb *b,
+                                    double t)
+{
+    struct vec3 min_offset = vec3_sub(&b->min, &a->min);
+    struct vec3 max_offset = vec3_sub(&b->max, &a->max);
+    min_offset = vec3_mul(&min_offset, t);
+    max_offset = vec3_mul(&max_offset, t);
+    return (struct aabb){
+        .min = vec3_add(&a->min, &min_offset),
+        .max = vec3_add(&a->max, &max_offset),
+    };
+}
+
+/*
+** Returns whether the other box may overlap the convex hull of a and b.
+** The hull is covered by steps boxes, each bounding two boxes interpolated
+** between a and b: more steps make for a tighter test.
+*/
+static inline bool aabb_hull_overlap(const struct aabb *a,
+                                     const struct aabb *b,
+                                     const struct aabb *other, size_t steps)
+{
+    struct aabb prev = *a;
+    for (size_t i = 1; i <= steps; i++)
+    {
+        struct aabb next = aabb_lerp(a, b, (double)i / steps);
+        struct aabb step = prev;
+        aabb_add(&step, &next);
+        if (aabb_overlap(&step, other))
+            return true;
+        prev = next;
+    }
+    return false;
+}
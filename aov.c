@@ -0,0 +1,79 @@
+#include "aov.h"
+#include "exr.h"
+#include "utils.h"
+
+#include <math.h>
+
+// the first channel of each layer
+static const size_t aov_layer_channels[AOV_LAYER_COUNT] = {
+    [AOV_BEAUTY] = 0,     [AOV_DEPTH] = 3,    [AOV_NORMAL] = 4,
+    [AOV_ALBEDO] = 7,     [AOV_OBJECT_ID] = 10, [AOV_AMBIENT] = 11,
+    [AOV_DIFFUSE] = 14,   [AOV_SPECULAR] = 17, [AOV_INDIRECT] = 20,
+};
+
+// channel names follow the usual compositing conventions. Depth and ids
+// need more precision than half floats have
+static const struct exr_channel aov_channels[AOV_CHANNEL_COUNT] = {
+    {"R", EXR_HALF},          {"G", EXR_HALF},
+    {"B", EXR_HALF},          {"Z", EXR_FLOAT},
+    {"N.X", EXR_HALF},        {"N.Y", EXR_HALF},
+    {"N.Z", EXR_HALF},        {"albedo.R", EXR_HALF},
+    {"albedo.G", EXR_HALF},   {"albedo.B", EXR_HALF},
+    {"id", EXR_FLOAT},        {"ambient.R", EXR_HALF},
+    {"ambient.G", EXR_HALF},  {"ambient.B", EXR_HALF},
+    {"diffuse.R", EXR_HALF},  {"diffuse.G", EXR_HALF},
+    {"diffuse.B", EXR_HALF},  {"specular.R", EXR_HALF},
+    {"specular.G", EXR_HALF}, {"specular.B", EXR_HALF},
+    {"indirect.R", EXR_HALF}, {"indirect.G", EXR_HALF},
+    {"indirect.B", EXR_HALF},
+};
+
+STATIC_ASSERT(aov_channel_count,
+              sizeof(aov_channels) / sizeof(aov_channels[0])
+                  == AOV_CHANNEL_COUNT);
+
+void aov_clear(struct aov_tile *tile, size_t i)
+{
+    for (size_t c = 0; c < AOV_CHANNEL_COUNT; c++)
+        tile->channels[c][i] = 0;
+
+    // the background is infinitely far away
+    tile->channels[aov_layer_channels[AOV_DEPTH]][i] = INFINITY;
+}
+
+void aov_set_scalar(struct aov_tile *tile, enum aov_layer layer, size_t i,
+                    double value)
+{
+    size_t channel = aov_layer_channels[layer];
+    tile->channels[channel][i] = value;
+}
+
+void aov_set_vec3(struct aov_tile *tile, enum aov_layer layer, size_t i,
+                  const struct vec3 *value)
+{
+    size_t channel = aov_layer_channels[layer];
+    tile->channels[channel][i] = value->x;
+    tile->channels[channel + 1][i] = value->y;
+    tile->channels[channel + 2][i] = value->z;
+}
+
+int aov_file_open(struct aov_file *file, const char *path, size_t width,
+                  size_t height)
+{
+    return exr_tiled_open(&file->exr, path, aov_channels, AOV_CHANNEL_COUNT,
+                          width, height, AOV_TILE_SIZE);
+}
+
+int aov_file_write_tile(struct aov_file *file, size_t x, size_t y,
+                        const struct aov_tile *tile)
+{
+    const float *planes[AOV_CHANNEL_COUNT];
+    for (size_t i = 0; i < AOV_CHANNEL_COUNT; i++)
+        planes[i] = tile->channels[i];
+    return exr_tiled_write_tile(&file->exr, x, y, planes);
+}
+
+int aov_file_close(struct aov_file *file)
+{
+    return exr_tiled_close(&file->exr);
+}
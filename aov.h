@@ -0,0 +1,72 @@
+#pragma once
+
+#include "exr.h"
+#include "vec3.h"
+
+#include <stddef.h>
+
+/*
+** Arbitrary output variables: the intermediate values the renderer
+** computes for each pixel, saved alongside the final image as separate
+** layers, for compositing.
+*/
+enum aov_layer
+{
+    /* the final color, before quantization */
+    AOV_BEAUTY = 0,
+    /* the distance travelled by the camera ray to the shaded surface */
+    AOV_DEPTH,
+    /* the surface normal */
+    AOV_NORMAL,
+    /* the surface color */
+    AOV_ALBEDO,
+    /* the index of the shaded object plus one, 0 for the background */
+    AOV_OBJECT_ID,
+    /* the lighting contributions, which sum up to the beauty layer */
+    AOV_AMBIENT,
+    AOV_DIFFUSE,
+    AOV_SPECULAR,
+    AOV_INDIRECT,
+    AOV_LAYER_COUNT,
+};
+
+#define AOV_CHANNEL_COUNT 23
+// layers are written one render tile at a time
+#define AOV_TILE_SIZE 16
+
+/*
+** The layers of a tile, with one value per pixel and channel. Pixels are
+** stored line by line, with a stride of the tile width.
+*/
+struct aov_tile
+{
+    float channels[AOV_CHANNEL_COUNT][AOV_TILE_SIZE * AOV_TILE_SIZE];
+};
+
+/*
+** Clears the pixel at index i, so that it shows the background.
+*/
+void aov_clear(struct aov_tile *tile, size_t i);
+void aov_set_scalar(struct aov_tile *tile, enum aov_layer layer, size_t i,
+                    double value);
+void aov_set_vec3(struct aov_tile *tile, enum aov_layer layer, size_t i,
+                  const struct vec3 *value);
+
+/*
+** A multi-layer OpenEXR image, which tiles are written to as soon as they
+** are rendered. Colors are stored as half floats, depth and object ids as
+** full floats. The file only replaces its path once closed.
+*/
+struct aov_file
+{
+    struct exr_tiled_file exr;
+};
+
+int aov_file_open(struct aov_file *file, const char *path, size_t width,
+                  size_t height);
+/*
+** Writes the tile whose top left pixel is (x, y). Thread safe.
+*/
+int aov_file_write_tile(struct aov_file *file, size_t x, size_t y,
+                        const struct aov_tile *tile);
+int aov_file_close(struct aov_file *file);
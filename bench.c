@@ -0,0 +1,404 @@
+/*
+** Microbenchmarks for the vec3 primitives and the intersection / shading
+** kernels. Each kernel runs over large arrays, both in the array of
+** structures layout used by the renderer (struct vec3[]) and in a structure
+** of arrays layout (one array per component), so that the cost of each
+** layout can be compared.
+**
+** Results are reported in cycles per operation. On x86 the time stamp
+** counter is used, elsewhere the monotonic clock is used and the results
+** are in nanoseconds per operation.
+**
+** `make vecreport` dumps the vectorizer decisions for this file.
+*/
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_UNIT "cycles"
+#else
+#define BENCH_UNIT "ns"
+#endif
+
+#include "camera.h"
+#include "shading.h"
+#include "sphere.h"
+#include "utils.h"
+#include "vec3.h"
+
+#define BENCH_COUNT ((size_t)1 << 20)
+#define BENCH_RUNS 8
+
+static inline uint64_t bench_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+struct vec3_soa
+{
+    double *x;
+    double *y;
+    double *z;
+};
+
+struct bench_data
+{
+    struct vec3 *a;
+    struct vec3 *b;
+    struct vec3 *out;
+    double *scalars;
+
+    struct vec3_soa soa_a;
+    struct vec3_soa soa_b;
+    struct vec3_soa soa_out;
+
+    struct ray *rays;
+    struct intersection *intersections;
+    double *distances;
+};
+
+// keeps the compiler from optimizing the kernels away
+static volatile double bench_sink;
+
+static void vec3_soa_alloc(struct vec3_soa *soa, size_t count)
+{
+    soa->x = xalloc(sizeof(double) * count);
+    soa->y = xalloc(sizeof(double) * count);
+    soa->z = xalloc(sizeof(double) * count);
+}
+
+static void vec3_soa_free(struct vec3_soa *soa)
+{
+    free(soa->x);
+    free(soa->y);
+    free(soa->z);
+}
+
+static double random_unit(void)
+{
+    return (double)rand() / RAND_MAX * 2. - 1.;
+}
+
+static struct vec3 random_direction(void)
+{
+    struct vec3 res;
+    do
+        res = (struct vec3){random_unit(), random_unit(), random_unit()};
+    while (vec3_length(&res) < 1e-3);
+    vec3_normalize(&res);
+    return res;
+}
+
+static void bench_data_init(struct bench_data *data, size_t count)
+{
+    data->a = xalloc(sizeof(struct vec3) * count);
+    data->b = xalloc(sizeof(struct vec3) * count);
+    data->out = xalloc(sizeof(struct vec3) * count);
+    data->scalars = xalloc(sizeof(double) * count);
+    vec3_soa_alloc(&data->soa_a, count);
+    vec3_soa_alloc(&data->soa_b, count);
+    vec3_soa_alloc(&data->soa_out, count);
+    data->rays = xalloc(sizeof(struct ray) * count);
+    data->intersections = xalloc(sizeof(struct intersection) * count);
+    data->distances = xalloc(sizeof(double) * count);
+
+    srand(42);
+    for (size_t i = 0; i < count; i++)
+    {
+        data->a[i] = random_direction();
+        data->b[i] = random_direction();
+        data->soa_a.x[i] = data->a[i].x;
+        data->soa_a.y[i] = data->a[i].y;
+        data->soa_a.z[i] = data->a[i].z;
+        data->soa_b.x[i] = data->b[i].x;
+        data->soa_b.y[i] = data->b[i].y;
+        data->soa_b.z[i] = data->b[i].z;
+    }
+
+    // rays going from around the origin towards the benchmark sphere
+    struct camera camera = {
+        .center = {0, 0, 0},
+        .forward = {0, 1, 0},
+        .up = {0, 0, 1},
+        .width = 10,
+        .height = 10,
+        .focal_distance = focal_distance_from_fov(10, 80),
+    };
+    for (size_t i = 0; i < count; i++)
+        camera_cast_ray(&data->rays[i], &camera, random_unit() / 2,
+                        random_unit() / 2);
+}
+
+static void bench_data_free(struct bench_data *data)
+{
+    free(data->a);
+    free(data->b);
+    free(data->out);
+    free(data->scalars);
+    vec3_soa_free(&data->soa_a);
+    vec3_soa_free(&data->soa_b);
+    vec3_soa_free(&data->soa_out);
+    free(data->rays);
+    free(data->intersections);
+    free(data->distances);
+}
+
+/*
+** The components are loaded into restrict pointers, otherwise the compiler
+** has to assume the output arrays may alias the inputs, and gives up on
+** vectorizing.
+*/
+#define SOA_LOAD_A(Data)                                                       \
+    const double *restrict ax = (Data)->soa_a.x;                               \
+    const double *restrict ay = (Data)->soa_a.y;                               \
+    const double *restrict az = (Data)->soa_a.z
+
+#define SOA_LOAD_AB(Data)                                                      \
+    SOA_LOAD_A(Data);                                                          \
+    const double *restrict bx = (Data)->soa_b.x;                               \
+    const double *restrict by = (Data)->soa_b.y;                               \
+    const double *restrict bz = (Data)->soa_b.z
+
+#define SOA_LOAD_OUT(Data)                                                     \
+    double *restrict outx = (Data)->soa_out.x;                                 \
+    double *restrict outy = (Data)->soa_out.y;                                 \
+    double *restrict outz = (Data)->soa_out.z
+
+static void aos_add(struct bench_data *data, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        data->out[i] = vec3_add(&data->a[i], &data->b[i]);
+}
+
+static void soa_add(struct bench_data *data, size_t count)
+{
+    SOA_LOAD_AB(data);
+    SOA_LOAD_OUT(data);
+    for (size_t i = 0; i < count; i++)
+    {
+        outx[i] = ax[i] + bx[i];
+        outy[i] = ay[i] + by[i];
+        outz[i] = az[i] + bz[i];
+    }
+}
+
+static void aos_dot(struct bench_data *data, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        data->scalars[i] = vec3_dot(&data->a[i], &data->b[i]);
+}
+
+static void soa_dot(struct bench_data *data, size_t count)
+{
+    SOA_LOAD_AB(data);
+    double *restrict scalars = data->scalars;
+    for (size_t i = 0; i < count; i++)
+        scalars[i] = ax[i] * bx[i] + ay[i] * by[i] + az[i] * bz[i];
+}
+
+static void aos_cross(struct bench_data *data, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        data->out[i] = vec3_cross(&data->a[i], &data->b[i]);
+}
+
+static void soa_cross(struct bench_data *data, size_t count)
+{
+    SOA_LOAD_AB(data);
+    SOA_LOAD_OUT(data);
+    for (size_t i = 0; i < count; i++)
+    {
+        outx[i] = ay[i] * bz[i] - by[i] * az[i];
+        outy[i] = az[i] * bx[i] - bz[i] * ax[i];
+        outz[i] = ax[i] * by[i] - bx[i] * ay[i];
+    }
+}
+
+static void aos_normalize(struct bench_data *data, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        data->out[i] = data->a[i];
+        vec3_normalize(&data->out[i]);
+    }
+}
+
+static void soa_normalize(struct bench_data *data, size_t count)
+{
+    SOA_LOAD_A(data);
+    SOA_LOAD_OUT(data);
+    for (size_t i = 0; i < count; i++)
+    {
+        double len = sqrt(ax[i] * ax[i] + ay[i] * ay[i] + az[i] * az[i]);
+        outx[i] = ax[i] / len;
+        outy[i] = ay[i] / len;
+        outz[i] = az[i] / len;
+    }
+}
+
+static void aos_reflect(struct bench_data *data, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        data->out[i] = vec3_reflect(&data->a[i], &data->b[i]);
+}
+
+static void soa_reflect(struct bench_data *data, size_t count)
+{
+    SOA_LOAD_AB(data);
+    SOA_LOAD_OUT(data);
+    for (size_t i = 0; i < count; i++)
+    {
+        double coeff = -2 * (ax[i] * bx[i] + ay[i] * by[i] + az[i] * bz[i]);
+        outx[i] = ax[i] + bx[i] * coeff;
+        outy[i] = ay[i] + by[i] * coeff;
+        outz[i] = az[i] + bz[i] * coeff;
+    }
+}
+
+static const struct sphere bench_sphere = {
+    .center = {0, 10, 0},
+    .radius = 4,
+};
+
+static void kernel_intersect(struct bench_data *data, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        data->distances[i] = sphere_ray_intersect(
+            &data->intersections[i], &data->rays[i], &bench_sphere);
+}
+
+static void kernel_shade(struct bench_data *data, size_t count)
+{
+    struct light light = {
+        .type = LIGHT_DIRECTIONAL,
+        .color = {1, 1, 0},
+        .direction = {-1, 1, 1},
+        .intensity = 5,
+    };
+    vec3_normalize(&light.direction);
+
+    struct light_sample sample;
+    light_sample(&sample, &light, &(struct vec3){0}, 0.5, 0.5);
+
+    struct material material = {
+        .surface_color = {0.75, 0.125, 0.125},
+        .diffuse_kn = 0.20,
+        .spec_n = 10,
+        .spec_ks = 0.20,
+    };
+
+    struct vec3 ambient = shade_ambient(&material, 0.1);
+    for (size_t i = 0; i < count; i++)
+    {
+        // reuse the normals of the random vector set, so that the shading
+        // cost does not depend on how many rays hit the sphere
+        struct intersection intersection = {
+            .point = data->a[i],
+            .normal = data->b[i],
+        };
+        struct light_contribution direct = shade_light(
+            &intersection, &data->rays[i], &material, &light, &sample);
+        data->out[i] = vec3_add(&ambient, &direct.diffuse);
+        data->out[i] = vec3_add(&data->out[i], &direct.specular);
+    }
+}
+
+struct bench_kernel
+{
+    const char *name;
+    const char *layout;
+    void (*run)(struct bench_data *data, size_t count);
+};
+
+static const struct bench_kernel bench_kernels[] = {
+    {"vec3_add", "aos", aos_add},
+    {"vec3_add", "soa", soa_add},
+    {"vec3_dot", "aos", aos_dot},
+    {"vec3_dot", "soa", soa_dot},
+    {"vec3_cross", "aos", aos_cross},
+    {"vec3_cross", "soa", soa_cross},
+    {"vec3_normalize", "aos", aos_normalize},
+    {"vec3_normalize", "soa", soa_normalize},
+    {"vec3_reflect", "aos", aos_reflect},
+    {"vec3_reflect", "soa", soa_reflect},
+    {"sphere_ray_intersect", "aos", kernel_intersect},
+    {"shade_light", "aos", kernel_shade},
+};
+
+static double bench_checksum(const struct bench_data *data, size_t count)
+{
+    double res = 0;
+    for (size_t i = 0; i < count; i += count / 16)
+        res += data->out[i].x + data->soa_out.x[i] + data->scalars[i]
+               + data->distances[i];
+    return res;
+}
+
+/*
+** Runs a kernel BENCH_RUNS times, and returns the best time per operation.
+** Taking the minimum filters out interrupts and frequency ramp-up.
+*/
+static double bench_run(const struct bench_kernel *kernel,
+                        struct bench_data *data, size_t count)
+{
+    // warm up caches and branch predictors
+    kernel->run(data, count);
+
+    uint64_t best = UINT64_MAX;
+    for (size_t run = 0; run < BENCH_RUNS; run++)
+    {
+        uint64_t start = bench_clock();
+        kernel->run(data, count);
+        uint64_t elapsed = bench_clock() - start;
+        if (elapsed < best)
+            best = elapsed;
+        bench_sink += bench_checksum(data, count);
+    }
+    return (double)best / count;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t count = BENCH_COUNT;
+    if (argc > 2)
+        errx(1, "Usage: [COUNT]");
+    if (argc == 2)
+    {
+        char *end;
+        count = strtoul(argv[1], &end, 10);
+        if (*end != '\0' || count < 16)
+            errx(1, "invalid element count: %s", argv[1]);
+    }
+
+    struct bench_data data;
+    bench_data_init(&data, count);
+    memset(data.out, 0, sizeof(*data.out) * count);
+    memset(data.scalars, 0, sizeof(*data.scalars) * count);
+    memset(data.distances, 0, sizeof(*data.distances) * count);
+    for (size_t i = 0; i < count; i++)
+        data.soa_out.x[i] = 0;
+
+    printf("%-22s %-6s %12s\n", "kernel", "layout", BENCH_UNIT "/op");
+    for (size_t i = 0; i < sizeof(bench_kernels) / sizeof(bench_kernels[0]);
+         i++)
+    {
+        const struct bench_kernel *kernel = &bench_kernels[i];
+        double per_op = bench_run(kernel, &data, count);
+        printf("%-22s %-6s %12.2f\n", kernel->name, kernel->layout, per_op);
+    }
+
+    bench_data_free(&data);
+    return 0;
+}
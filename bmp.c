@@ -48,9 +48,7 @@ STATIC_ASSERT(bmp_header_size, sizeof(struct bmp_header) == 54);
 
 int bmp_write(struct rgb_image *image, size_t pixel_density, FILE *file)
 {
-    size_t unpadded_stride = image->width * sizeof(struct rgb_pixel);
-    size_t stride = align_up(unpadded_stride, 4);
-    size_t data_size = stride * image->height;
+    size_t data_size = image->stride * image->height;
     struct bmp_header header;
     header.file = (struct bmp_file_header){
         .signature[0] = 'B',
@@ -76,26 +74,9 @@ int bmp_write(struct rgb_image *image, size_t pixel_density, FILE *file)
         .important_colors = 0, // obsolete and ignored field
     };
 
-    fwrite(&header, sizeof(header), 1, file);
-
-    size_t padding_size = stride - unpadded_stride;
-    char padding[4] = {0};
-
-    for (size_t line_i = 0; line_i < image->height; line_i++)
-    {
-        // bmp images are written from the bottom up
-        size_t bmp_line_i = image->height - 1 - line_i;
-        struct rgb_pixel *line = &image->data[image->width * bmp_line_i];
-        for (size_t col = 0; col < image->width; col++)
-        {
-            struct rgb_pixel *pixel = &line[col];
-            uint8_t out_data[3];
-            out_data[0] = pixel->b;
-            out_data[1] = pixel->g;
-            out_data[2] = pixel->r;
-            fwrite(out_data, 3, 1, file);
-        }
-        fwrite(padding, padding_size, 1, file);
-    }
+    // the image is already laid out as the pixel array
+    if (fwrite(&header, sizeof(header), 1, file) != 1
+        || fwrite(image->data, data_size, 1, file) != 1)
+        return -1;
     return 0;
 }
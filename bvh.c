@@ -0,0 +1,870 @@
+#include "bvh.h"
+#include "memory.h"
+#include "utils.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+// each axis gets 21 bits of the code
+#define MORTON_BITS 21
+// a node per level, plus its siblings
+#define BVH_STACK_SIZE 128
+// the child of nodes which bvh_build_lazy left to be split
+#define BVH_UNBUILT UINT32_MAX
+// levels which bvh_build_lazy builds up front
+#define BVH_EAGER_DEPTH 8
+
+/*
+** What lazily built hierarchies need to split their nodes, which lives
+** as long as they do.
+*/
+struct bvh_lazy
+{
+    // taken to split a node, never to traverse one
+    pthread_mutex_t lock;
+    // indexed from the first sphere of the hierarchy
+    uint64_t *codes;
+    // the nodes split since the build, and their area once built
+    size_t node_count;
+    double area;
+};
+
+/*
+** Spreads the low 21 bits of x so that two zero bits separate each one.
+*/
+static uint64_t morton_expand(uint64_t x)
+{
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffff;
+    x = (x | x << 16) & 0x1f0000ff0000ff;
+    x = (x | x << 8) & 0x100f00f00f00f00f;
+    x = (x | x << 4) & 0x10c30c30c30c30c3;
+    x = (x | x << 2) & 0x1249249249249249;
+    return x;
+}
+
+static uint64_t morton_quantize(double value, double min, double extent)
+{
+    double max_cell = (1 << MORTON_BITS) - 1;
+    if (extent <= 0)
+        return 0;
+    return (value - min) / extent * max_cell;
+}
+
+void bvh_morton_codes(uint64_t *codes, const struct sphere *spheres,
+                      size_t count)
+{
+    struct vec3 min = {INFINITY, INFINITY, INFINITY};
+    struct vec3 max = {-INFINITY, -INFINITY, -INFINITY};
+    for (size_t i = 0; i < count; i++)
+    {
+        const struct vec3 *center = &spheres[i].center;
+        min.x = fmin(min.x, center->x);
+        min.y = fmin(min.y, center->y);
+        min.z = fmin(min.z, center->z);
+        max.x = fmax(max.x, center->x);
+        max.y = fmax(max.y, center->y);
+        max.z = fmax(max.z, center->z);
+    }
+
+    struct vec3 extent = vec3_sub(&max, &min);
+    for (size_t i = 0; i < count; i++)
+    {
+        const struct vec3 *center = &spheres[i].center;
+        uint64_t x = morton_quantize(center->x, min.x, extent.x);
+        uint64_t y = morton_quantize(center->y, min.y, extent.y);
+        uint64_t z = morton_quantize(center->z, min.z, extent.z);
+        codes[i] = morton_expand(x) << 2 | morton_expand(y) << 1
+                   | morton_expand(z);
+    }
+}
+
+struct bvh_builder
+{
+    struct bvh *bvh;
+    const struct sphere *spheres;
+    // indexed from the first sphere of the hierarchy
+    const uint64_t *codes;
+};
+
+/*
+** Splits the range where the highest bit which differs between its first
+** and last codes flips. All codes before the split share a longer prefix,
+** and so do the codes after it. Identical codes are split in the middle.
+*/
+static size_t find_split(const uint64_t *codes, size_t first, size_t last)
+{
+    uint64_t first_code = codes[first];
+    uint64_t last_code = codes[last - 1];
+    if (first_code == last_code)
+        return (first + last) / 2;
+
+    int prefix = __builtin_clzll(first_code ^ last_code);
+    // the first index whose code shares less than prefix bits with the
+    // first code
+    size_t low = first;
+    size_t high = last - 1;
+    while (high - low > 1)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (__builtin_clzll(first_code ^ codes[mid]) > prefix)
+            low = mid;
+        else
+            high = mid;
+    }
+    return high;
+}
+
+static void node_bounds_from_spheres(struct bvh_node *node,
+                                     const struct sphere *spheres)
+{
+    node->min = (struct vec3){INFINITY, INFINITY, INFINITY};
+    node->max = (struct vec3){-INFINITY, -INFINITY, -INFINITY};
+    for (size_t i = node->first; i < node->first + node->count; i++)
+    {
+        const struct sphere *sphere = &spheres[i];
+        node->min.x = fmin(node->min.x, sphere->center.x - sphere->radius);
+        node->min.y = fmin(node->min.y, sphere->center.y - sphere->radius);
+        node->min.z = fmin(node->min.z, sphere->center.z - sphere->radius);
+        node->max.x = fmax(node->max.x, sphere->center.x + sphere->radius);
+        node->max.y = fmax(node->max.y, sphere->center.y + sphere->radius);
+        node->max.z = fmax(node->max.z, sphere->center.z + sphere->radius);
+    }
+}
+
+static void node_bounds_from_children(struct bvh_node *node,
+                                      const struct bvh_node *left,
+                                      const struct bvh_node *right)
+{
+    node->min.x = fmin(left->min.x, right->min.x);
+    node->min.y = fmin(left->min.y, right->min.y);
+    node->min.z = fmin(left->min.z, right->min.z);
+    node->max.x = fmax(left->max.x, right->max.x);
+    node->max.y = fmax(left->max.y, right->max.y);
+    node->max.z = fmax(left->max.z, right->max.z);
+}
+
+static double node_area(const struct bvh_node *node)
+{
+    // empty leaves have inverted bounds
+    if (node->min.x > node->max.x)
+        return 0;
+
+    struct vec3 extent = vec3_sub(&node->max, &node->min);
+    return 2
+           * (extent.x * extent.y + extent.y * extent.z
+              + extent.z * extent.x);
+}
+
+/*
+** Leaves point to the deepest node built over each of their spheres, which
+** is only above the leaf while the hierarchy is built lazily.
+*/
+static void init_leaf(const struct bvh *bvh, const struct sphere *spheres,
+                      size_t index, uint32_t child)
+{
+    struct bvh_node *node = &bvh->nodes[index];
+    node->child = child;
+    node_bounds_from_spheres(node, spheres);
+    for (size_t i = node->first; i < node->first + node->count; i++)
+        bvh->leaves[i - bvh->first] = index;
+}
+
+/*
+** Fills the two children of a node, at index child. They are left to be
+** built.
+*/
+static void split_node(const struct bvh *bvh, const uint64_t *codes,
+                       size_t index, size_t child)
+{
+    struct bvh_node *nodes = bvh->nodes;
+    size_t first = nodes[index].first;
+    size_t last = first + nodes[index].count;
+    size_t split
+        = find_split(codes, first - bvh->first, last - bvh->first)
+          + bvh->first;
+
+    nodes[child] = (struct bvh_node){
+        .first = first,
+        .count = split - first,
+        .parent = index,
+    };
+    nodes[child + 1] = (struct bvh_node){
+        .first = split,
+        .count = last - split,
+        .parent = index,
+    };
+}
+
+/*
+** Nodes deeper than depth are left unbuilt.
+*/
+static void build_node(struct bvh_builder *builder, size_t index,
+                       size_t depth)
+{
+    struct bvh *bvh = builder->bvh;
+    struct bvh_node *nodes = bvh->nodes;
+    struct bvh_node *node = &nodes[index];
+    if (node->count <= BVH_LEAF_SIZE || depth == 0)
+    {
+        init_leaf(bvh, builder->spheres, index,
+                  node->count <= BVH_LEAF_SIZE ? 0 : BVH_UNBUILT);
+        bvh->area += node_area(node);
+        return;
+    }
+
+    size_t child = bvh->node_count;
+    bvh->node_count += 2;
+    split_node(bvh, builder->codes, index, child);
+    node->child = child;
+
+    build_node(builder, child, depth - 1);
+    build_node(builder, child + 1, depth - 1);
+    node_bounds_from_children(node, &nodes[child], &nodes[child + 1]);
+    bvh->area += node_area(node);
+}
+
+/*
+** Returns the codes, which the caller frees.
+*/
+static uint64_t *build(struct bvh *bvh, const struct sphere *spheres,
+                       size_t first, size_t count, size_t depth)
+{
+    *bvh = (struct bvh){.first = first, .count = count};
+    if (count == 0)
+        return NULL;
+
+    // codes are indexed from first, like leaves
+    uint64_t *codes
+        = memory_alloc(MEMORY_ACCELERATION, sizeof(*codes) * count);
+    bvh_morton_codes(codes, spheres + first, count);
+
+    // a binary tree with at least a sphere per leaf
+    bvh->nodes = memory_alloc(MEMORY_ACCELERATION,
+                              sizeof(*bvh->nodes) * (2 * count - 1));
+    bvh->nodes[0] = (struct bvh_node){.first = first, .count = count};
+    bvh->node_count = 1;
+    bvh->leaves
+        = memory_alloc(MEMORY_ACCELERATION, sizeof(*bvh->leaves) * count);
+
+    struct bvh_builder builder = {
+        .bvh = bvh,
+        .spheres = spheres,
+        .codes = codes,
+    };
+    build_node(&builder, 0, depth);
+    bvh->built_area = bvh->area;
+    return codes;
+}
+
+void bvh_build(struct bvh *bvh, const struct sphere *spheres, size_t first,
+               size_t count)
+{
+    memory_free(build(bvh, spheres, first, count, SIZE_MAX));
+}
+
+void bvh_build_lazy(struct bvh *bvh, const struct sphere *spheres,
+                    size_t first, size_t count)
+{
+    uint64_t *codes = build(bvh, spheres, first, count, BVH_EAGER_DEPTH);
+    if (codes == NULL)
+        return;
+
+    bvh->lazy = memory_alloc(MEMORY_ACCELERATION, sizeof(*bvh->lazy));
+    *bvh->lazy = (struct bvh_lazy){.codes = codes};
+    pthread_mutex_init(&bvh->lazy->lock, NULL);
+}
+
+/*
+** Splits an unbuilt node, whose children are published once complete.
+** Nodes which removals left too small become leaves instead.
+*/
+static uint32_t build_children(const struct bvh *bvh,
+                               const struct sphere *spheres, size_t index)
+{
+    struct bvh_lazy *lazy = bvh->lazy;
+    uint32_t child = 0;
+    if (bvh->nodes[index].count > BVH_LEAF_SIZE)
+    {
+        child = bvh->node_count + lazy->node_count;
+        lazy->node_count += 2;
+        split_node(bvh, lazy->codes, index, child);
+        for (size_t i = child; i < child + 2; i++)
+        {
+            struct bvh_node *node = &bvh->nodes[i];
+            init_leaf(bvh, spheres, i,
+                      node->count <= BVH_LEAF_SIZE ? 0 : BVH_UNBUILT);
+            lazy->area += node_area(node);
+        }
+    }
+    __atomic_store_n(&bvh->nodes[index].child, child, __ATOMIC_RELEASE);
+    return child;
+}
+
+/*
+** Returns the index of the first child of a node, or 0 for leaves. Unbuilt
+** nodes are split by the first thread to reach them, while others wait.
+*/
+static uint32_t node_child(const struct bvh *bvh,
+                           const struct sphere *spheres, size_t index)
+{
+    uint32_t child
+        = __atomic_load_n(&bvh->nodes[index].child, __ATOMIC_ACQUIRE);
+    if (child != BVH_UNBUILT)
+        return child;
+
+    pthread_mutex_lock(&bvh->lazy->lock);
+    child = bvh->nodes[index].child;
+    if (child == BVH_UNBUILT)
+        child = build_children(bvh, spheres, index);
+    pthread_mutex_unlock(&bvh->lazy->lock);
+    return child;
+}
+
+void bvh_destroy(struct bvh *bvh)
+{
+    if (bvh->mapping != NULL)
+    {
+        munmap(bvh->mapping, bvh->mapping_size);
+        return;
+    }
+    memory_free(bvh->nodes);
+    memory_free(bvh->leaves);
+    if (bvh->lazy != NULL)
+    {
+        pthread_mutex_destroy(&bvh->lazy->lock);
+        memory_free(bvh->lazy->codes);
+        memory_free(bvh->lazy);
+    }
+}
+
+struct bvh_walk_entry
+{
+    uint32_t node;
+    uint32_t depth;
+};
+
+/*
+** Checks that the children of a node follow it, point back at it, and
+** split its spheres between them.
+*/
+static bool children_valid(const struct bvh *bvh, size_t index)
+{
+    const struct bvh_node *node = &bvh->nodes[index];
+    size_t child = node->child;
+    if (child <= index || child >= bvh->node_count - 1)
+        return false;
+
+    const struct bvh_node *left = &bvh->nodes[child];
+    const struct bvh_node *right = &bvh->nodes[child + 1];
+    return left->parent == index && right->parent == index
+           && left->first == node->first
+           && left->count <= node->count
+           && right->first == node->first + left->count
+           && right->count == node->count - left->count;
+}
+
+bool bvh_valid(const struct bvh *bvh)
+{
+    size_t count = bvh->count;
+    size_t node_count = bvh->node_count;
+    if (node_count == 0)
+        return count == 0;
+
+    const struct bvh_node *root = &bvh->nodes[0];
+    if (root->first != bvh->first || root->count != count
+        || root->parent != 0)
+        return false;
+
+    // the same walk as traversals, which must not overflow their stack.
+    // Children always come after their parent, and name it, so that no
+    // node can be reached twice
+    struct bvh_walk_entry stack[BVH_STACK_SIZE];
+    size_t stack_size = 0;
+    size_t visited = 0;
+    stack[stack_size++] = (struct bvh_walk_entry){.node = 0, .depth = 0};
+    while (stack_size)
+    {
+        struct bvh_walk_entry entry = stack[--stack_size];
+        visited++;
+
+        uint32_t child = bvh->nodes[entry.node].child;
+        if (child == 0)
+            continue;
+        if (entry.depth + 1 >= BVH_STACK_SIZE
+            || !children_valid(bvh, entry.node))
+            return false;
+        stack[stack_size++] = (struct bvh_walk_entry){
+            .node = child + 1,
+            .depth = entry.depth + 1,
+        };
+        stack[stack_size++] = (struct bvh_walk_entry){
+            .node = child,
+            .depth = entry.depth + 1,
+        };
+    }
+
+    // unreachable nodes could have parents which lead nowhere, or back to
+    // themselves, which refits would follow
+    if (visited != node_count)
+        return false;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t leaf = bvh->leaves[i];
+        if (leaf >= node_count)
+            return false;
+        const struct bvh_node *node = &bvh->nodes[leaf];
+        size_t index = bvh->first + i;
+        if (node->child != 0 || index < node->first
+            || index - node->first >= node->count)
+            return false;
+    }
+    return true;
+}
+
+double bvh_degradation(const struct bvh *bvh)
+{
+    // nodes split lazily count as if they were built up front
+    double area = bvh->area;
+    double built_area = bvh->built_area;
+    if (bvh->lazy != NULL)
+    {
+        area += bvh->lazy->area;
+        built_area += bvh->lazy->area;
+    }
+    if (built_area <= 0)
+        return 1;
+    return area / built_area;
+}
+
+static bool vec3_equal(const struct vec3 *a, const struct vec3 *b)
+{
+    return a->x == b->x && a->y == b->y && a->z == b->z;
+}
+
+/*
+** Recomputes the bounds of a leaf, then of its ancestors, up to the first
+** one which doesn't change.
+*/
+static void refit_leaf(struct bvh *bvh, const struct sphere *spheres,
+                       size_t index)
+{
+    struct bvh_node *node = &bvh->nodes[index];
+    bvh->area -= node_area(node);
+    node_bounds_from_spheres(node, spheres);
+    bvh->area += node_area(node);
+
+    while (index != 0)
+    {
+        index = node->parent;
+        node = &bvh->nodes[index];
+        struct bvh_node prev = *node;
+        node_bounds_from_children(node, &bvh->nodes[node->child],
+                                  &bvh->nodes[node->child + 1]);
+        if (vec3_equal(&prev.min, &node->min)
+            && vec3_equal(&prev.max, &node->max))
+            break;
+        bvh->area += node_area(node) - node_area(&prev);
+    }
+}
+
+void bvh_refit(struct bvh *bvh, const struct sphere *spheres, size_t index)
+{
+    refit_leaf(bvh, spheres, bvh->leaves[index - bvh->first]);
+}
+
+void bvh_remove_last(struct bvh *bvh, const struct sphere *spheres)
+{
+    // leaves cover consecutive ranges, so the last one ends with the last
+    // sphere. Its ancestors keep their count, which only matters to builds
+    size_t leaf = bvh->leaves[--bvh->count];
+    bvh->nodes[leaf].count--;
+    refit_leaf(bvh, spheres, leaf);
+}
+
+/*
+** The ray, prepared for box tests.
+*/
+struct bvh_ray
+{
+    const struct ray *ray;
+    struct vec3 inv_direction;
+};
+
+static void bvh_ray_init(struct bvh_ray *res, const struct ray *ray)
+{
+    res->ray = ray;
+    res->inv_direction = (struct vec3){
+        1. / ray->direction.x,
+        1. / ray->direction.y,
+        1. / ray->direction.z,
+    };
+}
+
+/*
+** Returns the distance at which the ray enters the box, or INFINITY if it
+** misses it, or only enters it after max_distance.
+*/
+static double node_ray_distance(const struct bvh_node *node,
+                                const struct bvh_ray *ray, double max_distance)
+{
+    const struct vec3 *source = &ray->ray->source;
+    const struct vec3 *inv = &ray->inv_direction;
+
+    double t1 = (node->min.x - source->x) * inv->x;
+    double t2 = (node->max.x - source->x) * inv->x;
+    double near = fmin(t1, t2);
+    double far = fmax(t1, t2);
+
+    t1 = (node->min.y - source->y) * inv->y;
+    t2 = (node->max.y - source->y) * inv->y;
+    near = fmax(near, fmin(t1, t2));
+    far = fmin(far, fmax(t1, t2));
+
+    t1 = (node->min.z - source->z) * inv->z;
+    t2 = (node->max.z - source->z) * inv->z;
+    near = fmax(near, fmin(t1, t2));
+    far = fmin(far, fmax(t1, t2));
+
+    if (far < 0 || near > far || near >= max_distance)
+        return INFINITY;
+    return near;
+}
+
+struct bvh_stack_entry
+{
+    uint32_t node;
+    // where the ray enters the node
+    double distance;
+};
+
+double bvh_intersect(const struct bvh *bvh, const struct sphere *spheres,
+                     const struct ray *ray, size_t *object,
+                     struct object_set *hits)
+{
+    double best_distance = INFINITY;
+    if (bvh->node_count == 0)
+        return best_distance;
+
+    struct bvh_ray bvh_ray;
+    bvh_ray_init(&bvh_ray, ray);
+
+    struct bvh_stack_entry stack[BVH_STACK_SIZE];
+    size_t stack_size = 0;
+    stack[stack_size++] = (struct bvh_stack_entry){
+        .node = 0,
+        .distance = node_ray_distance(&bvh->nodes[0], &bvh_ray, INFINITY),
+    };
+
+    while (stack_size)
+    {
+        struct bvh_stack_entry entry = stack[--stack_size];
+        // a closer hit may have been found since the node was pushed
+        if (entry.distance >= best_distance)
+            continue;
+
+        const struct bvh_node *node = &bvh->nodes[entry.node];
+        uint32_t child = node_child(bvh, spheres, entry.node);
+        if (child == 0)
+        {
+            for (size_t i = node->first; i < node->first + node->count; i++)
+            {
+                double distance = sphere_ray_distance(ray, &spheres[i]);
+                if (distance >= best_distance)
+                    continue;
+
+                if (hits != NULL)
+                    object_set_add(hits, i);
+                best_distance = distance;
+                *object = i;
+            }
+            continue;
+        }
+
+        struct bvh_stack_entry near = {
+            .node = child,
+            .distance = node_ray_distance(&bvh->nodes[child], &bvh_ray,
+                                          best_distance),
+        };
+        struct bvh_stack_entry far = {
+            .node = child + 1,
+            .distance = node_ray_distance(&bvh->nodes[child + 1], &bvh_ray,
+                                          best_distance),
+        };
+
+        // visit the closest child first, so that the other one may be
+        // skipped once a closer hit is known
+        if (far.distance < near.distance)
+        {
+            struct bvh_stack_entry tmp = near;
+            near = far;
+            far = tmp;
+        }
+
+        if (!isinf(far.distance))
+            stack[stack_size++] = far;
+        if (!isinf(near.distance))
+            stack[stack_size++] = near;
+    }
+    return best_distance;
+}
+
+/*
+** The bounds of the sources and inverse directions of the rays of a
+** packet. Each ray of the packet goes through any box it may enter.
+*/
+struct bvh_frustum
+{
+    struct vec3 source_min;
+    struct vec3 source_max;
+    struct vec3 inv_min;
+    struct vec3 inv_max;
+};
+
+/*
+** Fails if ray directions don't all have the same sign on each axis, as
+** the bounds of their inverse are then infinite.
+*/
+static bool bvh_frustum_init(struct bvh_frustum *res,
+                             const struct bvh_packet *packet)
+{
+    const struct vec3 *first_dir = &packet->rays[0]->direction;
+    if (first_dir->x == 0 || first_dir->y == 0 || first_dir->z == 0)
+        return false;
+
+    res->source_min = res->source_max = packet->rays[0]->source;
+    res->inv_min = res->inv_max = (struct vec3){
+        1. / first_dir->x,
+        1. / first_dir->y,
+        1. / first_dir->z,
+    };
+    for (size_t r = 1; r < packet->count; r++)
+    {
+        const struct ray *ray = packet->rays[r];
+        const struct vec3 *dir = &ray->direction;
+        if (dir->x * first_dir->x <= 0 || dir->y * first_dir->y <= 0
+            || dir->z * first_dir->z <= 0)
+            return false;
+
+        struct vec3 inv = {1. / dir->x, 1. / dir->y, 1. / dir->z};
+        vec3_update_min_components(&res->source_min, &ray->source);
+        vec3_update_max_components(&res->source_max, &ray->source);
+        vec3_update_min_components(&res->inv_min, &inv);
+        vec3_update_max_components(&res->inv_max, &inv);
+    }
+    return true;
+}
+
+static double interval_mul_min(double a_min, double a_max, double b_min,
+                               double b_max)
+{
+    return fmin(fmin(a_min * b_min, a_min * b_max),
+                fmin(a_max * b_min, a_max * b_max));
+}
+
+static double interval_mul_max(double a_min, double a_max, double b_min,
+                               double b_max)
+{
+    return fmax(fmax(a_min * b_min, a_min * b_max),
+                fmax(a_max * b_min, a_max * b_max));
+}
+
+/*
+** Returns a lower bound of the distance at which the rays of the packet
+** enter the box, or INFINITY if none of them can enter it before
+** max_distance.
+*/
+static double frustum_box_distance(const struct bvh_frustum *frustum,
+                                   const struct vec3 *box_min,
+                                   const struct vec3 *box_max,
+                                   double max_distance)
+{
+    const double *source_min = &frustum->source_min.x;
+    const double *source_max = &frustum->source_max.x;
+    const double *inv_min = &frustum->inv_min.x;
+    const double *inv_max = &frustum->inv_max.x;
+
+    double near = -INFINITY;
+    double far = INFINITY;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        // rays enter the slab on the side they come from
+        double enter = (&box_min->x)[axis];
+        double leave = (&box_max->x)[axis];
+        if (inv_min[axis] < 0)
+        {
+            enter = (&box_max->x)[axis];
+            leave = (&box_min->x)[axis];
+        }
+
+        near = fmax(near, interval_mul_min(enter - source_max[axis],
+                                           enter - source_min[axis],
+                                           inv_min[axis], inv_max[axis]));
+        far = fmin(far, interval_mul_max(leave - source_max[axis],
+                                         leave - source_min[axis],
+                                         inv_min[axis], inv_max[axis]));
+    }
+
+    if (far < 0 || near > far || near >= max_distance)
+        return INFINITY;
+    return near;
+}
+
+static double packet_max_distance(const struct bvh_packet *packet)
+{
+    double res = 0;
+    for (size_t r = 0; r < packet->count; r++)
+        res = fmax(res, packet->distances[r]);
+    return res;
+}
+
+static void intersect_packet_leaf(const struct bvh_node *node,
+                                  const struct sphere *spheres,
+                                  const struct bvh_frustum *frustum,
+                                  struct bvh_packet *packet,
+                                  double max_distance,
+                                  struct object_set *hits)
+{
+    for (size_t i = node->first; i < node->first + node->count; i++)
+    {
+        const struct sphere *sphere = &spheres[i];
+        struct vec3 radius = {sphere->radius, sphere->radius, sphere->radius};
+        struct vec3 min = vec3_sub(&sphere->center, &radius);
+        struct vec3 max = vec3_add(&sphere->center, &radius);
+        if (isinf(frustum_box_distance(frustum, &min, &max, max_distance)))
+            continue;
+
+        for (size_t r = 0; r < packet->count; r++)
+        {
+            double distance = sphere_ray_distance(packet->rays[r], sphere);
+            if (distance >= packet->distances[r])
+                continue;
+
+            if (hits != NULL)
+                object_set_add(hits, i);
+            packet->distances[r] = distance;
+            packet->objects[r] = i;
+        }
+    }
+}
+
+void bvh_intersect_packet(const struct bvh *bvh, const struct sphere *spheres,
+                          struct bvh_packet *packet, struct object_set *hits)
+{
+    if (bvh->node_count == 0 || packet->count == 0)
+        return;
+
+    struct bvh_frustum frustum;
+    if (!bvh_frustum_init(&frustum, packet))
+    {
+        for (size_t r = 0; r < packet->count; r++)
+        {
+            size_t object;
+            double distance = bvh_intersect(bvh, spheres, packet->rays[r],
+                                            &object, hits);
+            if (distance >= packet->distances[r])
+                continue;
+
+            packet->distances[r] = distance;
+            packet->objects[r] = object;
+        }
+        return;
+    }
+
+    // nodes are skipped once all rays hit something closer
+    double max_distance = packet_max_distance(packet);
+    struct bvh_stack_entry stack[BVH_STACK_SIZE];
+    size_t stack_size = 0;
+    stack[stack_size++] = (struct bvh_stack_entry){
+        .node = 0,
+        .distance = frustum_box_distance(&frustum, &bvh->nodes[0].min,
+                                         &bvh->nodes[0].max, max_distance),
+    };
+
+    while (stack_size)
+    {
+        struct bvh_stack_entry entry = stack[--stack_size];
+        if (entry.distance >= max_distance)
+            continue;
+
+        const struct bvh_node *node = &bvh->nodes[entry.node];
+        uint32_t child = node_child(bvh, spheres, entry.node);
+        if (child == 0)
+        {
+            intersect_packet_leaf(node, spheres, &frustum, packet,
+                                  max_distance, hits);
+            max_distance = packet_max_distance(packet);
+            continue;
+        }
+
+        const struct bvh_node *left = &bvh->nodes[child];
+        const struct bvh_node *right = &bvh->nodes[child + 1];
+        struct bvh_stack_entry near = {
+            .node = child,
+            .distance = frustum_box_distance(&frustum, &left->min,
+                                             &left->max, max_distance),
+        };
+        struct bvh_stack_entry far = {
+            .node = child + 1,
+            .distance = frustum_box_distance(&frustum, &right->min,
+                                             &right->max, max_distance),
+        };
+
+        if (far.distance < near.distance)
+        {
+            struct bvh_stack_entry tmp = near;
+            near = far;
+            far = tmp;
+        }
+
+        if (!isinf(far.distance))
+            stack[stack_size++] = far;
+        if (!isinf(near.distance))
+            stack[stack_size++] = near;
+    }
+}
+
+bool bvh_occluded(const struct bvh *bvh, const struct sphere *spheres,
+                  const struct ray *ray, double max_distance,
+                  size_t *occluder, struct object_set *hits)
+{
+    if (bvh->node_count == 0)
+        return false;
+
+    struct bvh_ray bvh_ray;
+    bvh_ray_init(&bvh_ray, ray);
+
+    uint32_t stack[BVH_STACK_SIZE];
+    size_t stack_size = 0;
+    stack[stack_size++] = 0;
+    while (stack_size)
+    {
+        uint32_t index = stack[--stack_size];
+        const struct bvh_node *node = &bvh->nodes[index];
+        if (isinf(node_ray_distance(node, &bvh_ray, max_distance)))
+            continue;
+
+        uint32_t child = node_child(bvh, spheres, index);
+        if (child == 0)
+        {
+            for (size_t i = node->first; i < node->first + node->count; i++)
+            {
+                if (sphere_ray_distance(ray, &spheres[i]) >= max_distance)
+                    continue;
+                if (hits != NULL)
+                    object_set_add(hits, i);
+                *occluder = i;
+                return true;
+            }
+            continue;
+        }
+
+        // any hit will do, order doesn't matter
+        stack[stack_size++] = child + 1;
+        stack[stack_size++] = child;
+    }
+    return false;
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include "object_set.h"
+#include "ray.h"
+#include "sphere.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BVH_LEAF_SIZE 4
+// the most rays traced together by bvh_intersect_packet
+#define BVH_PACKET_SIZE 64
+
+/*
+** A bounding volume hierarchy over spheres sorted along a Morton curve.
+** Since spheres which are close in space are also close in memory, each
+** node covers a contiguous range of spheres.
+*/
+struct bvh_node
+{
+    struct vec3 min;
+    struct vec3 max;
+    // the spheres below this node are [first, first + count)
+    uint32_t first;
+    uint32_t count;
+    // the index of the left child, which the right child follows. Leaves
+    // have none, and use 0, as the root is nobody's child
+    uint32_t child;
+    // the root is its own parent
+    uint32_t parent;
+};
+
+struct bvh
+{
+    struct bvh_node *nodes;
+    size_t node_count;
+    // the spheres covered are [first, first + count)
+    size_t first;
+    size_t count;
+    // the leaf holding each sphere, or the deepest node built over it so
+    // far, by index from first
+    uint32_t *leaves;
+    // set by bvh_build_lazy, whose nodes are split as rays reach them.
+    // node_count only counts those built up front
+    struct bvh_lazy *lazy;
+    // the total surface area of the nodes, which grows as refits make
+    // the hierarchy looser than when it was built
+    double area;
+    double built_area;
+    // set when nodes and leaves were loaded by bvh_cache_load, and live in
+    // a private mapping of the cache file
+    void *mapping;
+    size_t mapping_size;
+};
+
+/*
+** Computes the position of each sphere center along a Morton curve which
+** covers the bounds of all centers.
+*/
+void bvh_morton_codes(uint64_t *codes, const struct sphere *spheres,
+                      size_t count);
+
+/*
+** Builds the hierarchy over spheres [first, first + count), which must be
+** sorted by Morton code.
+*/
+void bvh_build(struct bvh *bvh, const struct sphere *spheres, size_t first,
+               size_t count);
+
+/*
+** Like bvh_build, but only builds the top levels, and leaves the nodes
+** below to the first traversal which reaches them, so that parts of the
+** scene no ray goes near are never built. Traversals may run on several
+** threads at once, but not along with edits. Hierarchies built this way
+** can't be saved, as they are never complete.
+*/
+void bvh_build_lazy(struct bvh *bvh, const struct sphere *spheres,
+                    size_t first, size_t count);
+void bvh_destroy(struct bvh *bvh);
+
+/*
+** Updates the bounds of the leaf holding a sphere which was moved or
+** replaced, and of its ancestors. The hierarchy keeps its shape, so that
+** it gets looser as spheres move away from where it was built.
+*/
+void bvh_refit(struct bvh *bvh, const struct sphere *spheres, size_t index);
+
+/*
+** Stops covering the last sphere.
+*/
+void bvh_remove_last(struct bvh *bvh, const struct sphere *spheres);
+
+/*
+** Checks that a hierarchy read from a file is a tree over its spheres, no
+** deeper than traversals can go, whose leaves are where leaves says, so
+** that a damaged file can't send traversals astray or loop forever.
+*/
+bool bvh_valid(const struct bvh *bvh);
+
+/*
+** Returns how much looser than when it was built the hierarchy got, as a
+** ratio of surface areas. Ray traversal costs about as much more.
+*/
+double bvh_degradation(const struct bvh *bvh);
+
+/*
+** Finds the closest sphere hit by the ray, like scene_intersect. Returns
+** INFINITY if none is hit. If hits is not NULL, the spheres the ray hit
+** on the way are added to it.
+*/
+double bvh_intersect(const struct bvh *bvh, const struct sphere *spheres,
+                     const struct ray *ray, size_t *object,
+                     struct object_set *hits);
+
+/*
+** Rays which start and go in about the same direction, such as the camera
+** rays of a block of pixels, which can share node fetches. Results are
+** kept as long as no closer hit is found, which lets several hierarchies
+** be traced in turn.
+*/
+struct bvh_packet
+{
+    const struct ray *rays[BVH_PACKET_SIZE];
+    // INFINITY until something is hit
+    double distances[BVH_PACKET_SIZE];
+    size_t objects[BVH_PACKET_SIZE];
+    size_t count;
+};
+
+/*
+** Like bvh_intersect, for all rays of the packet at once. Nodes and spheres
+** are culled against the bounds of the packet, using interval arithmetic.
+** Packets whose directions don't all point into the same octant have no
+** useful bounds, and fall back to tracing rays one by one.
+*/
+void bvh_intersect_packet(const struct bvh *bvh, const struct sphere *spheres,
+                          struct bvh_packet *packet, struct object_set *hits);
+
+/*
+** Returns whether any sphere blocks the ray before max_distance, and
+** stores the first one found in occluder.
+*/
+bool bvh_occluded(const struct bvh *bvh, const struct sphere *spheres,
+                  const struct ray *ray, double max_distance,
+                  size_t *occluder, struct object_set *hits);
@@ -0,0 +1,227 @@
+#include "bvh_cache.h"
+
+#include "rng.h"
+#include "utils.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BVH_CACHE_MAGIC "rt-bvh\0"
+#define BVH_CACHE_VERSION 1
+// sections start on cache lines
+#define BVH_CACHE_ALIGN 64
+
+struct cache_header
+{
+    char magic[8];
+    uint32_t version;
+    // nodes are stored as they are in memory, and only fit the same build
+    uint32_t node_size;
+    uint64_t key;
+    uint64_t first;
+    uint64_t count;
+    uint64_t node_count;
+    double area;
+    double built_area;
+    // from the start of the file
+    uint64_t order_offset;
+    uint64_t nodes_offset;
+    uint64_t leaves_offset;
+};
+
+uint64_t bvh_cache_key(const struct sphere *spheres, size_t count)
+{
+    uint64_t res = rng_mix(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        const double values[] = {
+            spheres[i].center.x,
+            spheres[i].center.y,
+            spheres[i].center.z,
+            spheres[i].radius,
+        };
+        for (size_t k = 0; k < sizeof(values) / sizeof(values[0]); k++)
+        {
+            uint64_t bits;
+            memcpy(&bits, &values[k], sizeof(bits));
+            res = rng_mix(res ^ bits);
+        }
+    }
+    return res;
+}
+
+static char *cache_path(const char *dir, uint64_t key)
+{
+    size_t size = strlen(dir) + sizeof("/0123456789abcdef.bvh");
+    char *res = xalloc(size);
+    snprintf(res, size, "%s/%016" PRIx64 ".bvh", dir, key);
+    return res;
+}
+
+static bool section_fits(uint64_t offset, uint64_t size, size_t file_size)
+{
+    return offset % BVH_CACHE_ALIGN == 0 && offset <= file_size
+           && size <= file_size - offset;
+}
+
+/*
+** Checks that indices stay within the file, and that nodes form a tree
+** traversals can walk, so that a damaged or stale file is built again
+** rather than crashing or hanging the render.
+*/
+static bool cache_valid(const struct cache_header *header,
+                        const uint32_t *order, struct bvh_node *nodes,
+                        uint32_t *leaves)
+{
+    // order must be a permutation, or spheres would be lost and others
+    // duplicated when reordered
+    size_t count = header->count;
+    size_t word_count = (count + 63) / 64;
+    uint64_t *seen = xalloc(sizeof(*seen) * word_count);
+    memset(seen, 0, sizeof(*seen) * word_count);
+    bool permutation = true;
+    for (size_t i = 0; i < count && permutation; i++)
+    {
+        uint32_t index = order[i];
+        uint64_t bit = UINT64_C(1) << (index % 64);
+        permutation = index < count && !(seen[index / 64] & bit);
+        if (permutation)
+            seen[index / 64] |= bit;
+    }
+    free(seen);
+    if (!permutation)
+        return false;
+
+    struct bvh bvh = {
+        .nodes = nodes,
+        .node_count = header->node_count,
+        .first = header->first,
+        .count = count,
+        .leaves = leaves,
+    };
+    return bvh_valid(&bvh);
+}
+
+bool bvh_cache_load(struct bvh *bvh, const uint32_t **order, const char *dir,
+                    uint64_t key, size_t first, size_t count)
+{
+    char *path = cache_path(dir, key);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        if (errno != ENOENT)
+            warn("failed to open %s", path);
+        free(path);
+        return false;
+    }
+
+    // refits write to the pages of their own copy
+    struct stat st;
+    void *mapping = MAP_FAILED;
+    if (fstat(fd, &st) == 0
+        && (size_t)st.st_size >= sizeof(struct cache_header))
+        mapping = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                       fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        warnx("%s: not a hierarchy cache", path);
+        free(path);
+        return false;
+    }
+
+    size_t size = st.st_size;
+    const struct cache_header *header = mapping;
+    char *base = mapping;
+    bool valid
+        = memcmp(header->magic, BVH_CACHE_MAGIC, sizeof(header->magic)) == 0
+          && header->version == BVH_CACHE_VERSION
+          && header->node_size == sizeof(struct bvh_node)
+          && header->key == key && header->first == first
+          && header->count == count && header->count > 0
+          && header->node_count > 0 && header->node_count < 2 * count
+          && section_fits(header->order_offset, count * sizeof(**order), size)
+          && section_fits(header->nodes_offset,
+                          header->node_count * sizeof(*bvh->nodes), size)
+          && section_fits(header->leaves_offset,
+                          count * sizeof(*bvh->leaves), size)
+          && cache_valid(header, (uint32_t *)(base + header->order_offset),
+                         (struct bvh_node *)(base + header->nodes_offset),
+                         (uint32_t *)(base + header->leaves_offset));
+    if (!valid)
+    {
+        warnx("%s: invalid hierarchy cache, building again", path);
+        munmap(mapping, size);
+        free(path);
+        return false;
+    }
+
+    *bvh = (struct bvh){
+        .nodes = (struct bvh_node *)(base + header->nodes_offset),
+        .node_count = header->node_count,
+        .first = first,
+        .count = count,
+        .leaves = (uint32_t *)(base + header->leaves_offset),
+        .area = header->area,
+        .built_area = header->built_area,
+        .mapping = mapping,
+        .mapping_size = size,
+    };
+    *order = (uint32_t *)(base + header->order_offset);
+    free(path);
+    return true;
+}
+
+void bvh_cache_store(const struct bvh *bvh, const uint32_t *order,
+                     const char *dir, uint64_t key)
+{
+    size_t count = bvh->count;
+    struct cache_header header = {
+        .version = BVH_CACHE_VERSION,
+        .node_size = sizeof(*bvh->nodes),
+        .key = key,
+        .first = bvh->first,
+        .count = count,
+        .node_count = bvh->node_count,
+        .area = bvh->area,
+        .built_area = bvh->built_area,
+    };
+    memcpy(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic));
+    header.order_offset = align_up(sizeof(header), BVH_CACHE_ALIGN);
+    header.nodes_offset = align_up(
+        header.order_offset + count * sizeof(*order), BVH_CACHE_ALIGN);
+    header.leaves_offset
+        = align_up(header.nodes_offset + bvh->node_count * sizeof(*bvh->nodes),
+                   BVH_CACHE_ALIGN);
+
+    // the hierarchy is built either way, and only the next run pays for a
+    // cache which can't be written
+    char *path = cache_path(dir, key);
+    char *tmp_path;
+    FILE *fp = replace_file_open(path, &tmp_path);
+    if (fp == NULL)
+        warn("failed to create a file next to %s", path);
+    else if (fwrite(&header, sizeof(header), 1, fp) != 1
+        || fseek(fp, header.order_offset, SEEK_SET) != 0
+        || fwrite(order, sizeof(*order), count, fp) != count
+        || fseek(fp, header.nodes_offset, SEEK_SET) != 0
+        || fwrite(bvh->nodes, sizeof(*bvh->nodes), bvh->node_count, fp)
+               != bvh->node_count
+        || fseek(fp, header.leaves_offset, SEEK_SET) != 0
+        || fwrite(bvh->leaves, sizeof(*bvh->leaves), count, fp) != count)
+    {
+        warn("failed to write %s", tmp_path);
+        replace_file_abort(fp, tmp_path);
+    }
+    else if (replace_file_commit(fp, tmp_path, path) != 0)
+        warn("failed to write %s", path);
+    free(path);
+}
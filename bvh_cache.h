@@ -0,0 +1,33 @@
+#pragma once
+
+#include "bvh.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+** Hierarchies saved in files named after a hash of the spheres they were
+** built over, along with the order these were sorted in, so that scenes
+** prepared before skip both the sort and the build. Files are mapped,
+** and used in place: pages are only copied once a refit writes to them.
+*/
+
+/*
+** Hashes the geometry of spheres, in order. Materials don't matter.
+*/
+uint64_t bvh_cache_key(const struct sphere *spheres, size_t count);
+
+/*
+** Loads the hierarchy built over count spheres with the given key, whose
+** first sphere has index first. order[i] is the index from first which
+** sphere i had before sorting, and lives as long as the hierarchy. Returns
+** false if the directory holds no valid hierarchy for this key.
+*/
+bool bvh_cache_load(struct bvh *bvh, const uint32_t **order, const char *dir,
+                    uint64_t key, size_t first, size_t count);
+
+/*
+** Saves a hierarchy, along with the order of its spheres.
+*/
+void bvh_cache_store(const struct bvh *bvh, const uint32_t *order,
+                     const char *dir, uint64_t key);
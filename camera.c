@@ -0,0 +1,83 @@
+#include "camera.h"
+
+#include <math.h>
+
+double focal_distance_from_fov(double width, double fov_deg)
+{
+    // convert from degrees to radians
+    double fov_rad = fov_deg * M_PI / (360 / 2);
+    return (width / 2) / tan(fov_rad / 2);
+}
+
+/*
+** The camera is a physical object in its own right, positioned in space just like
+** any other. When casting a ray, the raytracer must express the coordinates of the
+** starting point of the ray, relative to the image plane defined by the camera.
+**
+** One way to do it is to define the bottom left corner of the image plane to be at
+** (-0.5, 0.5), its center to be at (0, 0), and its top right corner to be at (0.5,
+** 0.5).
+**
+** This way, the camera doesn't have to know about the dimensions of the output
+** image: it just traces rays where asked to.
+**
+**  (x=-0.5, y=0.5)                (x=0.5, y=0.5)
+**        +------------------------------+
+**        |                              |
+**        |              ^ y             |
+**        |              |               |
+**        |              +---> x         |
+**        |            center            |
+**        |                              |
+**        |                              |
+**        +------------------------------+
+** (x=-0.5, y=-0.5)                (x=0.5, y=-0.5)
+*/
+void camera_cast_ray(struct ray *ray, const struct camera *camera, double cam_x,
+                     double cam_y)
+{
+    // translate relative position inside the image plane
+    // into absolute position into the image plane.
+    double x_coeff = cam_x * camera->width;
+    double y_coeff = cam_y * camera->height;
+
+    struct vec3 right = vec3_cross(&camera->forward, &camera->up);
+    // right_offset = right * x_coeff
+    struct vec3 right_offset = vec3_mul(&right, x_coeff);
+    // up_offset = up * y_coeff
+    struct vec3 up_offset = vec3_mul(&camera->up, y_coeff);
+    // offset = right_offset + up_offset
+    struct vec3 offset = vec3_add(&right_offset, &up_offset);
+    // ray->source = center + offset
+    ray->source = vec3_add(&camera->center, &offset);
+
+    struct vec3 vantage_point_offset
+        = vec3_mul(&camera->forward, -camera->focal_distance);
+    struct vec3 vantage_point
+        = vec3_add(&vantage_point_offset, &camera->center);
+    ray->direction = vec3_sub(&ray->source, &vantage_point);
+    vec3_normalize(&ray->direction);
+}
+
+bool camera_project(const struct camera *camera, const struct vec3 *point,
+                    double *cam_x, double *cam_y, double *depth)
+{
+    struct vec3 vantage_point_offset
+        = vec3_mul(&camera->forward, -camera->focal_distance);
+    struct vec3 vantage_point
+        = vec3_add(&vantage_point_offset, &camera->center);
+    struct vec3 offset = vec3_sub(point, &vantage_point);
+
+    double forward_distance = vec3_dot(&offset, &camera->forward);
+    if (forward_distance <= camera->focal_distance)
+        return false;
+
+    // scale the offset down to the image plane
+    struct vec3 plane_offset
+        = vec3_mul(&offset, camera->focal_distance / forward_distance);
+    struct vec3 right = vec3_cross(&camera->forward, &camera->up);
+    *cam_x = vec3_dot(&plane_offset, &right) / camera->width;
+    *cam_y = vec3_dot(&plane_offset, &camera->up) / camera->height;
+    *depth = vec3_length(&offset);
+    return true;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "ray.h"
+
+#include <stdbool.h>
+
+struct camera
+{
+    struct vec3 center;
+    struct vec3 forward;
+    struct vec3 up;
+
+    double width;
+    double height;
+
+    double focal_distance;
+};
+
+double focal_distance_from_fov(double width, double fov_deg);
+
+void camera_cast_ray(struct ray *ray, const struct camera *camera, double cam_x,
+                     double cam_y);
+
+/*
+** Finds the image plane coordinates of the camera ray which goes through
+** point, the reverse of camera_cast_ray. Returns false if the point is
+** behind the image plane. depth is set to the distance from the point the
+** rays come from.
+*/
+bool camera_project(const struct camera *camera, const struct vec3 *point,
+                    double *cam_x, double *cam_y, double *depth);
@@ -0,0 +1,331 @@
+#include "exr.h"
+#include "half.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define EXR_MAGIC 20000630
+#define EXR_VERSION 2
+// the version flag of single part tiled files
+#define EXR_VERSION_TILED 0x200
+
+// the tile coordinates, level, and data size
+#define EXR_TILE_HEADER_SIZE (5 * sizeof(int32_t))
+
+/*
+** The header is built in memory, and written at once.
+*/
+struct exr_buffer
+{
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+};
+
+static void write_bytes(struct exr_buffer *buf, const void *data, size_t size)
+{
+    if (buf->size + size > buf->capacity)
+    {
+        size_t capacity = buf->capacity ? buf->capacity : 1024;
+        while (capacity < buf->size + size)
+            capacity *= 2;
+
+        uint8_t *new_data = xalloc(capacity);
+        if (buf->size)
+            memcpy(new_data, buf->data, buf->size);
+        free(buf->data);
+        buf->data = new_data;
+        buf->capacity = capacity;
+    }
+
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+}
+
+static void write_u8(struct exr_buffer *buf, uint8_t value)
+{
+    write_bytes(buf, &value, sizeof(value));
+}
+
+static void write_i32(struct exr_buffer *buf, int32_t value)
+{
+    write_bytes(buf, &value, sizeof(value));
+}
+
+static void write_u32(struct exr_buffer *buf, uint32_t value)
+{
+    write_bytes(buf, &value, sizeof(value));
+}
+
+static void write_u64(struct exr_buffer *buf, uint64_t value)
+{
+    write_bytes(buf, &value, sizeof(value));
+}
+
+static void write_f32(struct exr_buffer *buf, float value)
+{
+    write_bytes(buf, &value, sizeof(value));
+}
+
+static void write_string(struct exr_buffer *buf, const char *str)
+{
+    write_bytes(buf, str, strlen(str) + 1);
+}
+
+static void write_attribute(struct exr_buffer *buf, const char *name,
+                            const char *type, int32_t size)
+{
+    write_string(buf, name);
+    write_string(buf, type);
+    write_i32(buf, size);
+}
+
+static void write_box2i(struct exr_buffer *buf, const char *name,
+                        size_t width, size_t height)
+{
+    write_attribute(buf, name, "box2i", 16);
+    write_i32(buf, 0);
+    write_i32(buf, 0);
+    write_i32(buf, width - 1);
+    write_i32(buf, height - 1);
+}
+
+static size_t pixel_type_size(enum exr_pixel_type type)
+{
+    return type == EXR_HALF ? sizeof(uint16_t) : sizeof(float);
+}
+
+static int pwrite_all(int fd, const void *data, size_t size, uint64_t offset)
+{
+    const uint8_t *cur = data;
+    while (size)
+    {
+        ssize_t written = pwrite(fd, cur, size, offset);
+        if (written < 0)
+            return -1;
+        cur += written;
+        size -= written;
+        offset += written;
+    }
+    return 0;
+}
+
+struct exr_sorted_channel
+{
+    struct exr_channel channel;
+    size_t index;
+};
+
+static int channel_compare(const void *a, const void *b)
+{
+    const struct exr_sorted_channel *ca = a;
+    const struct exr_sorted_channel *cb = b;
+    return strcmp(ca->channel.name, cb->channel.name);
+}
+
+/*
+** Tiles are stored line by line. All lines of tiles but the last are
+** full height, and the widths of a line of tiles add up to the image width.
+*/
+static uint64_t tile_offset(const struct exr_tiled_file *file, size_t tile_x,
+                            size_t tile_y)
+{
+    size_t tile_size = file->tile_size;
+    size_t tile_height = file->height - tile_y * tile_size;
+    if (tile_height > tile_size)
+        tile_height = tile_size;
+
+    uint64_t full_line_size = file->tiles_x * EXR_TILE_HEADER_SIZE
+                              + tile_size * file->width * file->pixel_size;
+    uint64_t full_tile_size = EXR_TILE_HEADER_SIZE
+                              + tile_size * tile_height * file->pixel_size;
+    return file->data_offset + tile_y * full_line_size
+           + tile_x * full_tile_size;
+}
+
+/*
+** The size of the pixels of a tile, which are cropped on the right and
+** bottom edges.
+*/
+static size_t tile_data_size(const struct exr_tiled_file *file,
+                             size_t tile_x, size_t tile_y)
+{
+    size_t width = file->width - tile_x * file->tile_size;
+    size_t height = file->height - tile_y * file->tile_size;
+    if (width > file->tile_size)
+        width = file->tile_size;
+    if (height > file->tile_size)
+        height = file->tile_size;
+    return width * height * file->pixel_size;
+}
+
+/*
+** Gives every tile its header and zeroed pixels, up to the end of the
+** file, so that tiles which are never written still read as black.
+*/
+static int write_empty_tiles(const struct exr_tiled_file *file,
+                             size_t tiles_y)
+{
+    size_t last_x = file->tiles_x - 1;
+    size_t last_y = tiles_y - 1;
+    uint64_t end = tile_offset(file, last_x, last_y) + EXR_TILE_HEADER_SIZE
+                   + tile_data_size(file, last_x, last_y);
+    if (ftruncate(file->fd, end) != 0)
+        return -1;
+
+    for (size_t y = 0; y < tiles_y; y++)
+        for (size_t x = 0; x < file->tiles_x; x++)
+        {
+            int32_t header[5] = {x, y, 0, 0, tile_data_size(file, x, y)};
+            if (pwrite_all(file->fd, header, sizeof(header),
+                           tile_offset(file, x, y)))
+                return -1;
+        }
+    return 0;
+}
+
+int exr_tiled_open(struct exr_tiled_file *file, const char *path,
+                   const struct exr_channel *channels, size_t channel_count,
+                   size_t width, size_t height, size_t tile_size)
+{
+    // the format requires channels to be sorted by name
+    struct exr_sorted_channel *sorted = xalloc(sizeof(*sorted) * channel_count);
+    for (size_t i = 0; i < channel_count; i++)
+        sorted[i] = (struct exr_sorted_channel){channels[i], i};
+    qsort(sorted, channel_count, sizeof(*sorted), channel_compare);
+
+    file->channels = xalloc(sizeof(*file->channels) * channel_count);
+    file->channel_order = xalloc(sizeof(size_t) * channel_count);
+    file->channel_count = channel_count;
+    file->pixel_size = 0;
+    for (size_t i = 0; i < channel_count; i++)
+    {
+        file->channels[i] = sorted[i].channel;
+        file->channel_order[i] = sorted[i].index;
+        file->pixel_size += pixel_type_size(sorted[i].channel.type);
+    }
+    free(sorted);
+
+    file->width = width;
+    file->height = height;
+    file->tile_size = tile_size;
+    file->tiles_x = (width + tile_size - 1) / tile_size;
+    size_t tiles_y = (height + tile_size - 1) / tile_size;
+
+    struct exr_buffer buf = {0};
+    write_i32(&buf, EXR_MAGIC);
+    write_i32(&buf, EXR_VERSION | EXR_VERSION_TILED);
+
+    int32_t chlist_size = 1;
+    for (size_t i = 0; i < channel_count; i++)
+        chlist_size += strlen(file->channels[i].name) + 1 + 16;
+    write_attribute(&buf, "channels", "chlist", chlist_size);
+    for (size_t i = 0; i < channel_count; i++)
+    {
+        write_string(&buf, file->channels[i].name);
+        write_i32(&buf, file->channels[i].type);
+        // pLinear, then three reserved bytes
+        write_i32(&buf, 0);
+        // x and y sampling
+        write_i32(&buf, 1);
+        write_i32(&buf, 1);
+    }
+    write_u8(&buf, 0);
+
+    write_attribute(&buf, "compression", "compression", 1);
+    write_u8(&buf, 0); // NO_COMPRESSION
+    write_box2i(&buf, "dataWindow", width, height);
+    write_box2i(&buf, "displayWindow", width, height);
+    write_attribute(&buf, "lineOrder", "lineOrder", 1);
+    write_u8(&buf, 0); // INCREASING_Y
+    write_attribute(&buf, "pixelAspectRatio", "float", 4);
+    write_f32(&buf, 1);
+    write_attribute(&buf, "screenWindowCenter", "v2f", 8);
+    write_f32(&buf, 0);
+    write_f32(&buf, 0);
+    write_attribute(&buf, "screenWindowWidth", "float", 4);
+    write_f32(&buf, 1);
+    write_attribute(&buf, "tiles", "tiledesc", 9);
+    write_u32(&buf, tile_size);
+    write_u32(&buf, tile_size);
+    write_u8(&buf, 0); // ONE_LEVEL, ROUND_DOWN
+    // end of the header
+    write_u8(&buf, 0);
+
+    file->data_offset = buf.size + sizeof(uint64_t) * file->tiles_x * tiles_y;
+    for (size_t y = 0; y < tiles_y; y++)
+        for (size_t x = 0; x < file->tiles_x; x++)
+            write_u64(&buf, tile_offset(file, x, y));
+
+    // tiles are written straight to the file, which only replaces path
+    // once closed
+    int res = -1;
+    file->fp = replace_file_open(path, &file->tmp_path);
+    if (file->fp != NULL)
+    {
+        file->fd = fileno(file->fp);
+        res = pwrite_all(file->fd, buf.data, buf.size, 0);
+        if (res == 0)
+            res = write_empty_tiles(file, tiles_y);
+        if (res != 0)
+            replace_file_abort(file->fp, file->tmp_path);
+    }
+
+    free(buf.data);
+    if (res != 0)
+    {
+        free(file->channels);
+        free(file->channel_order);
+        return res;
+    }
+    file->path = strdup(path);
+    return 0;
+}
+
+int exr_tiled_write_tile(struct exr_tiled_file *file, size_t x, size_t y,
+                         const float *const *planes)
+{
+    size_t tile_x = x / file->tile_size;
+    size_t tile_y = y / file->tile_size;
+    size_t width = file->width - x;
+    size_t height = file->height - y;
+    if (width > file->tile_size)
+        width = file->tile_size;
+    if (height > file->tile_size)
+        height = file->tile_size;
+
+    size_t data_size = width * height * file->pixel_size;
+    uint8_t *chunk = xalloc(EXR_TILE_HEADER_SIZE + data_size);
+    int32_t header[5] = {tile_x, tile_y, 0, 0, data_size};
+    memcpy(chunk, header, sizeof(header));
+
+    // each line of the tile holds all its values for a channel, then
+    // moves on to the next channel
+    uint8_t *cur = chunk + EXR_TILE_HEADER_SIZE;
+    for (size_t line = 0; line < height; line++)
+        for (size_t c = 0; c < file->channel_count; c++)
+        {
+            const float *src = planes[file->channel_order[c]] + width * line;
+            if (file->channels[c].type == EXR_HALF)
+                half_from_float_array((uint16_t *)cur, src, width);
+            else
+                memcpy(cur, src, sizeof(float) * width);
+            cur += pixel_type_size(file->channels[c].type) * width;
+        }
+
+    int res = pwrite_all(file->fd, chunk, EXR_TILE_HEADER_SIZE + data_size,
+                         tile_offset(file, tile_x, tile_y));
+    free(chunk);
+    return res;
+}
+
+int exr_tiled_close(struct exr_tiled_file *file)
+{
+    free(file->channels);
+    free(file->channel_order);
+    int res = replace_file_commit(file->fp, file->tmp_path, file->path);
+    free(file->path);
+    return res;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+** A minimal OpenEXR writer: single part, tiled, uncompressed images with
+** half or 32 bit float channels.
+**
+** Uncompressed tiles all have a known size, so the position of each tile
+** in the file is known before any pixel is. Tiles can thus be written in
+** any order, from several threads at once, as soon as they are done.
+*/
+
+enum exr_pixel_type
+{
+    EXR_UINT = 0,
+    EXR_HALF = 1,
+    EXR_FLOAT = 2,
+};
+
+struct exr_channel
+{
+    // layers are written as a prefix, like "diffuse.R"
+    const char *name;
+    enum exr_pixel_type type;
+};
+
+struct exr_tiled_file
+{
+    // the file is written under tmp_path, and renamed to path once closed
+    FILE *fp;
+    int fd;
+    char *path;
+    char *tmp_path;
+    size_t width;
+    size_t height;
+    size_t tile_size;
+    size_t tiles_x;
+
+    // channels, sorted by name as the format requires
+    struct exr_channel *channels;
+    // for each sorted channel, its index in the caller's array
+    size_t *channel_order;
+    size_t channel_count;
+    // the size of all channels of one pixel
+    size_t pixel_size;
+    // where the first tile starts
+    uint64_t data_offset;
+};
+
+/*
+** Creates the file next to path, under a temporary name, and writes the
+** header and an empty tile everywhere. The channels may be given in any
+** order, and the array needs not outlive the call, but the names must.
+** Returns 0 on success, and -1 on error with errno set.
+*/
+int exr_tiled_open(struct exr_tiled_file *file, const char *path,
+                   const struct exr_channel *channels, size_t channel_count,
+                   size_t width, size_t height, size_t tile_size);
+
+/*
+** Writes the tile whose top left pixel is (x, y). planes holds a plane of
+** tile width * tile height values per channel, in the order the channels
+** were given to exr_tiled_open. Tiles on the right and bottom edges are
+** cropped to the image. May be called from any thread.
+*/
+int exr_tiled_write_tile(struct exr_tiled_file *file, size_t x, size_t y,
+                         const float *const *planes);
+
+/*
+** Closes the file, and renames it to its path, so that a process killed
+** while writing tiles never leaves part of a file there. Tiles which were
+** never written are left zeroed. Returns -1 with errno set on error, in
+** which case the file is removed.
+*/
+int exr_tiled_close(struct exr_tiled_file *file);
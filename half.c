@@ -0,0 +1,81 @@
+#include "half.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HALF_HAS_F16C_PATH
+#endif
+
+uint16_t half_from_float(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    uint16_t sign = (bits >> 16) & 0x8000;
+    uint32_t exponent = (bits >> 23) & 0xff;
+    uint32_t mantissa = bits & 0x7fffff;
+
+    // infinities and NaNs, keeping NaNs quiet
+    if (exponent == 0xff)
+        return sign | 0x7c00 | (mantissa ? 0x200 | (mantissa >> 13) : 0);
+
+    // rebias the exponent, from 127 to 15
+    int32_t half_exponent = (int32_t)exponent - 127 + 15;
+    if (half_exponent >= 0x1f)
+        return sign | 0x7c00;
+
+    if (half_exponent <= 0)
+    {
+        // too small even for a subnormal half, round to zero
+        if (half_exponent < -10)
+            return sign;
+
+        // subnormal: make the implicit bit explicit, and shift it in place
+        mantissa |= 0x800000;
+        uint32_t shift = 14 - half_exponent;
+        uint32_t res = mantissa >> shift;
+        uint32_t remainder = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (remainder > halfway || (remainder == halfway && (res & 1)))
+            res++;
+        return sign | res;
+    }
+
+    uint32_t res = (half_exponent << 10) | (mantissa >> 13);
+    uint32_t remainder = mantissa & 0x1fff;
+    // rounding may carry into the exponent, which is still correct,
+    // including when it overflows to infinity
+    if (remainder > 0x1000 || (remainder == 0x1000 && (res & 1)))
+        res++;
+    return sign | res;
+}
+
+#ifdef HALF_HAS_F16C_PATH
+__attribute__((target("avx,f16c"))) static void
+half_from_float_array_f16c(uint16_t *dst, const float *src, size_t count)
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 floats = _mm256_loadu_ps(&src[i]);
+        __m128i halves = _mm256_cvtps_ph(floats, _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128((__m128i *)&dst[i], halves);
+    }
+    for (; i < count; i++)
+        dst[i] = half_from_float(src[i]);
+}
+#endif
+
+void half_from_float_array(uint16_t *dst, const float *src, size_t count)
+{
+#ifdef HALF_HAS_F16C_PATH
+    if (__builtin_cpu_supports("f16c"))
+    {
+        half_from_float_array_f16c(dst, src, count);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < count; i++)
+        dst[i] = half_from_float(src[i]);
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+** Conversion of 32 bit floats to IEEE 754 half precision floats, rounding
+** to the nearest even value.
+*/
+uint16_t half_from_float(float value);
+
+/*
+** Converts count floats. Uses the F16C instructions when the cpu has them.
+*/
+void half_from_float_array(uint16_t *dst, const float *src, size_t count);
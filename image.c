@@ -1,21 +1,30 @@
 #include <string.h>
 
 #include "image.h"
+#include "memory.h"
 
 struct rgb_image *rgb_image_alloc(size_t width, size_t height)
 {
-    size_t alloc_size = sizeof(struct rgb_image);
-    alloc_size += sizeof(struct rgb_pixel) * width * height;
+    size_t stride = align_up(3 * width, 4);
+    size_t alloc_size = sizeof(struct rgb_image) + stride * height;
 
-    struct rgb_image *res = xalloc(alloc_size);
+    struct rgb_image *res = memory_alloc(MEMORY_FRAMEBUFFERS, alloc_size);
     res->width = width;
     res->height = height;
+    res->stride = stride;
+    // the padding is written out too
+    memset(res->data, 0, stride * height);
     return res;
 }
 
+void rgb_image_free(struct rgb_image *image)
+{
+    memory_free(image);
+}
+
 void rgb_image_clear(struct rgb_image *image, const struct rgb_pixel *pix)
 {
     for (size_t y = 0; y < image->height; y++)
         for (size_t x = 0; x < image->width; x++)
-            memcpy(&image->data[image->width * y + x], pix, sizeof(*pix));
+            rgb_image_set(image, x, y, *pix);
 }
@@ -12,18 +12,37 @@ struct __attribute__((packed)) rgb_pixel
     uint8_t b;
 };
 
+/*
+** Images are stored the way bmp files store them, so that writing one is
+** a single copy: lines go from the bottom up, are padded to 4 bytes, and
+** pixels are in blue, green, red order.
+*/
 struct rgb_image
 {
     size_t width;
     size_t height;
-    struct rgb_pixel data[];
+    // the size of a line, padding included
+    size_t stride;
+    uint8_t data[];
 };
 
 struct rgb_image *rgb_image_alloc(size_t width, size_t height);
+void rgb_image_free(struct rgb_image *image);
 void rgb_image_clear(struct rgb_image *image, const struct rgb_pixel *pix);
 
+/*
+** Returns the first pixel of line y, counting from the top.
+*/
+static inline uint8_t *rgb_image_line(struct rgb_image *image, size_t y)
+{
+    return &image->data[image->stride * (image->height - 1 - y)];
+}
+
 static inline void rgb_image_set(struct rgb_image *image, size_t x, size_t y,
                                  struct rgb_pixel pixel)
 {
-    image->data[image->width * y + x] = pixel;
+    uint8_t *data = rgb_image_line(image, y) + 3 * x;
+    data[0] = pixel.b;
+    data[1] = pixel.g;
+    data[2] = pixel.r;
 }
@@ -0,0 +1,256 @@
+#include "irradiance_cache.h"
+#include "memory.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct irradiance_cell
+{
+    bool used;
+    int64_t x;
+    int64_t y;
+    int64_t z;
+
+    // indices of the records valid somewhere inside the cell
+    size_t *records;
+    size_t record_count;
+    size_t record_capacity;
+};
+
+#define IRRADIANCE_CACHE_INITIAL_CELLS 1024
+
+void irradiance_cache_init(struct irradiance_cache *cache, double error,
+                           double min_radius, double max_radius)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->error = error;
+    cache->min_radius = min_radius;
+    cache->max_radius = max_radius;
+    // a record can't be valid further than error * max_radius away, so it
+    // overlaps at most 8 cells
+    cache->cell_size = error * max_radius;
+
+    // cells are allocated with the first record
+}
+
+void irradiance_cache_destroy(struct irradiance_cache *cache)
+{
+    for (size_t i = 0; i < cache->cell_capacity; i++)
+        memory_free(cache->cells[i].records);
+    memory_free(cache->cells);
+    memory_free(cache->records);
+}
+
+void irradiance_cache_clear(struct irradiance_cache *cache)
+{
+    irradiance_cache_destroy(cache);
+    cache->records = NULL;
+    cache->record_count = 0;
+    cache->record_capacity = 0;
+    cache->cells = NULL;
+    cache->cell_count = 0;
+    cache->cell_capacity = 0;
+}
+
+static uint64_t cell_hash(int64_t x, int64_t y, int64_t z)
+{
+    uint64_t h = (uint64_t)x * 73856093;
+    h ^= (uint64_t)y * 19349663;
+    h ^= (uint64_t)z * 83492791;
+    // mix the high bits in, as the capacity is a power of two
+    return h ^ (h >> 29);
+}
+
+static struct irradiance_cell *cell_find(struct irradiance_cell *cells,
+                                         size_t capacity, int64_t x,
+                                         int64_t y, int64_t z)
+{
+    size_t mask = capacity - 1;
+    size_t i = cell_hash(x, y, z) & mask;
+    while (cells[i].used
+           && (cells[i].x != x || cells[i].y != y || cells[i].z != z))
+        i = (i + 1) & mask;
+    return &cells[i];
+}
+
+static void cache_grow(struct irradiance_cache *cache)
+{
+    size_t new_capacity = cache->cell_capacity * 2;
+    if (new_capacity == 0)
+        new_capacity = IRRADIANCE_CACHE_INITIAL_CELLS;
+    struct irradiance_cell *new_cells
+        = memory_alloc(MEMORY_CACHES, sizeof(*new_cells) * new_capacity);
+    memset(new_cells, 0, sizeof(*new_cells) * new_capacity);
+
+    for (size_t i = 0; i < cache->cell_capacity; i++)
+    {
+        struct irradiance_cell *cell = &cache->cells[i];
+        if (!cell->used)
+            continue;
+        *cell_find(new_cells, new_capacity, cell->x, cell->y, cell->z) = *cell;
+    }
+
+    memory_free(cache->cells);
+    cache->cells = new_cells;
+    cache->cell_capacity = new_capacity;
+}
+
+static int64_t cell_coord(const struct irradiance_cache *cache, double v)
+{
+    return floor(v / cache->cell_size);
+}
+
+/*
+** Ward's weighting function. It decreases with the distance to the record,
+** relative to the record radius, and with the difference of orientation.
+*/
+static double record_weight(const struct irradiance_record *record,
+                            const struct vec3 *point,
+                            const struct vec3 *normal)
+{
+    struct vec3 delta = vec3_sub(point, &record->point);
+    double normal_divergence = 1. - vec3_dot(normal, &record->normal);
+    if (normal_divergence < 0)
+        normal_divergence = 0;
+
+    double distance_error = vec3_length(&delta) / record->radius;
+    double error = distance_error + sqrt(normal_divergence);
+    if (error == 0)
+        return INFINITY;
+    return 1. / error;
+}
+
+bool irradiance_cache_lookup(const struct irradiance_cache *cache,
+                             const struct vec3 *point,
+                             const struct vec3 *normal, double *value)
+{
+    if (cache->cell_count == 0)
+        return false;
+
+    struct irradiance_cell *cell = cell_find(
+        cache->cells, cache->cell_capacity, cell_coord(cache, point->x),
+        cell_coord(cache, point->y), cell_coord(cache, point->z));
+    if (!cell->used)
+        return false;
+
+    double min_weight = 1. / cache->error;
+    double weight_sum = 0;
+    double value_sum = 0;
+    for (size_t i = 0; i < cell->record_count; i++)
+    {
+        const struct irradiance_record *record
+            = &cache->records[cell->records[i]];
+
+        // records behind the point describe another surface
+        struct vec3 delta = vec3_sub(point, &record->point);
+        struct vec3 mean_normal = vec3_add(normal, &record->normal);
+        if (vec3_dot(&delta, &mean_normal) < -1e-3 * record->radius)
+            continue;
+
+        double weight = record_weight(record, point, normal);
+        if (weight <= min_weight)
+            continue;
+        if (isinf(weight))
+        {
+            *value = record->value;
+            return true;
+        }
+
+        weight_sum += weight;
+        value_sum += weight * record->value;
+    }
+
+    if (weight_sum == 0)
+        return false;
+
+    *value = value_sum / weight_sum;
+    return true;
+}
+
+/*
+** Out of memory, the record is left out of the cell, where lookups then
+** miss it.
+*/
+static void cell_add_record(struct irradiance_cell *cell, size_t record)
+{
+    if (cell->record_count == cell->record_capacity)
+    {
+        size_t capacity
+            = cell->record_capacity ? cell->record_capacity * 2 : 4;
+        size_t *records = memory_realloc(cell->records, MEMORY_CACHES,
+                                         sizeof(*records) * capacity);
+        if (records == NULL)
+            return;
+        cell->records = records;
+        cell->record_capacity = capacity;
+    }
+    cell->records[cell->record_count++] = record;
+}
+
+void irradiance_cache_insert(struct irradiance_cache *cache,
+                             const struct vec3 *point,
+                             const struct vec3 *normal, double value,
+                             double radius)
+{
+    if (radius < cache->min_radius)
+        radius = cache->min_radius;
+    if (radius > cache->max_radius)
+        radius = cache->max_radius;
+
+    if (cache->record_count == cache->record_capacity)
+    {
+        size_t capacity
+            = cache->record_capacity ? cache->record_capacity * 2 : 256;
+        struct irradiance_record *records = memory_realloc(
+            cache->records, MEMORY_CACHES, sizeof(*records) * capacity);
+        // the cache is only there to save time
+        if (records == NULL)
+            return;
+        cache->records = records;
+        cache->record_capacity = capacity;
+    }
+
+    size_t index = cache->record_count++;
+    cache->records[index] = (struct irradiance_record){
+        .point = *point,
+        .normal = *normal,
+        .value = value,
+        .radius = radius,
+    };
+
+    // register the record in all the cells its validity area overlaps
+    double reach = cache->error * radius;
+    int64_t min[3] = {
+        cell_coord(cache, point->x - reach),
+        cell_coord(cache, point->y - reach),
+        cell_coord(cache, point->z - reach),
+    };
+    int64_t max[3] = {
+        cell_coord(cache, point->x + reach),
+        cell_coord(cache, point->y + reach),
+        cell_coord(cache, point->z + reach),
+    };
+
+    for (int64_t x = min[0]; x <= max[0]; x++)
+        for (int64_t y = min[1]; y <= max[1]; y++)
+            for (int64_t z = min[2]; z <= max[2]; z++)
+            {
+                // keep the load factor under one half
+                if (2 * (cache->cell_count + 1) > cache->cell_capacity)
+                    cache_grow(cache);
+
+                struct irradiance_cell *cell
+                    = cell_find(cache->cells, cache->cell_capacity, x, y, z);
+                if (!cell->used)
+                {
+                    cell->used = true;
+                    cell->x = x;
+                    cell->y = y;
+                    cell->z = z;
+                    cache->cell_count++;
+                }
+                cell_add_record(cell, index);
+            }
+}
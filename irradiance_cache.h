@@ -0,0 +1,70 @@
+#pragma once
+
+#include "vec3.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+** An irradiance cache (Ward et al., 1988), storing sparse samples of a
+** slowly varying quantity (here, ambient occlusion) on surfaces, and
+** interpolating between them.
+**
+** Each record is valid within a radius proportional to the distance to
+** the surrounding geometry: records taken in open areas cover a large
+** part of the surface, records taken in corners only a small one.
+** Records are indexed in a hashed uniform grid, in every cell their
+** validity area overlaps, so that a lookup only needs to inspect a
+** single cell.
+*/
+
+struct irradiance_record
+{
+    struct vec3 point;
+    struct vec3 normal;
+    double value;
+    // the harmonic mean distance to the surrounding geometry
+    double radius;
+};
+
+struct irradiance_cell;
+
+struct irradiance_cache
+{
+    // the maximum allowed interpolation error, Ward's a parameter
+    double error;
+    double min_radius;
+    double max_radius;
+    double cell_size;
+
+    struct irradiance_record *records;
+    size_t record_count;
+    size_t record_capacity;
+
+    // open addressing hash table of grid cells
+    struct irradiance_cell *cells;
+    size_t cell_count;
+    size_t cell_capacity;
+};
+
+void irradiance_cache_init(struct irradiance_cache *cache, double error,
+                           double min_radius, double max_radius);
+void irradiance_cache_destroy(struct irradiance_cache *cache);
+
+/*
+** Drops all records, and frees their memory.
+*/
+void irradiance_cache_clear(struct irradiance_cache *cache);
+
+/*
+** Interpolates the cached records valid at point. Returns false if none
+** is, in which case the caller should compute a new sample and insert it.
+*/
+bool irradiance_cache_lookup(const struct irradiance_cache *cache,
+                             const struct vec3 *point,
+                             const struct vec3 *normal, double *value);
+
+void irradiance_cache_insert(struct irradiance_cache *cache,
+                             const struct vec3 *point,
+                             const struct vec3 *normal, double value,
+                             double radius);
@@ -0,0 +1,113 @@
+#include "light.h"
+
+#include <math.h>
+
+/*
+** Maps the unit square to the unit disk, preserving the relative areas and
+** adjacency of strata (Shirley and Chiu's concentric mapping).
+*/
+static void concentric_disk(double u, double v, double *x, double *y)
+{
+    double a = 2 * u - 1;
+    double b = 2 * v - 1;
+    if (a == 0 && b == 0)
+    {
+        *x = 0;
+        *y = 0;
+        return;
+    }
+
+    double r;
+    double phi;
+    if (fabs(a) > fabs(b))
+    {
+        r = a;
+        phi = (M_PI / 4) * (b / a);
+    }
+    else
+    {
+        r = b;
+        phi = (M_PI / 2) - (M_PI / 4) * (a / b);
+    }
+    *x = r * cos(phi);
+    *y = r * sin(phi);
+}
+
+static void light_sample_from(struct light_sample *sample,
+                              const struct vec3 *light_point,
+                              const struct vec3 *point)
+{
+    sample->direction = vec3_sub(point, light_point);
+    sample->distance = vec3_length(&sample->direction);
+    vec3_normalize(&sample->direction);
+    sample->attenuation = 1. / (sample->distance * sample->distance);
+}
+
+void light_sample(struct light_sample *sample, const struct light *light,
+                  const struct vec3 *point, double u, double v)
+{
+    switch (light->type)
+    {
+    case LIGHT_DIRECTIONAL:
+        sample->direction = light->direction;
+        sample->distance = INFINITY;
+        sample->attenuation = 1.;
+        return;
+    case LIGHT_SPHERE:
+    {
+        // only the disk facing the point is visible, sample it
+        struct vec3 to_point = vec3_sub(point, &light->position);
+        vec3_normalize(&to_point);
+        struct vec3 u_axis;
+        struct vec3 v_axis;
+        vec3_orthonormal_basis(&to_point, &u_axis, &v_axis);
+
+        double disk_x;
+        double disk_y;
+        concentric_disk(u, v, &disk_x, &disk_y);
+        struct vec3 u_offset = vec3_mul(&u_axis, disk_x * light->radius);
+        struct vec3 v_offset = vec3_mul(&v_axis, disk_y * light->radius);
+        struct vec3 offset = vec3_add(&u_offset, &v_offset);
+        struct vec3 light_point = vec3_add(&light->position, &offset);
+        light_sample_from(sample, &light_point, point);
+        return;
+    }
+    case LIGHT_RECT:
+    {
+        struct vec3 u_offset = vec3_mul(&light->edge_u, u);
+        struct vec3 v_offset = vec3_mul(&light->edge_v, v);
+        struct vec3 offset = vec3_add(&u_offset, &v_offset);
+        struct vec3 light_point = vec3_add(&light->position, &offset);
+        light_sample_from(sample, &light_point, point);
+
+        // the rectangle only emits on one side, and emits less at grazing
+        // angles
+        struct vec3 normal = vec3_cross(&light->edge_u, &light->edge_v);
+        vec3_normalize(&normal);
+        double cos_light = vec3_dot(&normal, &sample->direction);
+        if (cos_light < 0)
+            cos_light = 0;
+        sample->attenuation *= cos_light;
+        return;
+    }
+    }
+}
+
+struct aabb light_bounds(const struct light *light)
+{
+    struct aabb res = aabb_empty();
+    aabb_add_point(&res, &light->position);
+    if (light->type == LIGHT_SPHERE)
+    {
+        aabb_grow(&res, light->radius);
+        return res;
+    }
+
+    struct vec3 corner_u = vec3_add(&light->position, &light->edge_u);
+    struct vec3 corner_v = vec3_add(&light->position, &light->edge_v);
+    struct vec3 corner_uv = vec3_add(&corner_u, &light->edge_v);
+    aabb_add_point(&res, &corner_u);
+    aabb_add_point(&res, &corner_v);
+    aabb_add_point(&res, &corner_uv);
+    return res;
+}
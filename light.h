@@ -0,0 +1,72 @@
+#pragma once
+
+#include "aabb.h"
+#include "vec3.h"
+
+#include <stdbool.h>
+
+enum light_type
+{
+    /* infinitely far away, all rays are parallel */
+    LIGHT_DIRECTIONAL = 0,
+    /* a sphere emitting in all directions */
+    LIGHT_SPHERE,
+    /* a one sided rectangle, emitting towards edge_u x edge_v */
+    LIGHT_RECT,
+};
+
+struct light
+{
+    enum light_type type;
+    struct vec3 color;
+    /*
+    ** For directional lights, the intensity of the light reaching any
+    ** point. For area lights, the intensity at a distance of 1 from the
+    ** light surface: it decreases with the square of the distance.
+    */
+    double intensity;
+
+    // LIGHT_DIRECTIONAL: the direction light travels in, normalized
+    struct vec3 direction;
+
+    // LIGHT_SPHERE: the center of the sphere
+    // LIGHT_RECT: a corner of the rectangle
+    struct vec3 position;
+    // LIGHT_SPHERE only
+    double radius;
+    // LIGHT_RECT only: the two edges starting at position
+    struct vec3 edge_u;
+    struct vec3 edge_v;
+};
+
+/*
+** The light arriving at a given point, from a given point of the light.
+*/
+struct light_sample
+{
+    // the direction the light travels in, normalized
+    struct vec3 direction;
+    // the distance between the light and the point, INFINITY for
+    // directional lights
+    double distance;
+    // how much of the light intensity reaches the point
+    double attenuation;
+};
+
+static inline bool light_is_area(const struct light *light)
+{
+    return light->type != LIGHT_DIRECTIONAL;
+}
+
+/*
+** Samples the light arriving at point. For area lights, (u, v) are
+** coordinates in [0, 1) on the light surface, which are mapped such that
+** a stratified set of coordinates gives stratified light samples.
+*/
+void light_sample(struct light_sample *sample, const struct light *light,
+                  const struct vec3 *point, double u, double v);
+
+/*
+** Returns the bounds of the surface of an area light.
+*/
+struct aabb light_bounds(const struct light *light);
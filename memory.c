@@ -0,0 +1,195 @@
+#include "memory.h"
+#include "utils.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+** Each allocation is preceded by its size and category, padded to
+** MEMORY_HEADER_SIZE bytes whatever the size of size_t, so that the
+** allocation keeps the alignment malloc gives.
+*/
+#define MEMORY_HEADER_SIZE 16
+
+struct memory_header
+{
+    size_t size;
+    size_t category;
+};
+
+STATIC_ASSERT(memory_header_size,
+              sizeof(struct memory_header) <= MEMORY_HEADER_SIZE);
+
+static const char *const category_names[MEMORY_CATEGORY_COUNT] = {
+    [MEMORY_SCENE] = "scene",
+    [MEMORY_ACCELERATION] = "acceleration",
+    [MEMORY_FRAMEBUFFERS] = "framebuffers",
+    [MEMORY_CACHES] = "caches",
+};
+
+static size_t used[MEMORY_CATEGORY_COUNT];
+static size_t peak[MEMORY_CATEGORY_COUNT];
+static size_t total_used;
+static size_t total_peak;
+static size_t budget;
+
+static pthread_mutex_t shrinkers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct memory_shrinker *shrinkers;
+
+static void update_peak(size_t *peak, size_t value)
+{
+    size_t prev = __atomic_load_n(peak, __ATOMIC_RELAXED);
+    while (prev < value
+           && !__atomic_compare_exchange_n(peak, &prev, value, true,
+                                           __ATOMIC_RELAXED,
+                                           __ATOMIC_RELAXED))
+        continue;
+}
+
+static void charge(enum memory_category category, size_t size)
+{
+    size_t value
+        = __atomic_add_fetch(&used[category], size, __ATOMIC_RELAXED);
+    update_peak(&peak[category], value);
+    value = __atomic_add_fetch(&total_used, size, __ATOMIC_RELAXED);
+    update_peak(&total_peak, value);
+}
+
+static void discharge(enum memory_category category, size_t size)
+{
+    __atomic_sub_fetch(&used[category], size, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&total_used, size, __ATOMIC_RELAXED);
+}
+
+/*
+** Asks caches to shrink, until size more bytes fit. Returns whether
+** anything was freed.
+*/
+static bool shrink(size_t size)
+{
+    bool res = false;
+    pthread_mutex_lock(&shrinkers_lock);
+    for (struct memory_shrinker *shrinker = shrinkers; shrinker != NULL;
+         shrinker = shrinker->next)
+    {
+        size_t limit = __atomic_load_n(&budget, __ATOMIC_RELAXED);
+        size_t current = __atomic_load_n(&total_used, __ATOMIC_RELAXED);
+        if (limit != 0 && current + size <= limit)
+            break;
+        res |= shrinker->fn(shrinker->ctx);
+    }
+    pthread_mutex_unlock(&shrinkers_lock);
+    return res;
+}
+
+bool memory_fits(size_t size)
+{
+    size_t limit = __atomic_load_n(&budget, __ATOMIC_RELAXED);
+    if (limit == 0)
+        return true;
+    if (__atomic_load_n(&total_used, __ATOMIC_RELAXED) + size <= limit)
+        return true;
+
+    shrink(size);
+    return __atomic_load_n(&total_used, __ATOMIC_RELAXED) + size <= limit;
+}
+
+static struct memory_header *header_of(void *ptr)
+{
+    return (struct memory_header *)((char *)ptr - MEMORY_HEADER_SIZE);
+}
+
+static void *data_of(struct memory_header *header)
+{
+    return (char *)header + MEMORY_HEADER_SIZE;
+}
+
+void *memory_realloc(void *ptr, enum memory_category category, size_t size)
+{
+    struct memory_header *header = ptr ? header_of(ptr) : NULL;
+    size_t prev_size = header ? header->size : 0;
+    if (size > prev_size)
+        memory_fits(size - prev_size);
+
+    struct memory_header *res;
+    // caches may give back enough for the allocation to succeed
+    while ((res = realloc(header, MEMORY_HEADER_SIZE + size)) == NULL)
+        if (!shrink(size))
+            return NULL;
+
+    if (header != NULL)
+        discharge(res->category, prev_size);
+    res->size = size;
+    res->category = category;
+    charge(category, size);
+    return data_of(res);
+}
+
+void *memory_alloc(enum memory_category category, size_t size)
+{
+    void *res = memory_realloc(NULL, category, size);
+    if (res == NULL)
+        abort();
+    return res;
+}
+
+void memory_free(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+
+    struct memory_header *header = header_of(ptr);
+    discharge(header->category, header->size);
+    free(header);
+}
+
+void memory_add_shrinker(struct memory_shrinker *shrinker)
+{
+    pthread_mutex_lock(&shrinkers_lock);
+    shrinker->next = shrinkers;
+    shrinkers = shrinker;
+    pthread_mutex_unlock(&shrinkers_lock);
+}
+
+void memory_remove_shrinker(struct memory_shrinker *shrinker)
+{
+    pthread_mutex_lock(&shrinkers_lock);
+    struct memory_shrinker **link = &shrinkers;
+    while (*link != shrinker)
+        link = &(*link)->next;
+    *link = shrinker->next;
+    pthread_mutex_unlock(&shrinkers_lock);
+}
+
+void memory_set_budget(size_t new_budget)
+{
+    __atomic_store_n(&budget, new_budget, __ATOMIC_RELAXED);
+}
+
+size_t memory_used(enum memory_category category)
+{
+    return __atomic_load_n(&used[category], __ATOMIC_RELAXED);
+}
+
+const char *memory_category_name(enum memory_category category)
+{
+    return category_names[category];
+}
+
+static double to_mib(size_t size)
+{
+    return size / (1024. * 1024.);
+}
+
+void memory_report(FILE *fp)
+{
+    fprintf(fp, "%-14s %12s %12s\n", "memory (MiB)", "current", "peak");
+    for (size_t i = 0; i < MEMORY_CATEGORY_COUNT; i++)
+        fprintf(fp, "%-14s %12.2f %12.2f\n", category_names[i],
+                to_mib(used[i]), to_mib(peak[i]));
+    fprintf(fp, "%-14s %12.2f %12.2f\n", "total", to_mib(total_used),
+            to_mib(total_peak));
+    if (budget != 0)
+        fprintf(fp, "%-14s %12.2f\n", "budget", to_mib(budget));
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+** What memory is used for. Long lived allocations are charged to one of
+** these, so that usage can be reported and kept under a budget.
+*/
+enum memory_category
+{
+    /* spheres, and the maps between their ids and indices */
+    MEMORY_SCENE = 0,
+    /* bounding volume hierarchies and shadow grids */
+    MEMORY_ACCELERATION,
+    /* images, G-buffers and per worker tile buffers */
+    MEMORY_FRAMEBUFFERS,
+    /* ambient occlusion caches and photon maps */
+    MEMORY_CACHES,
+    MEMORY_CATEGORY_COUNT,
+};
+
+/*
+** Like xalloc and realloc, but charged to a category. The result must be
+** released with memory_free. If the allocation goes over the budget, or
+** fails, caches are asked to shrink first. Allocations over the budget
+** still succeed: keeping under it is up to admission control, see
+** memory_fits. If there is no memory left even then, memory_alloc aborts,
+** like xalloc, while memory_realloc returns NULL, and leaves ptr as is, so
+** that callers which can do without more memory carry on.
+*/
+__attribute__((malloc)) void *memory_alloc(enum memory_category category,
+                                           size_t size);
+void *memory_realloc(void *ptr, enum memory_category category, size_t size);
+void memory_free(void *ptr);
+
+/*
+** A cache which can drop what it holds when memory runs low. fn returns
+** whether it freed anything. It may be called from any thread, including
+** one in the middle of using the cache, and must not block.
+*/
+struct memory_shrinker
+{
+    bool (*fn)(void *ctx);
+    void *ctx;
+    struct memory_shrinker *next;
+};
+
+void memory_add_shrinker(struct memory_shrinker *shrinker);
+void memory_remove_shrinker(struct memory_shrinker *shrinker);
+
+/*
+** The budget all categories share, in bytes. 0, the default, means none.
+*/
+void memory_set_budget(size_t budget);
+
+/*
+** Returns whether size more bytes fit in the budget. If they don't,
+** caches are shrunk before giving up.
+*/
+bool memory_fits(size_t size);
+
+size_t memory_used(enum memory_category category);
+const char *memory_category_name(enum memory_category category);
+
+/*
+** Prints current and peak usage, by category
+*/
+void memory_report(FILE *fp);
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define OBJECT_SET_CAPACITY 1024
+// keep the table at most half full
+#define OBJECT_SET_SLOTS (2 * OBJECT_SET_CAPACITY)
+#define OBJECT_SET_EMPTY UINT32_MAX
+
+/*
+** A small set of object indices, which gives up once it holds more than
+** OBJECT_SET_CAPACITY of them. Used to record which objects the rays of a
+** tile hit.
+*/
+struct object_set
+{
+    uint32_t slots[OBJECT_SET_SLOTS];
+    size_t count;
+    bool overflow;
+};
+
+static inline void object_set_clear(struct object_set *set)
+{
+    memset(set->slots, 0xff, sizeof(set->slots));
+    set->count = 0;
+    set->overflow = false;
+}
+
+static inline void object_set_add(struct object_set *set, size_t object)
+{
+    if (set->overflow)
+        return;
+
+    size_t mask = OBJECT_SET_SLOTS - 1;
+    size_t i = ((uint64_t)object * 0x9e3779b97f4a7c15) >> 32 & mask;
+    while (set->slots[i] != OBJECT_SET_EMPTY)
+    {
+        if (set->slots[i] == object)
+            return;
+        i = (i + 1) & mask;
+    }
+
+    if (set->count == OBJECT_SET_CAPACITY)
+    {
+        set->overflow = true;
+        return;
+    }
+    set->slots[i] = object;
+    set->count++;
+}
@@ -0,0 +1,82 @@
+#include "parallel.h"
+#include "utils.h"
+
+#include <err.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct parallel_job
+{
+    size_t count;
+    size_t next;
+    parallel_fn fn;
+    void *ctx;
+};
+
+struct parallel_worker
+{
+    struct parallel_job *job;
+    size_t id;
+    pthread_t thread;
+};
+
+static void *parallel_worker_run(void *arg)
+{
+    struct parallel_worker *worker = arg;
+    struct parallel_job *job = worker->job;
+
+    size_t index;
+    while ((index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED))
+           < job->count)
+        job->fn(job->ctx, index, worker->id);
+    return NULL;
+}
+
+void parallel_for(size_t thread_count, size_t count, parallel_fn fn,
+                  void *ctx)
+{
+    struct parallel_job job = {
+        .count = count,
+        .next = 0,
+        .fn = fn,
+        .ctx = ctx,
+    };
+
+    if (thread_count > count)
+        thread_count = count;
+    if (thread_count <= 1)
+    {
+        for (size_t i = 0; i < count; i++)
+            fn(ctx, i, 0);
+        return;
+    }
+
+    struct parallel_worker *workers
+        = xalloc(sizeof(*workers) * thread_count);
+    // the calling thread is worker 0
+    for (size_t i = 0; i < thread_count; i++)
+    {
+        workers[i].job = &job;
+        workers[i].id = i;
+        if (i == 0)
+            continue;
+        int rc = pthread_create(&workers[i].thread, NULL, parallel_worker_run,
+                                &workers[i]);
+        if (rc != 0)
+            errx(1, "failed to create a worker thread");
+    }
+
+    parallel_worker_run(&workers[0]);
+    for (size_t i = 1; i < thread_count; i++)
+        pthread_join(workers[i].thread, NULL);
+    free(workers);
+}
+
+size_t parallel_default_threads(void)
+{
+    long res = sysconf(_SC_NPROCESSORS_ONLN);
+    if (res < 1)
+        return 1;
+    return res;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+** Calls fn(ctx, index, worker) for every index in [0, count), spread over
+** thread_count threads. Indices are handed out dynamically, one at a time,
+** so that expensive items don't stall a whole thread. worker is in
+** [0, thread_count), and identifies the thread running the item, so that
+** callers can use per thread buffers without locking.
+**
+** Returns once all items are done.
+*/
+typedef void (*parallel_fn)(void *ctx, size_t index, size_t worker);
+
+void parallel_for(size_t thread_count, size_t count, parallel_fn fn,
+                  void *ctx);
+
+/*
+** The number of online processors, at least one
+*/
+size_t parallel_default_threads(void);
@@ -0,0 +1,182 @@
+#include "perf.h"
+
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const struct
+{
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} perf_events[PERF_COUNTER_COUNT] = {
+    [PERF_CYCLES] = {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [PERF_INSTRUCTIONS] = {"instructions", PERF_TYPE_HARDWARE,
+                           PERF_COUNT_HW_INSTRUCTIONS},
+    [PERF_L1D_MISSES] = {"L1D misses", PERF_TYPE_HW_CACHE,
+                         PERF_COUNT_HW_CACHE_L1D
+                             | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                             | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    [PERF_LLC_MISSES] = {"LLC misses", PERF_TYPE_HARDWARE,
+                         PERF_COUNT_HW_CACHE_MISSES},
+    [PERF_BRANCH_MISSES] = {"branch misses", PERF_TYPE_HARDWARE,
+                            PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+static const char *perf_stage_names[PERF_STAGE_COUNT] = {
+    [PERF_STAGE_RAY_GEN] = "ray-gen",
+    [PERF_STAGE_INTERSECT] = "intersect",
+    [PERF_STAGE_SHADE] = "shade",
+    [PERF_STAGE_OUTPUT] = "output",
+};
+
+static int perf_event_open(struct perf_event_attr *attr, int group_fd)
+{
+    // measure the calling thread, on any cpu
+    return syscall(__NR_perf_event_open, attr, 0, -1, group_fd, 0);
+}
+
+bool perf_counters_open(struct perf_counters *pc)
+{
+    pc->group_fd = -1;
+    pc->slot_count = 0;
+
+    for (size_t i = 0; i < PERF_COUNTER_COUNT; i++)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perf_events[i].type;
+        attr.config = perf_events[i].config;
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        // the group is started all at once, when all counters are opened
+        attr.disabled = (pc->group_fd == -1);
+
+        pc->fds[i] = perf_event_open(&attr, pc->group_fd);
+        pc->slots[i] = -1;
+        if (pc->fds[i] == -1)
+        {
+            // without a cycle counter, the other counters are meaningless
+            if (i == PERF_CYCLES)
+            {
+                pc->unavailable = true;
+                return false;
+            }
+            continue;
+        }
+
+        if (pc->group_fd == -1)
+            pc->group_fd = pc->fds[i];
+        pc->slots[i] = pc->slot_count++;
+    }
+
+    ioctl(pc->group_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(pc->group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    pc->enabled = true;
+    pc->opened = true;
+    return true;
+}
+
+void perf_counters_close(struct perf_counters *pc)
+{
+    if (!pc->enabled)
+        return;
+
+    for (size_t i = 0; i < PERF_COUNTER_COUNT; i++)
+        if (pc->fds[i] != -1)
+            close(pc->fds[i]);
+    pc->enabled = false;
+}
+
+void perf_counters_read(struct perf_counters *pc,
+                        uint64_t values[PERF_COUNTER_COUNT])
+{
+    // a group read returns the number of counters, then their values
+    uint64_t buf[1 + PERF_COUNTER_COUNT] = {0};
+    if (read(pc->group_fd, buf, sizeof(buf)) <= 0)
+        return;
+
+    for (size_t i = 0; i < PERF_COUNTER_COUNT; i++)
+        values[i] = pc->slots[i] == -1 ? 0 : buf[1 + pc->slots[i]];
+}
+
+static void perf_report_line(FILE *fp, const char *name,
+                             const uint64_t totals[PERF_COUNTER_COUNT],
+                             uint64_t rays, const int slots[PERF_COUNTER_COUNT])
+{
+    double ipc = 0;
+    if (totals[PERF_CYCLES])
+        ipc = (double)totals[PERF_INSTRUCTIONS] / totals[PERF_CYCLES];
+
+    fprintf(fp, "%-10s %12lu", name, (unsigned long)rays);
+    for (size_t i = 0; i < PERF_COUNTER_COUNT; i++)
+    {
+        if (slots[i] == -1)
+            fprintf(fp, " %14s", "n/a");
+        else if (rays)
+            fprintf(fp, " %14.3f", (double)totals[i] / rays);
+        else
+            fprintf(fp, " %14lu", (unsigned long)totals[i]);
+    }
+    fprintf(fp, " %6.2f\n", ipc);
+}
+
+void perf_counters_report(const struct perf_counters *threads,
+                          size_t thread_count, FILE *fp)
+{
+    const struct perf_counters *reference = NULL;
+    for (size_t i = 0; i < thread_count; i++)
+        if (threads[i].opened)
+            reference = &threads[i];
+
+    if (reference == NULL)
+    {
+        fprintf(fp, "perf: hardware counters unavailable\n");
+        return;
+    }
+
+    fprintf(fp, "%-10s %12s", "stage", "rays");
+    for (size_t i = 0; i < PERF_COUNTER_COUNT; i++)
+        fprintf(fp, " %14s", perf_events[i].name);
+    fprintf(fp, " %6s\n", "IPC");
+    fprintf(fp, "(counter values are per ray)\n");
+
+    for (size_t stage = 0; stage < PERF_STAGE_COUNT; stage++)
+    {
+        uint64_t totals[PERF_COUNTER_COUNT] = {0};
+        uint64_t rays = 0;
+        for (size_t t = 0; t < thread_count; t++)
+        {
+            if (!threads[t].opened)
+                continue;
+            for (size_t i = 0; i < PERF_COUNTER_COUNT; i++)
+                totals[i] += threads[t].totals[stage][i];
+            rays += threads[t].rays[stage];
+        }
+        perf_report_line(fp, perf_stage_names[stage], totals, rays,
+                         reference->slots);
+    }
+
+    if (thread_count < 2)
+        return;
+
+    for (size_t t = 0; t < thread_count; t++)
+    {
+        if (!threads[t].opened)
+            continue;
+
+        uint64_t totals[PERF_COUNTER_COUNT] = {0};
+        for (size_t stage = 0; stage < PERF_STAGE_COUNT; stage++)
+            for (size_t i = 0; i < PERF_COUNTER_COUNT; i++)
+                totals[i] += threads[t].totals[stage][i];
+
+        char name[32];
+        snprintf(name, sizeof(name), "thread %zu", t);
+        perf_report_line(fp, name, totals, threads[t].rays[PERF_STAGE_RAY_GEN],
+                         threads[t].slots);
+    }
+}
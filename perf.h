@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+** Optional hardware performance counters, recorded around each stage of the
+** render loop. Counters are opened for the calling thread only: each worker
+** owns its own struct perf_counters, which are merged when reporting.
+**
+** When counters aren't available (no PMU, or perf_event_paranoid forbids
+** it), all operations are no-ops.
+*/
+
+enum perf_stage
+{
+    PERF_STAGE_RAY_GEN = 0,
+    PERF_STAGE_INTERSECT,
+    PERF_STAGE_SHADE,
+    PERF_STAGE_OUTPUT,
+    PERF_STAGE_COUNT,
+};
+
+enum perf_counter
+{
+    PERF_CYCLES = 0,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_COUNTER_COUNT,
+};
+
+struct perf_counters
+{
+    // whether the counters are currently open
+    bool enabled;
+    // whether the counters were opened at least once, and totals are valid
+    bool opened;
+    // whether opening the counters failed, and shouldn't be retried
+    bool unavailable;
+    int group_fd;
+    int fds[PERF_COUNTER_COUNT];
+    // the position of each counter inside a group read, or -1 if the counter
+    // could not be opened
+    int slots[PERF_COUNTER_COUNT];
+    size_t slot_count;
+
+    uint64_t stage_start[PERF_COUNTER_COUNT];
+    uint64_t totals[PERF_STAGE_COUNT][PERF_COUNTER_COUNT];
+    // how many rays went through each stage
+    uint64_t rays[PERF_STAGE_COUNT];
+};
+
+/*
+** Opens the counters for the calling thread. Returns false and leaves the
+** counters disabled if the cycle counter can't be opened. The counters
+** must be zero initialized before being opened for the first time. Totals
+** accumulate across reopenings, which allows a set of counters to be
+** carried by successive threads.
+*/
+bool perf_counters_open(struct perf_counters *pc);
+void perf_counters_close(struct perf_counters *pc);
+
+void perf_counters_read(struct perf_counters *pc,
+                        uint64_t values[PERF_COUNTER_COUNT]);
+
+static inline void perf_stage_begin(struct perf_counters *pc)
+{
+    if (!pc->enabled)
+        return;
+    perf_counters_read(pc, pc->stage_start);
+}
+
+static inline void perf_stage_end(struct perf_counters *pc,
+                                  enum perf_stage stage, size_t ray_count)
+{
+    if (!pc->enabled)
+        return;
+
+    // if the read fails, the stage is accounted as empty
+    uint64_t now[PERF_COUNTER_COUNT];
+    for (size_t i = 0; i < PERF_COUNTER_COUNT; i++)
+        now[i] = pc->stage_start[i];
+    perf_counters_read(pc, now);
+    for (size_t i = 0; i < PERF_COUNTER_COUNT; i++)
+        pc->totals[stage][i] += now[i] - pc->stage_start[i];
+    pc->rays[stage] += ray_count;
+}
+
+/*
+** Prints a table of per stage counters, summed across all threads, followed
+** by per thread totals.
+*/
+void perf_counters_report(const struct perf_counters *threads,
+                          size_t thread_count, FILE *fp);
@@ -0,0 +1,616 @@
+#include "photon_map.h"
+#include "memory.h"
+#include "parallel.h"
+#include "rng.h"
+#include "utils.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// photons are traced by chunks, each seeded by its index
+#define PHOTON_CHUNK_SIZE 1024
+#define PHOTON_MAX_DEPTH 16
+#define PHOTON_GATHER_MAX 256
+// how far photons start from the surfaces they leave
+#define PHOTON_EPSILON 1e-6
+
+/*
+** Something photons are emitted from. Directional lights have no finite
+** extent to emit from: they only emit towards glass objects, and only
+** contribute to the caustic map (Jensen's projection maps).
+*/
+struct photon_emitter
+{
+    const struct light *light;
+    // for directional lights, the glass sphere photons are aimed at
+    const struct sphere *target;
+    // the total power emitted, relative to the light color
+    double flux;
+};
+
+struct photon_buffer
+{
+    struct photon *photons;
+    size_t count;
+    size_t capacity;
+};
+
+struct photon_tracer
+{
+    const struct scene *scene;
+    struct photon_emitter *emitters;
+    size_t emitter_count;
+    double total_flux;
+    // the radius of a sphere centered on the origin containing the scene
+    double scene_radius;
+
+    size_t photon_count;
+    // per worker buffers
+    struct photon_buffer *global;
+    struct photon_buffer *caustic;
+};
+
+static inline double vec3_axis(const struct vec3 *v, int axis)
+{
+    if (axis == 0)
+        return v->x;
+    if (axis == 1)
+        return v->y;
+    return v->z;
+}
+
+static void photon_buffer_push(struct photon_buffer *buffer,
+                               const struct photon *photon)
+{
+    if (buffer->count == buffer->capacity)
+    {
+        buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 1024;
+        struct photon *photons
+            = xalloc(sizeof(*photons) * buffer->capacity);
+        if (buffer->count)
+            memcpy(photons, buffer->photons,
+                   sizeof(*photons) * buffer->count);
+        free(buffer->photons);
+        buffer->photons = photons;
+    }
+    buffer->photons[buffer->count++] = *photon;
+}
+
+static void emit_photon(const struct photon_tracer *tracer,
+                        const struct photon_emitter *emitter, struct rng *rng,
+                        struct ray *ray)
+{
+    const struct light *light = emitter->light;
+    switch (light->type)
+    {
+    case LIGHT_DIRECTIONAL:
+    {
+        // start from a disk covering the target, outside of the scene
+        const struct sphere *target = emitter->target;
+        struct vec3 u_axis;
+        struct vec3 v_axis;
+        vec3_orthonormal_basis(&light->direction, &u_axis, &v_axis);
+
+        double r = sqrt(rng_double(rng)) * target->radius;
+        double phi = 2 * M_PI * rng_double(rng);
+        struct vec3 u_offset = vec3_mul(&u_axis, r * cos(phi));
+        struct vec3 v_offset = vec3_mul(&v_axis, r * sin(phi));
+        struct vec3 back = vec3_mul(&light->direction,
+                                    -2 * tracer->scene_radius - target->radius);
+        ray->source = vec3_add(&target->center, &back);
+        ray->source = vec3_add(&ray->source, &u_offset);
+        ray->source = vec3_add(&ray->source, &v_offset);
+        ray->direction = light->direction;
+        return;
+    }
+    case LIGHT_SPHERE:
+    {
+        // uniformly pick a point on the sphere, and emit away from it
+        double z = 1. - 2. * rng_double(rng);
+        double r = sqrt(1. - z * z);
+        double phi = 2 * M_PI * rng_double(rng);
+        struct vec3 normal = {r * cos(phi), r * sin(phi), z};
+        struct vec3 offset
+            = vec3_mul(&normal, light->radius + PHOTON_EPSILON);
+        ray->source = vec3_add(&light->position, &offset);
+        ray->direction = vec3_cosine_sample(&normal, rng_double(rng),
+                                            rng_double(rng));
+        return;
+    }
+    case LIGHT_RECT:
+    {
+        struct vec3 u_offset = vec3_mul(&light->edge_u, rng_double(rng));
+        struct vec3 v_offset = vec3_mul(&light->edge_v, rng_double(rng));
+        struct vec3 normal = vec3_cross(&light->edge_u, &light->edge_v);
+        vec3_normalize(&normal);
+        ray->source = vec3_add(&light->position, &u_offset);
+        ray->source = vec3_add(&ray->source, &v_offset);
+        ray->direction = vec3_cosine_sample(&normal, rng_double(rng),
+                                            rng_double(rng));
+        return;
+    }
+    }
+}
+
+static void trace_photon(const struct photon_tracer *tracer, struct ray *ray,
+                         struct vec3 power, bool caustic_only,
+                         struct rng *rng, size_t worker)
+{
+    const struct scene *scene = tracer->scene;
+    bool through_glass = false;
+    bool bounced = false;
+
+    for (size_t depth = 0; depth < PHOTON_MAX_DEPTH; depth++)
+    {
+        struct intersection intersection;
+        size_t object;
+        double distance
+            = scene_intersect(scene, ray, &intersection, &object, NULL);
+        if (isinf(distance))
+            return;
+
+        const struct material *material = scene_material(scene, object);
+        if (material->kind == MATERIAL_GLASS)
+        {
+            glass_scatter(ray, &intersection, material, rng_double(rng));
+            power = vec3_mul_vec(&power, &material->surface_color);
+            through_glass = true;
+            continue;
+        }
+
+        struct photon photon = {
+            .position = intersection.point,
+            .direction = ray->direction,
+            .power = power,
+        };
+        if (bounced)
+            photon_buffer_push(&tracer->global[worker], &photon);
+        else if (through_glass)
+            photon_buffer_push(&tracer->caustic[worker], &photon);
+
+        if (caustic_only)
+            return;
+
+        // russian roulette: either absorb the photon, or bounce it with
+        // its power adjusted so that the estimate stays unbiased
+        struct vec3 albedo
+            = vec3_mul(&material->surface_color, material->diffuse_kn);
+        double survival = fmax(albedo.x, fmax(albedo.y, albedo.z));
+        if (survival <= 0 || rng_double(rng) >= survival)
+            return;
+
+        power = vec3_mul_vec(&power, &albedo);
+        power = vec3_mul(&power, 1. / survival);
+
+        struct vec3 normal = intersection.normal;
+        if (vec3_dot(&normal, &ray->direction) > 0)
+            vec3_neg(&normal);
+        struct vec3 offset = vec3_mul(&normal, PHOTON_EPSILON);
+        ray->source = vec3_add(&intersection.point, &offset);
+        ray->direction
+            = vec3_cosine_sample(&normal, rng_double(rng), rng_double(rng));
+        bounced = true;
+    }
+}
+
+static void trace_photon_chunk(void *ctx, size_t chunk, size_t worker)
+{
+    const struct photon_tracer *tracer = ctx;
+
+    struct rng rng;
+    rng_seed(&rng, chunk);
+
+    size_t start = chunk * PHOTON_CHUNK_SIZE;
+    size_t end = start + PHOTON_CHUNK_SIZE;
+    if (end > tracer->photon_count)
+        end = tracer->photon_count;
+
+    for (size_t i = start; i < end; i++)
+    {
+        // pick an emitter with a probability proportional to its flux
+        double pick = rng_double(&rng) * tracer->total_flux;
+        size_t e = 0;
+        while (e + 1 < tracer->emitter_count
+               && pick >= tracer->emitters[e].flux)
+            pick -= tracer->emitters[e++].flux;
+
+        const struct photon_emitter *emitter = &tracer->emitters[e];
+        struct ray ray;
+        emit_photon(tracer, emitter, &rng, &ray);
+
+        struct vec3 power = vec3_mul(&emitter->light->color,
+                                     emitter->light->intensity
+                                         * tracer->total_flux
+                                         / tracer->photon_count);
+        trace_photon(tracer, &ray, power, emitter->target != NULL, &rng,
+                     worker);
+    }
+}
+
+/*
+** Lists the emitters of the scene in emitters, if not NULL, and returns
+** how many there are.
+*/
+static size_t collect_emitters(const struct scene *scene,
+                               struct photon_emitter *emitters)
+{
+    size_t count = 0;
+    for (size_t l = 0; l < scene->light_count; l++)
+    {
+        const struct light *light = &scene->lights[l];
+        struct photon_emitter emitter = {.light = light};
+        switch (light->type)
+        {
+        case LIGHT_SPHERE:
+            // isotropic: the intensity is the same in all directions
+            emitter.flux = 4 * M_PI;
+            break;
+        case LIGHT_RECT:
+            // lambertian: the intensity falls off with the cosine
+            emitter.flux = M_PI;
+            break;
+        case LIGHT_DIRECTIONAL:
+            for (size_t s = 0; s < scene->sphere_count; s++)
+            {
+                const struct sphere *sphere = &scene->spheres[s];
+                if (scene_material(scene, s)->kind != MATERIAL_GLASS)
+                    continue;
+
+                emitter.target = sphere;
+                emitter.flux = M_PI * sphere->radius * sphere->radius;
+                if (emitters != NULL)
+                    emitters[count] = emitter;
+                count++;
+            }
+            continue;
+        }
+
+        if (emitters != NULL)
+            emitters[count] = emitter;
+        count++;
+    }
+    return count;
+}
+
+/*
+** Moves the k-th smallest photon of [lo, hi) along axis at position k,
+** with smaller photons before it, and larger photons after it.
+*/
+static void photon_select(struct photon *photons, size_t lo, size_t hi,
+                          size_t k, int axis)
+{
+    while (hi - lo > 1)
+    {
+        // median of three pivot
+        size_t mid = lo + (hi - lo) / 2;
+        double a = vec3_axis(&photons[lo].position, axis);
+        double b = vec3_axis(&photons[mid].position, axis);
+        double c = vec3_axis(&photons[hi - 1].position, axis);
+        double pivot = fmax(fmin(a, b), fmin(fmax(a, b), c));
+
+        size_t i = lo;
+        size_t j = hi - 1;
+        while (i <= j)
+        {
+            while (vec3_axis(&photons[i].position, axis) < pivot)
+                i++;
+            while (vec3_axis(&photons[j].position, axis) > pivot)
+                j--;
+            if (i > j)
+                break;
+
+            struct photon tmp = photons[i];
+            photons[i] = photons[j];
+            photons[j] = tmp;
+            i++;
+            if (j == 0)
+                break;
+            j--;
+        }
+
+        // [lo, j] <= pivot <= [i, hi)
+        if (k <= j)
+            hi = j + 1;
+        else if (k >= i)
+            lo = i;
+        else
+            return;
+    }
+}
+
+static int photon_split_axis(const struct photon *photons, size_t lo,
+                             size_t hi)
+{
+    struct vec3 min = photons[lo].position;
+    struct vec3 max = photons[lo].position;
+    for (size_t i = lo + 1; i < hi; i++)
+    {
+        vec3_update_min_components(&min, &photons[i].position);
+        vec3_update_max_components(&max, &photons[i].position);
+    }
+
+    struct vec3 extent = vec3_sub(&max, &min);
+    if (extent.x >= extent.y && extent.x >= extent.z)
+        return 0;
+    if (extent.y >= extent.z)
+        return 1;
+    return 2;
+}
+
+/*
+** Makes [lo, hi) a subtree node, and returns the position of its root
+*/
+static size_t photon_kd_node(struct photon *photons, size_t lo, size_t hi)
+{
+    size_t mid = lo + (hi - lo) / 2;
+    int axis = photon_split_axis(photons, lo, hi);
+    photon_select(photons, lo, hi, mid, axis);
+    photons[mid].axis = axis;
+    return mid;
+}
+
+static void photon_kd_build(struct photon *photons, size_t lo, size_t hi)
+{
+    if (hi - lo <= 1)
+        return;
+
+    size_t mid = photon_kd_node(photons, lo, hi);
+    photon_kd_build(photons, lo, mid);
+    photon_kd_build(photons, mid + 1, hi);
+}
+
+struct photon_kd_range
+{
+    size_t lo;
+    size_t hi;
+};
+
+struct photon_kd_job
+{
+    struct photon *photons;
+    struct photon_kd_range *ranges;
+};
+
+static void photon_kd_build_range(void *ctx, size_t index, size_t worker)
+{
+    (void)worker;
+    struct photon_kd_job *job = ctx;
+    struct photon_kd_range *range = &job->ranges[index];
+    photon_kd_build(job->photons, range->lo, range->hi);
+}
+
+/*
+** The top levels of the tree are built serially, until there are enough
+** independent subtrees to keep all threads busy.
+*/
+static void photon_map_build(struct photon_map *map, size_t thread_count)
+{
+    size_t target = 4 * thread_count;
+    struct photon_kd_range *ranges = xalloc(sizeof(*ranges) * 2 * target);
+    size_t range_count = 0;
+    ranges[range_count++] = (struct photon_kd_range){0, map->count};
+
+    while (range_count < target)
+    {
+        size_t next_count = 0;
+        struct photon_kd_range *next = xalloc(sizeof(*next) * 2 * range_count);
+        for (size_t i = 0; i < range_count; i++)
+        {
+            struct photon_kd_range *range = &ranges[i];
+            if (range->hi - range->lo <= 1)
+                continue;
+            size_t mid = photon_kd_node(map->photons, range->lo, range->hi);
+            next[next_count++] = (struct photon_kd_range){range->lo, mid};
+            next[next_count++] = (struct photon_kd_range){mid + 1, range->hi};
+        }
+        free(ranges);
+        ranges = next;
+        range_count = next_count;
+        if (range_count == 0)
+            break;
+    }
+
+    struct photon_kd_job job = {
+        .photons = map->photons,
+        .ranges = ranges,
+    };
+    parallel_for(thread_count, range_count, photon_kd_build_range, &job);
+    free(ranges);
+}
+
+static void photon_map_from_buffers(struct photon_map *map,
+                                    struct photon_buffer *buffers,
+                                    size_t thread_count)
+{
+    map->count = 0;
+    for (size_t i = 0; i < thread_count; i++)
+        map->count += buffers[i].count;
+
+    map->photons
+        = memory_alloc(MEMORY_CACHES, sizeof(*map->photons) * map->count);
+    size_t offset = 0;
+    for (size_t i = 0; i < thread_count; i++)
+    {
+        if (buffers[i].count)
+            memcpy(&map->photons[offset], buffers[i].photons,
+                   sizeof(*map->photons) * buffers[i].count);
+        offset += buffers[i].count;
+        free(buffers[i].photons);
+    }
+
+    photon_map_build(map, thread_count);
+}
+
+void photon_maps_build(struct photon_maps *maps, const struct scene *scene,
+                       size_t photon_count, size_t thread_count)
+{
+    struct photon_tracer tracer = {
+        .scene = scene,
+        .photon_count = photon_count,
+    };
+
+    tracer.emitter_count = collect_emitters(scene, NULL);
+    tracer.emitters = xalloc(sizeof(*tracer.emitters) * tracer.emitter_count);
+    collect_emitters(scene, tracer.emitters);
+    for (size_t i = 0; i < tracer.emitter_count; i++)
+        tracer.total_flux += tracer.emitters[i].flux;
+
+    for (size_t i = 0; i < scene->sphere_count; i++)
+    {
+        const struct sphere *sphere = &scene->spheres[i];
+        double reach = vec3_length(&sphere->center) + sphere->radius;
+        if (reach > tracer.scene_radius)
+            tracer.scene_radius = reach;
+    }
+
+    tracer.global = xalloc(sizeof(*tracer.global) * thread_count);
+    tracer.caustic = xalloc(sizeof(*tracer.caustic) * thread_count);
+    memset(tracer.global, 0, sizeof(*tracer.global) * thread_count);
+    memset(tracer.caustic, 0, sizeof(*tracer.caustic) * thread_count);
+
+    if (tracer.emitter_count != 0)
+    {
+        size_t chunk_count
+            = (photon_count + PHOTON_CHUNK_SIZE - 1) / PHOTON_CHUNK_SIZE;
+        parallel_for(thread_count, chunk_count, trace_photon_chunk, &tracer);
+    }
+
+    photon_map_from_buffers(&maps->global, tracer.global, thread_count);
+    photon_map_from_buffers(&maps->caustic, tracer.caustic, thread_count);
+
+    free(tracer.global);
+    free(tracer.caustic);
+    free(tracer.emitters);
+}
+
+void photon_maps_destroy(struct photon_maps *maps)
+{
+    memory_free(maps->global.photons);
+    memory_free(maps->caustic.photons);
+}
+
+/*
+** A bounded max-heap of the closest photons found so far
+*/
+struct photon_heap
+{
+    size_t k;
+    size_t count;
+    // the squared search radius, which shrinks once the heap is full
+    double max_dist2;
+    double dist2[PHOTON_GATHER_MAX];
+    const struct photon *photons[PHOTON_GATHER_MAX];
+};
+
+static void photon_heap_swap(struct photon_heap *heap, size_t a, size_t b)
+{
+    double dist2 = heap->dist2[a];
+    const struct photon *photon = heap->photons[a];
+    heap->dist2[a] = heap->dist2[b];
+    heap->photons[a] = heap->photons[b];
+    heap->dist2[b] = dist2;
+    heap->photons[b] = photon;
+}
+
+static void photon_heap_push(struct photon_heap *heap,
+                             const struct photon *photon, double dist2)
+{
+    if (heap->count < heap->k)
+    {
+        size_t i = heap->count++;
+        heap->dist2[i] = dist2;
+        heap->photons[i] = photon;
+        while (i > 0 && heap->dist2[(i - 1) / 2] < heap->dist2[i])
+        {
+            photon_heap_swap(heap, i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+        if (heap->count == heap->k)
+            heap->max_dist2 = heap->dist2[0];
+        return;
+    }
+
+    // replace the furthest photon
+    heap->dist2[0] = dist2;
+    heap->photons[0] = photon;
+    size_t i = 0;
+    for (;;)
+    {
+        size_t largest = i;
+        size_t left = 2 * i + 1;
+        size_t right = 2 * i + 2;
+        if (left < heap->count && heap->dist2[left] > heap->dist2[largest])
+            largest = left;
+        if (right < heap->count && heap->dist2[right] > heap->dist2[largest])
+            largest = right;
+        if (largest == i)
+            break;
+        photon_heap_swap(heap, i, largest);
+        i = largest;
+    }
+    heap->max_dist2 = heap->dist2[0];
+}
+
+static void photon_map_search(const struct photon_map *map, size_t lo,
+                              size_t hi, const struct vec3 *point,
+                              struct photon_heap *heap)
+{
+    if (lo >= hi)
+        return;
+
+    size_t mid = lo + (hi - lo) / 2;
+    const struct photon *photon = &map->photons[mid];
+    if (hi - lo > 1)
+    {
+        double delta = vec3_axis(point, photon->axis)
+                       - vec3_axis(&photon->position, photon->axis);
+        if (delta < 0)
+        {
+            photon_map_search(map, lo, mid, point, heap);
+            if (delta * delta < heap->max_dist2)
+                photon_map_search(map, mid + 1, hi, point, heap);
+        }
+        else
+        {
+            photon_map_search(map, mid + 1, hi, point, heap);
+            if (delta * delta < heap->max_dist2)
+                photon_map_search(map, lo, mid, point, heap);
+        }
+    }
+
+    struct vec3 offset = vec3_sub(&photon->position, point);
+    double dist2 = vec3_dot(&offset, &offset);
+    if (dist2 < heap->max_dist2)
+        photon_heap_push(heap, photon, dist2);
+}
+
+struct vec3 photon_map_irradiance(const struct photon_map *map,
+                                  const struct vec3 *point,
+                                  const struct vec3 *normal, size_t k,
+                                  double max_radius)
+{
+    struct vec3 res = {0};
+    if (map->count == 0)
+        return res;
+
+    struct photon_heap heap;
+    heap.k = k < PHOTON_GATHER_MAX ? k : PHOTON_GATHER_MAX;
+    heap.count = 0;
+    heap.max_dist2 = max_radius * max_radius;
+    photon_map_search(map, 0, map->count, point, &heap);
+    if (heap.count == 0)
+        return res;
+
+    for (size_t i = 0; i < heap.count; i++)
+    {
+        const struct photon *photon = heap.photons[i];
+        if (vec3_dot(&photon->direction, normal) >= 0)
+            continue;
+        res = vec3_add(&res, &photon->power);
+    }
+
+    // the photons are spread over a disk of the search radius
+    return vec3_mul(&res, 1. / (M_PI * heap.max_dist2));
+}
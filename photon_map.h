@@ -0,0 +1,64 @@
+#pragma once
+
+#include "scene.h"
+#include "vec3.h"
+
+#include <stddef.h>
+
+/*
+** Photon mapping (Jensen, 1996). Light paths are traced from the lights,
+** and every time they land on a diffuse surface, the light they carry is
+** recorded as a photon. At shading time, the irradiance at a point is
+** estimated from the density of the photons around it.
+**
+** Two maps are built: the caustic map holds photons which went through
+** glass only before landing (light focused by glass), the global map holds
+** photons which bounced off at least one diffuse surface (indirect light).
+** Direct lighting isn't stored, as it is computed exactly by the renderer.
+*/
+
+struct photon
+{
+    struct vec3 position;
+    // the direction the photon travels in
+    struct vec3 direction;
+    struct vec3 power;
+    // the kd-tree split axis, when this photon is an inner node
+    int axis;
+};
+
+/*
+** A balanced kd-tree of photons, stored implicitly: the root of the
+** subtree covering [lo, hi) is the photon at the middle of the range.
+*/
+struct photon_map
+{
+    struct photon *photons;
+    size_t count;
+};
+
+struct photon_maps
+{
+    struct photon_map global;
+    struct photon_map caustic;
+};
+
+/*
+** Traces photon_count photons from the lights of the scene, and builds
+** the photon maps. Both tracing and building are spread over thread_count
+** threads, each tracing into its own buffers. The set of photons stored
+** does not depend on the number of threads.
+*/
+void photon_maps_build(struct photon_maps *maps, const struct scene *scene,
+                       size_t photon_count, size_t thread_count);
+void photon_maps_destroy(struct photon_maps *maps);
+
+/*
+** Estimates the irradiance at a surface point, from the k photons closest
+** to it, no further than max_radius. Photons arriving from below the
+** surface are ignored.
+*/
+struct vec3 photon_map_irradiance(const struct photon_map *map,
+                                  const struct vec3 *point,
+                                  const struct vec3 *normal, size_t k,
+                                  double max_radius);
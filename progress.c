@@ -0,0 +1,113 @@
+#include "progress.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+uint64_t progress_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+struct progress_page *progress_create(const char *path, size_t thread_count,
+                                      size_t frame_count)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        warn("failed to create %s", path);
+        return NULL;
+    }
+
+    struct progress_page *res = MAP_FAILED;
+    if (ftruncate(fd, sizeof(*res)) == 0)
+        res = mmap(NULL, sizeof(*res), PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                   0);
+    close(fd);
+    if (res == MAP_FAILED)
+    {
+        warn("failed to map %s", path);
+        return NULL;
+    }
+
+    // the file was truncated, and is all zeros
+    res->version = PROGRESS_VERSION;
+    res->state = PROGRESS_RUNNING;
+    res->pid = getpid();
+    res->thread_count = thread_count;
+    res->frame_count = frame_count;
+    res->start_ns = progress_now_ns();
+    res->frame_start_ns = res->start_ns;
+    res->updated_ns = res->start_ns;
+    // readers only trust the page once the magic is there
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(res->magic, PROGRESS_MAGIC, sizeof(res->magic));
+    return res;
+}
+
+void progress_close(struct progress_page *page, enum progress_state state)
+{
+    __atomic_store_n(&page->updated_ns, progress_now_ns(), __ATOMIC_RELAXED);
+    __atomic_store_n(&page->state, state, __ATOMIC_RELEASE);
+    munmap(page, sizeof(*page));
+}
+
+const struct progress_page *progress_map(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+
+    struct stat st;
+    const struct progress_page *res = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(*res))
+        res = mmap(NULL, sizeof(*res), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (res == MAP_FAILED)
+        return NULL;
+
+    if (memcmp(res->magic, PROGRESS_MAGIC, sizeof(res->magic)) != 0
+        || res->version != PROGRESS_VERSION)
+    {
+        progress_unmap(res);
+        return NULL;
+    }
+    return res;
+}
+
+void progress_unmap(const struct progress_page *page)
+{
+    munmap((void *)page, sizeof(*page));
+}
+
+void progress_frame_start(struct progress_page *page, size_t tile_count)
+{
+    // workers are idle between frames
+    __atomic_store_n(&page->tiles_done, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&page->camera_rays, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&page->shadow_rays, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&page->tiles_total, tile_count, __ATOMIC_RELAXED);
+    __atomic_store_n(&page->frame_start_ns, progress_now_ns(),
+                     __ATOMIC_RELAXED);
+    __atomic_add_fetch(&page->frames_started, 1, __ATOMIC_RELAXED);
+}
+
+void progress_tile_done(struct progress_page *page, size_t worker,
+                        uint64_t busy_ns, size_t camera_rays,
+                        size_t shadow_rays)
+{
+    if (worker < PROGRESS_MAX_THREADS)
+        __atomic_add_fetch(&page->busy_ns[worker], busy_ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&page->camera_rays, camera_rays, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&page->shadow_rays, shadow_rays, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < MEMORY_CATEGORY_COUNT; i++)
+        __atomic_store_n(&page->memory[i], memory_used(i), __ATOMIC_RELAXED);
+    __atomic_store_n(&page->updated_ns, progress_now_ns(), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&page->tiles_done, 1, __ATOMIC_RELAXED);
+}
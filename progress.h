@@ -0,0 +1,85 @@
+#pragma once
+
+#include "memory.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+** Live counters of a running render, published in a small file which is
+** mapped shared, so that other processes can poll it while workers update
+** it. Workers only ever add to counters and store timestamps, with atomic
+** operations, and never lock. Readers may see counters of slightly
+** different instants. Rates, the remaining time and thread utilization
+** are derived by readers, from the counters and the CLOCK_MONOTONIC
+** timestamps, which all processes share. Files in /dev/shm are held in
+** shared memory.
+*/
+
+#define PROGRESS_MAGIC "rt-prog"
+#define PROGRESS_VERSION 1
+// threads past this many aren't accounted
+#define PROGRESS_MAX_THREADS 64
+
+enum progress_state
+{
+    PROGRESS_RUNNING = 0,
+    PROGRESS_DONE,
+    PROGRESS_CANCELLED,
+};
+
+struct progress_page
+{
+    char magic[8];
+    uint32_t version;
+    // an enum progress_state
+    uint32_t state;
+    uint64_t pid;
+    uint64_t thread_count;
+    // the frame being rendered is the last one started
+    uint64_t frames_started;
+    uint64_t frame_count;
+
+    // CLOCK_MONOTONIC, in nanoseconds
+    uint64_t start_ns;
+    uint64_t frame_start_ns;
+    // when a worker last finished a tile
+    uint64_t updated_ns;
+
+    // counted over the current frame
+    uint64_t tiles_done;
+    uint64_t tiles_total;
+    uint64_t camera_rays;
+    uint64_t shadow_rays;
+
+    // in bytes, as of the last tile done
+    uint64_t memory[MEMORY_CATEGORY_COUNT];
+    // how long each worker spent rendering tiles, since the start
+    uint64_t busy_ns[PROGRESS_MAX_THREADS];
+};
+
+uint64_t progress_now_ns(void);
+
+/*
+** Creates the file, and maps it. Returns NULL if it can't be created.
+*/
+struct progress_page *progress_create(const char *path, size_t thread_count,
+                                      size_t frame_count);
+void progress_close(struct progress_page *page, enum progress_state state);
+
+/*
+** Maps a file written by a running render, read-only. Returns NULL if it
+** isn't one.
+*/
+const struct progress_page *progress_map(const char *path);
+void progress_unmap(const struct progress_page *page);
+
+/*
+** Starts counting a new frame, which renders tile_count tiles.
+*/
+void progress_frame_start(struct progress_page *page, size_t tile_count);
+
+void progress_tile_done(struct progress_page *page, size_t worker,
+                        uint64_t busy_ns, size_t camera_rays,
+                        size_t shadow_rays);
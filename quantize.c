@@ -0,0 +1,90 @@
+#include "quantize.h"
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define QUANTIZE_HAS_AVX_PATH
+#endif
+
+/*
+** Values are converted to float before rounding, so that both paths give
+** the same bytes.
+*/
+static inline uint8_t quantize_component(double value)
+{
+    float res = value;
+    // also turns NaNs to 0
+    if (!(res > 0.f))
+        res = 0.f;
+    if (res > 1.f)
+        res = 1.f;
+    return lrintf(res * 255.f);
+}
+
+static void quantize_bgr_scalar(uint8_t *dst, const double *src, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        dst[3 * i + 0] = quantize_component(src[3 * i + 2]);
+        dst[3 * i + 1] = quantize_component(src[3 * i + 1]);
+        dst[3 * i + 2] = quantize_component(src[3 * i + 0]);
+    }
+}
+
+#ifdef QUANTIZE_HAS_AVX_PATH
+/*
+** Handles 4 pixels, 12 values, per iteration.
+*/
+__attribute__((target("avx"))) static void
+quantize_bgr_avx(uint8_t *dst, const double *src, size_t count)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 scale = _mm_set1_ps(255.f);
+    // swaps red and blue within each of the 4 pixels
+    const __m128i swizzle = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9,
+                                          -1, -1, -1, -1);
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i ints[3];
+        for (size_t k = 0; k < 3; k++)
+        {
+            __m256d doubles = _mm256_loadu_pd(&src[3 * i + 4 * k]);
+            __m128 values = _mm256_cvtpd_ps(doubles);
+            // the operand order maps NaNs to 0
+            values = _mm_max_ps(values, zero);
+            values = _mm_min_ps(values, one);
+            // rounds to nearest even, like lrintf
+            ints[k] = _mm_cvtps_epi32(_mm_mul_ps(values, scale));
+        }
+
+        __m128i words = _mm_packs_epi32(ints[0], ints[1]);
+        __m128i last_words = _mm_packs_epi32(ints[2], ints[2]);
+        __m128i bytes = _mm_packus_epi16(words, last_words);
+        bytes = _mm_shuffle_epi8(bytes, swizzle);
+
+        // 12 bytes: the next pixels may be past the end of the line
+        _mm_storel_epi64((__m128i *)&dst[3 * i], bytes);
+        int last = _mm_cvtsi128_si32(_mm_srli_si128(bytes, 8));
+        memcpy(&dst[3 * i + 8], &last, sizeof(last));
+    }
+
+    quantize_bgr_scalar(&dst[3 * i], &src[3 * i], count - i);
+}
+#endif
+
+void quantize_bgr(uint8_t *dst, const double *src, size_t count)
+{
+#ifdef QUANTIZE_HAS_AVX_PATH
+    if (__builtin_cpu_supports("avx"))
+    {
+        quantize_bgr_avx(dst, src, count);
+        return;
+    }
+#endif
+    quantize_bgr_scalar(dst, src, count);
+}
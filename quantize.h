@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+** Converts count rgb light values, given as consecutive doubles, to 24 bit
+** pixels stored in blue, green, red order, as bmp files do. Values are
+** clamped to [0, 1], then scaled to [0, 255] and rounded to the nearest
+** integer. Clamping, rounding and reordering happen in a single pass.
+*/
+void quantize_bgr(uint8_t *dst, const double *src, size_t count);
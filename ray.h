@@ -0,0 +1,15 @@
+#pragma once
+
+#include "vec3.h"
+
+struct ray
+{
+    struct vec3 source;
+    struct vec3 direction;
+};
+
+struct intersection
+{
+    struct vec3 point;
+    struct vec3 normal;
+};
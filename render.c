@@ -0,0 +1,1605 @@
+#include "memory.h"
+#include "quantize.h"
+#include "render.h"
+#include "rng.h"
+#include "utils.h"
+
+#include <err.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+** Area light shadows are sampled adaptively, on a stratified grid of
+** strata x strata samples. Every pixel first takes a few probe samples.
+** If all of them agree, the pixel is either fully lit or fully shadowed,
+** and the probes are good enough. If they disagree, the pixel is inside a
+** penumbra, and gets many more samples. As thin penumbras can be missed by
+** the probes, all other pixels of a tile containing a penumbra get an
+** intermediate number of samples.
+*/
+#define SHADOW_PROBE_STRATA 2
+#define SHADOW_TILE_STRATA 4
+#define SHADOW_PENUMBRA_STRATA 8
+
+// how far shadow rays start from the surface, to avoid self intersection
+#define SHADOW_EPSILON 1e-6
+
+/*
+** Once tile costs are known, consecutive cheap tiles along the curve are
+** grouped into work items costing about this many average tiles, and at
+** most WORK_ITEM_MAX_TILES tiles. Tiles costing more get an item of their
+** own. The scheduler can only switch jobs between items, which then never
+** take much longer than a tile. As frames have many more items than
+** threads, none is left with much more work than the others at the end.
+*/
+#define WORK_ITEM_COST 2
+#define WORK_ITEM_MAX_TILES 8
+
+// how many glass surfaces camera rays can go through
+#define PRIMARY_MAX_DEPTH 8
+
+/*
+** How many photons are used to estimate irradiance, and how far they can
+** be. Caustics are sharp features, and use a smaller radius.
+*/
+#define PHOTON_GLOBAL_GATHER 100
+#define PHOTON_GLOBAL_RADIUS 1.
+#define PHOTON_CAUSTIC_GATHER 50
+#define PHOTON_CAUSTIC_RADIUS 0.25
+
+/*
+** Maps a distance along a Hilbert curve covering a size x size square,
+** where size is a power of 2, to its coordinates.
+*/
+static void hilbert_point(size_t size, size_t d, size_t *x, size_t *y)
+{
+    *x = 0;
+    *y = 0;
+    for (size_t s = 1; s < size; s *= 2)
+    {
+        size_t rx = 1 & (d / 2);
+        size_t ry = 1 & (d ^ rx);
+        // rotate the quadrant
+        if (ry == 0)
+        {
+            if (rx == 1)
+            {
+                *x = s - 1 - *x;
+                *y = s - 1 - *y;
+            }
+            size_t tmp = *x;
+            *x = *y;
+            *y = tmp;
+        }
+        *x += s * rx;
+        *y += s * ry;
+        d /= 4;
+    }
+}
+
+static double elapsed_seconds(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static uint64_t pixel_seed(const struct rgb_image *image, size_t x, size_t y)
+{
+    return y * image->width + x;
+}
+
+static size_t tile_columns(const struct rgb_image *image)
+{
+    return (image->width + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+}
+
+static size_t tile_rows(const struct rgb_image *image)
+{
+    return (image->height + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+}
+
+static size_t tile_index(const struct rgb_image *image,
+                         const struct render_tile *tile)
+{
+    return (tile->y / RENDER_TILE_SIZE) * tile_columns(image)
+           + tile->x / RENDER_TILE_SIZE;
+}
+
+static struct ray shadow_ray(const struct intersection *intersection,
+                             const struct light_sample *sample)
+{
+    struct vec3 offset = vec3_mul(&intersection->normal, SHADOW_EPSILON);
+    struct ray res = {
+        .source = vec3_add(&intersection->point, &offset),
+        .direction = sample->direction,
+    };
+    vec3_neg(&res.direction);
+    return res;
+}
+
+/*
+** Shadow rays of neighbouring pixels are mostly blocked by the same sphere.
+** Each worker remembers the last one which blocked a light, and tests it
+** before going through the scene.
+*/
+static bool sample_visible(const struct renderer *renderer,
+                           size_t light_index,
+                           const struct intersection *intersection,
+                           const struct light_sample *sample,
+                           struct render_buffers *buffers)
+{
+    const struct scene *scene = renderer->scene;
+    struct ray ray = shadow_ray(intersection, sample);
+    buffers->shadow_rays++;
+
+    size_t *last = NULL;
+    if (light_index < RENDER_OCCLUDER_LIGHTS)
+        last = &buffers->last_occluders[light_index];
+    if (last != NULL && *last != SCENE_NO_OBJECT
+        && sphere_ray_distance(&ray, &scene->spheres[*last])
+               < sample->distance)
+    {
+        buffers->occluder_hits++;
+        if (buffers->hits != NULL)
+            object_set_add(buffers->hits, *last);
+        return false;
+    }
+
+    size_t occluder;
+    bool occluded;
+    if (renderer->shadow_grids != NULL
+        && !light_is_area(&scene->lights[light_index]))
+        occluded = shadow_grid_occluded(&renderer->shadow_grids[light_index],
+                                        scene->spheres, &ray, &occluder,
+                                        buffers->hits);
+    else
+        occluded = scene_occluded(scene, &ray, sample->distance, &occluder,
+                                  buffers->hits);
+    if (occluded && last != NULL)
+        *last = occluder;
+    return !occluded;
+}
+
+/*
+** Takes strata x strata stratified shadow samples of an area light, and
+** returns the average light reflected towards the camera. The number of
+** unoccluded samples is stored in visible_count.
+*/
+static struct light_contribution
+sample_area_light(const struct renderer *renderer, size_t light_index,
+                  uint64_t seed, size_t strata,
+                  const struct intersection *intersection,
+                  const struct ray *ray, const struct material *material,
+                  size_t *visible_count, struct render_buffers *buffers)
+{
+    const struct light *light = &renderer->scene->lights[light_index];
+    struct rng rng;
+    rng_seed(&rng, seed);
+
+    struct light_contribution res = {0};
+    size_t visible = 0;
+    for (size_t su = 0; su < strata; su++)
+        for (size_t sv = 0; sv < strata; sv++)
+        {
+            double u = (su + rng_double(&rng)) / strata;
+            double v = (sv + rng_double(&rng)) / strata;
+
+            struct light_sample sample;
+            light_sample(&sample, light, &intersection->point, u, v);
+            if (sample.attenuation <= 0
+                || !sample_visible(renderer, light_index, intersection,
+                                   &sample, buffers))
+                continue;
+
+            visible++;
+            struct light_contribution contribution
+                = shade_light(intersection, ray, material, light, &sample);
+            light_contribution_add(&res, &contribution);
+        }
+
+    *visible_count = visible;
+    light_contribution_scale(&res, 1. / (strata * strata));
+    return res;
+}
+
+static void shade_directional_light(const struct renderer *renderer,
+                                    size_t light_index,
+                                    const struct render_tile *tile,
+                                    struct render_buffers *buffers)
+{
+    const struct scene *scene = renderer->scene;
+    const struct light *light = &scene->lights[light_index];
+    size_t pixel_count = tile->width * tile->height;
+    for (size_t i = 0; i < pixel_count; i++)
+    {
+        if (isinf(buffers->distances[i]))
+            continue;
+
+        const struct intersection *intersection = &buffers->intersections[i];
+        struct light_sample sample;
+        light_sample(&sample, light, &intersection->point, 0.5, 0.5);
+        if (!sample_visible(renderer, light_index, intersection, &sample,
+                            buffers))
+            continue;
+
+        const struct material *material
+            = scene_material(scene, buffers->objects[i]);
+        struct light_contribution contribution = shade_light(
+            intersection, &buffers->rays[i], material, light, &sample);
+        light_contribution_add(&buffers->direct[i], &contribution);
+    }
+}
+
+static void shade_area_light(const struct renderer *renderer,
+                             size_t light_index,
+                             const struct render_tile *tile,
+                             struct render_buffers *buffers)
+{
+    const struct scene *scene = renderer->scene;
+    const struct rgb_image *image = renderer->image;
+    size_t pixel_count = tile->width * tile->height;
+    size_t probe_count = SHADOW_PROBE_STRATA * SHADOW_PROBE_STRATA;
+
+    // the sampling pattern only depends on the pixel and the light
+    uint64_t seeds[RENDER_TILE_PIXELS];
+    for (size_t i = 0; i < pixel_count; i++)
+    {
+        size_t x = tile->x + i % tile->width;
+        size_t y = tile->y + i / tile->width;
+        seeds[i] = pixel_seed(image, x, y) * scene->light_count + light_index;
+    }
+
+    bool tile_penumbra = false;
+    for (size_t i = 0; i < pixel_count; i++)
+    {
+        if (isinf(buffers->distances[i]))
+            continue;
+
+        const struct material *material
+            = scene_material(scene, buffers->objects[i]);
+        size_t visible;
+        buffers->probes[i] = sample_area_light(
+            renderer, light_index, seeds[i], SHADOW_PROBE_STRATA,
+            &buffers->intersections[i], &buffers->rays[i], material, &visible,
+            buffers);
+        buffers->probe_visible[i] = visible;
+        if (visible != 0 && visible != probe_count)
+            tile_penumbra = true;
+    }
+
+    for (size_t i = 0; i < pixel_count; i++)
+    {
+        if (isinf(buffers->distances[i]))
+            continue;
+
+        struct light_contribution contribution = buffers->probes[i];
+        size_t visible = buffers->probe_visible[i];
+        size_t strata = SHADOW_PROBE_STRATA;
+        if (visible != 0 && visible != probe_count)
+            strata = SHADOW_PENUMBRA_STRATA;
+        else if (tile_penumbra)
+            strata = SHADOW_TILE_STRATA;
+
+        if (strata != SHADOW_PROBE_STRATA)
+        {
+            const struct material *material
+                = scene_material(scene, buffers->objects[i]);
+            contribution = sample_area_light(
+                renderer, light_index, ~seeds[i], strata,
+                &buffers->intersections[i], &buffers->rays[i], material,
+                &visible, buffers);
+        }
+        light_contribution_add(&buffers->direct[i], &contribution);
+    }
+}
+
+/*
+** Estimates the fraction of ambient light reaching a surface point, by
+** casting cosine distributed rays over the hemisphere. The harmonic mean
+** distance to the occluders is stored in mean_distance, for the irradiance
+** cache.
+*/
+static double ambient_occlusion(const struct renderer *renderer,
+                                const struct intersection *intersection,
+                                uint64_t seed, double *mean_distance,
+                                struct object_set *hits)
+{
+    const struct render_options *options = &renderer->options;
+    size_t strata = sqrt(options->ao_samples);
+    if (strata == 0)
+        strata = 1;
+
+    struct rng rng;
+    rng_seed(&rng, seed);
+
+    struct vec3 offset = vec3_mul(&intersection->normal, SHADOW_EPSILON);
+    struct ray ray = {.source = vec3_add(&intersection->point, &offset)};
+
+    size_t occluded = 0;
+    double inverse_distance_sum = 0;
+    for (size_t su = 0; su < strata; su++)
+        for (size_t sv = 0; sv < strata; sv++)
+        {
+            double u = (su + rng_double(&rng)) / strata;
+            double v = (sv + rng_double(&rng)) / strata;
+            ray.direction = vec3_cosine_sample(&intersection->normal, u, v);
+
+            struct intersection hit;
+            size_t object;
+            double distance = scene_intersect(renderer->scene, &ray, &hit,
+                                              &object, hits);
+            if (distance < options->ao_distance)
+                occluded++;
+            else
+                distance = options->ao_distance;
+            inverse_distance_sum += 1. / distance;
+        }
+
+    size_t sample_count = strata * strata;
+    *mean_distance = sample_count / inverse_distance_sum;
+    return 1. - (double)occluded / sample_count;
+}
+
+static double ambient_factor(struct renderer *renderer,
+                             const struct intersection *intersection,
+                             uint64_t seed, struct object_set *hits)
+{
+    double mean_distance;
+    double res;
+    switch (renderer->options.ambient)
+    {
+    case AMBIENT_CONSTANT:
+        break;
+    case AMBIENT_OCCLUSION_BRUTE:
+        return ambient_occlusion(renderer, intersection, seed, &mean_distance,
+                                 hits);
+    case AMBIENT_OCCLUSION_CACHED:
+    {
+        pthread_rwlock_rdlock(&renderer->ao_cache_lock);
+        bool found
+            = irradiance_cache_lookup(&renderer->ao_cache, &intersection->point,
+                                      &intersection->normal, &res);
+        pthread_rwlock_unlock(&renderer->ao_cache_lock);
+        if (found)
+            return res;
+
+        // the sample is computed outside of the lock. Another worker may
+        // compute a sample nearby at the same time, which is harmless
+        res = ambient_occlusion(renderer, intersection, seed, &mean_distance,
+                                hits);
+        // under memory pressure, caches are dropped rather than grown. This
+        // one can't be while it's locked, and the sample is left out if
+        // there still is no room for it
+        if (!memory_fits(sizeof(struct irradiance_record)))
+            return res;
+        pthread_rwlock_wrlock(&renderer->ao_cache_lock);
+        irradiance_cache_insert(&renderer->ao_cache, &intersection->point,
+                                &intersection->normal, res, mean_distance);
+        pthread_rwlock_unlock(&renderer->ao_cache_lock);
+        return res;
+    }
+    }
+    return 1.;
+}
+
+/*
+** Finds the first opaque surface seen by a camera ray. Glass surfaces
+** along the way refract the ray (or reflect it, when refraction is
+** impossible), and tint the light reaching the camera. The ray is updated
+** to the last segment of the path. Returns the length of the whole path.
+** Camera rays are intersected in packets beforehand: distance and object
+** are where the first segment hits. If hits is not NULL, the objects hit
+** are added to it, and the surfaces hit to bounds.
+*/
+static double trace_primary(const struct scene *scene, struct ray *ray,
+                            double distance, struct intersection *intersection,
+                            size_t *object, struct vec3 *throughput,
+                            struct object_set *hits, struct aabb *bounds)
+{
+    *throughput = (struct vec3){1, 1, 1};
+    double path_length = 0;
+    if (!isinf(distance))
+        sphere_ray_intersect(intersection, ray, &scene->spheres[*object]);
+
+    for (size_t depth = 0; depth < PRIMARY_MAX_DEPTH; depth++)
+    {
+        if (depth > 0)
+            distance
+                = scene_intersect(scene, ray, intersection, object, hits);
+        if (isinf(distance))
+        {
+            // the tile depends on whatever refracted rays may now hit
+            if (hits != NULL && depth > 0)
+                hits->overflow = true;
+            return distance;
+        }
+
+        if (hits != NULL)
+            aabb_add_point(bounds, &intersection->point);
+        path_length += distance;
+        const struct material *material = scene_material(scene, *object);
+        if (material->kind != MATERIAL_GLASS)
+            return path_length;
+
+        glass_scatter(ray, intersection, material, 1.);
+        *throughput = vec3_mul_vec(throughput, &material->surface_color);
+    }
+    return INFINITY;
+}
+
+/*
+** Adds the indirect and caustic lighting estimated from the photon maps
+*/
+static void shade_photons(const struct renderer *renderer, size_t i,
+                          struct render_buffers *buffers)
+{
+    const struct scene *scene = renderer->scene;
+    const struct photon_maps *maps = &renderer->photon_maps;
+    const struct intersection *intersection = &buffers->intersections[i];
+
+    struct vec3 global = photon_map_irradiance(
+        &maps->global, &intersection->point, &intersection->normal,
+        PHOTON_GLOBAL_GATHER, PHOTON_GLOBAL_RADIUS);
+    struct vec3 caustic = photon_map_irradiance(
+        &maps->caustic, &intersection->point, &intersection->normal,
+        PHOTON_CAUSTIC_GATHER, PHOTON_CAUSTIC_RADIUS);
+    struct vec3 irradiance = vec3_add(&global, &caustic);
+
+    // photons carry light the same way a light sample does, and get
+    // reflected the same way diffuse light is
+    const struct material *material
+        = scene_material(scene, buffers->objects[i]);
+    struct vec3 reflected
+        = vec3_mul_vec(&irradiance, &material->surface_color);
+    reflected = vec3_mul(&reflected, material->diffuse_kn);
+    buffers->indirect[i] = reflected;
+}
+
+// colors are read as consecutive doubles
+STATIC_ASSERT(vec3_packed, sizeof(struct vec3) == 3 * sizeof(double));
+
+// the layers of a render tile are written as a single tile
+STATIC_ASSERT(aov_tile_size, AOV_TILE_SIZE == RENDER_TILE_SIZE);
+
+static void store_aovs(struct renderer *renderer, size_t i,
+                       struct render_buffers *buffers)
+{
+    struct aov_tile *aovs = &buffers->aovs;
+    if (isinf(buffers->distances[i]))
+    {
+        aov_clear(aovs, i);
+        return;
+    }
+
+    const struct material *material
+        = scene_material(renderer->scene, buffers->objects[i]);
+    struct vec3 albedo
+        = vec3_mul_vec(&material->surface_color, &buffers->throughputs[i]);
+
+    aov_set_vec3(aovs, AOV_BEAUTY, i, &buffers->colors[i]);
+    aov_set_scalar(aovs, AOV_DEPTH, i, buffers->distances[i]);
+    aov_set_vec3(aovs, AOV_NORMAL, i, &buffers->intersections[i].normal);
+    aov_set_vec3(aovs, AOV_ALBEDO, i, &albedo);
+    size_t id = scene_object_id(renderer->scene, buffers->objects[i]);
+    aov_set_scalar(aovs, AOV_OBJECT_ID, i, id + 1);
+    aov_set_vec3(aovs, AOV_AMBIENT, i, &buffers->ambient[i]);
+    aov_set_vec3(aovs, AOV_DIFFUSE, i, &buffers->direct[i].diffuse);
+    aov_set_vec3(aovs, AOV_SPECULAR, i, &buffers->direct[i].specular);
+    aov_set_vec3(aovs, AOV_INDIRECT, i, &buffers->indirect[i]);
+}
+
+static struct render_gbuffer_pixel *
+gbuffer_tile(const struct renderer *renderer, const struct render_tile *tile)
+{
+    size_t index = tile_index(renderer->image, tile);
+    return &renderer->gbuffer.pixels[RENDER_TILE_PIXELS * index];
+}
+
+static void store_gbuffer(struct render_gbuffer_pixel *gbuffer,
+                          size_t pixel_count,
+                          const struct render_buffers *buffers)
+{
+    for (size_t i = 0; i < pixel_count; i++)
+        gbuffer[i] = (struct render_gbuffer_pixel){
+            .intersection = buffers->intersections[i],
+            .direction = buffers->rays[i].direction,
+            .throughput = buffers->throughputs[i],
+            .distance = buffers->distances[i],
+            .object = buffers->objects[i],
+        };
+}
+
+/*
+** Fills the buffers as the ray generation and intersection stages would,
+** and returns the number of hits.
+*/
+static size_t load_gbuffer(const struct render_gbuffer_pixel *gbuffer,
+                           size_t pixel_count, struct render_buffers *buffers)
+{
+    size_t hit_count = 0;
+    for (size_t i = 0; i < pixel_count; i++)
+    {
+        if (buffers->reprojected[i])
+        {
+            buffers->distances[i] = INFINITY;
+            continue;
+        }
+
+        const struct render_gbuffer_pixel *pixel = &gbuffer[i];
+        // shading only looks at the direction of the ray
+        buffers->rays[i] = (struct ray){.direction = pixel->direction};
+        buffers->intersections[i] = pixel->intersection;
+        buffers->throughputs[i] = pixel->throughput;
+        buffers->distances[i] = pixel->distance;
+        buffers->objects[i] = pixel->object;
+        hit_count += !isinf(pixel->distance);
+    }
+    return hit_count;
+}
+
+/*
+** A surface which a nearby pixel sees much closer, and at another angle,
+** may hide this one: it only left a hole because it got magnified.
+*/
+#define REPROJECT_DEPTH_TOLERANCE 0.05
+#define REPROJECT_NORMAL_TOLERANCE 0.9
+
+static bool reprojection_occluded(const struct render_history_pixel *pixels,
+                                  size_t width, size_t height, size_t x,
+                                  size_t y)
+{
+    const struct render_history_pixel *pixel = &pixels[width * y + x];
+    double max_depth = pixel->depth * (1 - REPROJECT_DEPTH_TOLERANCE);
+    for (size_t ny = y ? y - 1 : y; ny <= y + 1 && ny < height; ny++)
+        for (size_t nx = x ? x - 1 : x; nx <= x + 1 && nx < width; nx++)
+        {
+            const struct render_history_pixel *other = &pixels[width * ny + nx];
+            if (other->depth < max_depth
+                && vec3_dot(&other->normal, &pixel->normal)
+                       < REPROJECT_NORMAL_TOLERANCE)
+                return true;
+        }
+    return false;
+}
+
+/*
+** Moves the surfaces seen by the previous frame to where the current camera
+** sees them. The closest surface wins each pixel. Surfaces which now face
+** away, may be hidden, or are due for a refresh are dropped.
+*/
+static void reproject_history(struct renderer *renderer)
+{
+    const struct camera *camera = &renderer->scene->camera;
+    struct render_history *history = &renderer->history;
+    size_t width = renderer->image->width;
+    size_t height = renderer->image->height;
+    size_t pixel_count = width * height;
+
+    for (size_t i = 0; i < pixel_count; i++)
+        history->reprojected[i] = (struct render_history_pixel){
+            .depth = INFINITY,
+            .valid = false,
+        };
+
+    struct vec3 vantage_point_offset
+        = vec3_mul(&camera->forward, -camera->focal_distance);
+    struct vec3 vantage_point
+        = vec3_add(&vantage_point_offset, &camera->center);
+    for (size_t i = 0; i < pixel_count; i++)
+    {
+        const struct render_history_pixel *pixel = &history->pixels[i];
+        if (!pixel->valid)
+            continue;
+
+        struct vec3 view = vec3_sub(&pixel->point, &vantage_point);
+        if (vec3_dot(&view, &pixel->normal) >= 0)
+            continue;
+
+        double cam_x, cam_y, depth;
+        if (!camera_project(camera, &pixel->point, &cam_x, &cam_y, &depth))
+            continue;
+
+        // pixels are cast through their corner, see render_tile
+        double x = round((cam_x + 0.5) * width);
+        double y = round((cam_y + 0.5) * height);
+        if (x < 0 || y < 0 || x >= width || y >= height)
+            continue;
+
+        struct render_history_pixel *target
+            = &history->reprojected[width * (size_t)y + (size_t)x];
+        if (depth >= target->depth)
+            continue;
+
+        *target = *pixel;
+        target->depth = depth;
+    }
+
+    size_t count = 0;
+    size_t period = renderer->options.refresh_period;
+    for (size_t y = 0; y < height; y++)
+        for (size_t x = 0; x < width; x++)
+        {
+            struct render_history_pixel *pixel
+                = &history->reprojected[width * y + x];
+            if (!pixel->valid)
+                continue;
+
+            // each pixel is refreshed once per period, at a random frame
+            uint64_t seed = pixel_seed(renderer->image, x, y);
+            bool refresh = (rng_mix(seed) + history->frame) % period == 0;
+            if (refresh
+                || reprojection_occluded(history->reprojected, width, height,
+                                         x, y))
+                pixel->valid = false;
+            else
+                count++;
+        }
+    history->reprojected_count = count;
+}
+
+static void mark_reprojected(const struct renderer *renderer,
+                             const struct render_tile *tile,
+                             struct render_buffers *buffers)
+{
+    size_t pixel_count = tile->width * tile->height;
+    if (renderer->history.reprojected_count == 0)
+    {
+        memset(buffers->reprojected, 0, pixel_count);
+        return;
+    }
+
+    size_t width = renderer->image->width;
+    for (size_t i = 0; i < pixel_count; i++)
+    {
+        size_t x = tile->x + i % tile->width;
+        size_t y = tile->y + i / tile->width;
+        buffers->reprojected[i]
+            = renderer->history.reprojected[width * y + x].valid;
+    }
+}
+
+/*
+** Records what traced pixels show, for the next frame. Surfaces seen
+** through glass can't be reprojected.
+*/
+static void store_history(struct renderer *renderer,
+                          const struct render_tile *tile,
+                          const struct render_buffers *buffers)
+{
+    size_t width = renderer->image->width;
+    size_t pixel_count = tile->width * tile->height;
+    for (size_t i = 0; i < pixel_count; i++)
+    {
+        if (buffers->reprojected[i])
+            continue;
+
+        size_t x = tile->x + i % tile->width;
+        size_t y = tile->y + i / tile->width;
+        const struct vec3 *throughput = &buffers->throughputs[i];
+        bool direct = throughput->x == 1 && throughput->y == 1
+                      && throughput->z == 1;
+        renderer->history.reprojected[width * y + x]
+            = (struct render_history_pixel){
+                  .point = buffers->intersections[i].point,
+                  .normal = buffers->intersections[i].normal,
+                  .color = buffers->colors[i],
+                  .valid = !isinf(buffers->distances[i]) && direct,
+              };
+    }
+}
+
+STATIC_ASSERT(packet_size,
+              RENDER_PACKET_SIZE * RENDER_PACKET_SIZE <= BVH_PACKET_SIZE);
+
+/*
+** Finds where camera rays first hit, block by block. Reprojected pixels
+** are not traced, and get an infinite distance.
+*/
+static void intersect_packets(const struct scene *scene,
+                              const struct render_tile *tile,
+                              struct render_buffers *buffers)
+{
+    size_t indices[BVH_PACKET_SIZE];
+    struct bvh_packet packet;
+    for (size_t block_y = 0; block_y < tile->height;
+         block_y += RENDER_PACKET_SIZE)
+        for (size_t block_x = 0; block_x < tile->width;
+             block_x += RENDER_PACKET_SIZE)
+        {
+            packet.count = 0;
+            for (size_t y = block_y;
+                 y < tile->height && y < block_y + RENDER_PACKET_SIZE; y++)
+                for (size_t x = block_x;
+                     x < tile->width && x < block_x + RENDER_PACKET_SIZE; x++)
+                {
+                    size_t i = y * tile->width + x;
+                    buffers->distances[i] = INFINITY;
+                    if (buffers->reprojected[i])
+                        continue;
+
+                    indices[packet.count] = i;
+                    packet.rays[packet.count++] = &buffers->rays[i];
+                }
+
+            scene_intersect_packet(scene, &packet, buffers->hits);
+            for (size_t r = 0; r < packet.count; r++)
+            {
+                buffers->distances[indices[r]] = packet.distances[r];
+                buffers->objects[indices[r]] = packet.objects[r];
+            }
+        }
+}
+
+static int id_compare(const void *a, const void *b)
+{
+    const size_t *ia = a;
+    const size_t *ib = b;
+    return (*ia > *ib) - (*ia < *ib);
+}
+
+static void store_tile_deps(struct renderer *renderer,
+                            const struct render_tile *tile,
+                            const struct render_buffers *buffers)
+{
+    const struct object_set *hits = buffers->hits;
+    struct render_tile_deps *deps
+        = &renderer->tile_deps[tile_index(renderer->image, tile)];
+
+    free(deps->objects);
+    deps->objects = NULL;
+    deps->object_count = 0;
+    deps->overflow = hits->overflow;
+    deps->receivers = buffers->receivers;
+    if (hits->overflow || hits->count == 0)
+        return;
+
+    // the set holds indices, which change when the scene is sorted again
+    deps->objects = xalloc(sizeof(*deps->objects) * hits->count);
+    for (size_t i = 0; i < OBJECT_SET_SLOTS; i++)
+        if (hits->slots[i] != OBJECT_SET_EMPTY)
+            deps->objects[deps->object_count++]
+                = scene_object_id(renderer->scene, hits->slots[i]);
+    qsort(deps->objects, deps->object_count, sizeof(*deps->objects),
+          id_compare);
+}
+
+void render_tile(struct renderer *renderer, const struct render_tile *tile,
+                 struct render_buffers *buffers, struct perf_counters *perf)
+{
+    const struct scene *scene = renderer->scene;
+    struct rgb_image *image = renderer->image;
+    size_t pixel_count = tile->width * tile->height;
+
+    struct render_gbuffer_pixel *gbuffer = NULL;
+    if (renderer->options.gbuffer)
+        gbuffer = gbuffer_tile(renderer, tile);
+
+    // reprojected pixels are neither traced nor shaded
+    mark_reprojected(renderer, tile, buffers);
+
+    buffers->hits = NULL;
+    if (renderer->tile_deps != NULL)
+    {
+        buffers->hits = &buffers->hit_set;
+        object_set_clear(buffers->hits);
+        buffers->receivers = aabb_empty();
+    }
+
+    size_t hit_count = 0;
+    if (gbuffer != NULL && renderer->gbuffer.valid)
+        hit_count = load_gbuffer(gbuffer, pixel_count, buffers);
+    else
+    {
+        perf_stage_begin(perf);
+        for (size_t i = 0; i < pixel_count; i++)
+        {
+            if (buffers->reprojected[i])
+                continue;
+
+            size_t x = tile->x + i % tile->width;
+            size_t y = tile->y + i / tile->width;
+            double cam_x = ((double)x / image->width) - 0.5;
+            double cam_y = ((double)y / image->height) - 0.5;
+
+            camera_cast_ray(&buffers->rays[i], &scene->camera, cam_x, cam_y);
+        }
+        perf_stage_end(perf, PERF_STAGE_RAY_GEN, pixel_count);
+
+        perf_stage_begin(perf);
+        intersect_packets(scene, tile, buffers);
+        for (size_t i = 0; i < pixel_count; i++)
+        {
+            if (buffers->reprojected[i])
+                continue;
+
+            buffers->distances[i] = trace_primary(
+                scene, &buffers->rays[i], buffers->distances[i],
+                &buffers->intersections[i], &buffers->objects[i],
+                &buffers->throughputs[i], buffers->hits, &buffers->receivers);
+            hit_count += !isinf(buffers->distances[i]);
+        }
+        perf_stage_end(perf, PERF_STAGE_INTERSECT, pixel_count);
+
+        if (gbuffer != NULL)
+            store_gbuffer(gbuffer, pixel_count, buffers);
+    }
+
+    perf_stage_begin(perf);
+    for (size_t i = 0; i < pixel_count; i++)
+    {
+        // if the intersection distance is infinite, do not shade the pixel
+        if (isinf(buffers->distances[i]))
+            continue;
+
+        const struct material *material
+            = scene_material(scene, buffers->objects[i]);
+        size_t x = tile->x + i % tile->width;
+        size_t y = tile->y + i / tile->width;
+        double ambient
+            = ambient_factor(renderer, &buffers->intersections[i],
+                             pixel_seed(image, x, y), buffers->hits);
+        buffers->ambient[i]
+            = shade_ambient(material, scene->ambient_intensity * ambient);
+        buffers->direct[i] = (struct light_contribution){0};
+        buffers->indirect[i] = (struct vec3){0};
+    }
+
+    for (size_t l = 0; l < scene->light_count; l++)
+    {
+        if (light_is_area(&scene->lights[l]))
+            shade_area_light(renderer, l, tile, buffers);
+        else
+            shade_directional_light(renderer, l, tile, buffers);
+    }
+
+    for (size_t i = 0; i < pixel_count; i++)
+    {
+        // the background is black
+        if (isinf(buffers->distances[i]))
+        {
+            buffers->colors[i] = (struct vec3){0};
+            continue;
+        }
+
+        if (renderer->options.photon_count)
+            shade_photons(renderer, i, buffers);
+
+        // only part of the light makes it through glass
+        const struct vec3 *throughput = &buffers->throughputs[i];
+        buffers->ambient[i] = vec3_mul_vec(&buffers->ambient[i], throughput);
+        buffers->direct[i].diffuse
+            = vec3_mul_vec(&buffers->direct[i].diffuse, throughput);
+        buffers->direct[i].specular
+            = vec3_mul_vec(&buffers->direct[i].specular, throughput);
+        buffers->indirect[i] = vec3_mul_vec(&buffers->indirect[i], throughput);
+
+        struct vec3 *color = &buffers->colors[i];
+        *color = vec3_add(&buffers->ambient[i], &buffers->direct[i].diffuse);
+        *color = vec3_add(color, &buffers->direct[i].specular);
+        *color = vec3_add(color, &buffers->indirect[i]);
+    }
+    perf_stage_end(perf, PERF_STAGE_SHADE, hit_count);
+
+    perf_stage_begin(perf);
+    if (renderer->options.reproject)
+    {
+        size_t width = image->width;
+        for (size_t i = 0; i < pixel_count; i++)
+        {
+            if (!buffers->reprojected[i])
+                continue;
+
+            size_t x = tile->x + i % tile->width;
+            size_t y = tile->y + i / tile->width;
+            buffers->colors[i]
+                = renderer->history.reprojected[width * y + x].color;
+        }
+        store_history(renderer, tile, buffers);
+    }
+
+    // lines of the tile go straight to where the file format wants them
+    for (size_t line = 0; line < tile->height; line++)
+    {
+        uint8_t *dst = rgb_image_line(image, tile->y + line) + 3 * tile->x;
+        const struct vec3 *src = &buffers->colors[tile->width * line];
+        quantize_bgr(dst, &src->x, tile->width);
+    }
+
+    if (renderer->aovs != NULL)
+    {
+        for (size_t i = 0; i < pixel_count; i++)
+            store_aovs(renderer, i, buffers);
+        if (aov_file_write_tile(renderer->aovs, tile->x, tile->y,
+                                &buffers->aovs))
+            err(1, "failed to write the aov output file");
+    }
+
+    if (buffers->hits != NULL)
+        store_tile_deps(renderer, tile, buffers);
+    perf_stage_end(perf, PERF_STAGE_OUTPUT, pixel_count);
+}
+
+static void snapshot_materials(struct renderer *renderer)
+{
+    const struct scene *scene = renderer->scene;
+    size_t size = sizeof(*scene->materials) * scene->material_count;
+    free(renderer->gbuffer_materials);
+    renderer->gbuffer_materials = xalloc(size);
+    memcpy(renderer->gbuffer_materials, scene->materials, size);
+}
+
+/*
+** Drops the ambient occlusion cache, unless a worker is adding to it. Its
+** samples are computed again as needed.
+*/
+static bool shrink_ao_cache(void *ctx)
+{
+    struct renderer *renderer = ctx;
+    if (pthread_rwlock_trywrlock(&renderer->ao_cache_lock) != 0)
+        return false;
+
+    bool res = renderer->ao_cache.record_count != 0;
+    irradiance_cache_clear(&renderer->ao_cache);
+    pthread_rwlock_unlock(&renderer->ao_cache_lock);
+    return res;
+}
+
+/*
+** Area lights keep an empty grid, which is never used
+*/
+static void build_shadow_grids(struct renderer *renderer)
+{
+    const struct scene *scene = renderer->scene;
+    for (size_t i = 0; i < scene->light_count; i++)
+    {
+        const struct light *light = &scene->lights[i];
+        size_t sphere_count = light_is_area(light) ? 0 : scene->sphere_count;
+        shadow_grid_build(&renderer->shadow_grids[i], &light->direction,
+                          scene->spheres, sphere_count);
+    }
+}
+
+static void destroy_shadow_grids(struct renderer *renderer)
+{
+    for (size_t i = 0; i < renderer->scene->light_count; i++)
+        shadow_grid_destroy(&renderer->shadow_grids[i]);
+}
+
+void renderer_init(struct renderer *renderer, const struct scene *scene,
+                   struct rgb_image *image,
+                   const struct render_options *options)
+{
+    renderer->scene = scene;
+    renderer->image = image;
+    renderer->aovs = NULL;
+    renderer->options = *options;
+    // tracked tiles record every ray they depend on, so they are always
+    // traced in full
+    if (options->track_edits)
+    {
+        renderer->options.gbuffer = false;
+        renderer->options.reproject = false;
+    }
+    options = &renderer->options;
+
+    renderer->scheduler = options->scheduler;
+    renderer->owns_scheduler = renderer->scheduler == NULL;
+    if (renderer->owns_scheduler)
+    {
+        renderer->scheduler = xalloc(sizeof(*renderer->scheduler));
+        scheduler_init(renderer->scheduler, options->thread_count);
+    }
+    // per worker buffers and counters are indexed by pool thread
+    renderer->options.thread_count = renderer->scheduler->thread_count;
+    renderer->job = NULL;
+
+    double ao_distance = options->ao_distance;
+    irradiance_cache_init(&renderer->ao_cache, options->ao_cache_error,
+                          ao_distance / 100, ao_distance);
+    pthread_rwlock_init(&renderer->ao_cache_lock, NULL);
+
+    memset(&renderer->photon_maps, 0, sizeof(renderer->photon_maps));
+    if (options->photon_count)
+        photon_maps_build(&renderer->photon_maps, scene, options->photon_count,
+                          options->thread_count);
+
+    renderer->shadow_grids = NULL;
+    if (options->shadow_grids)
+    {
+        renderer->shadow_grids = xalloc(sizeof(*renderer->shadow_grids)
+                                        * scene->light_count);
+        build_shadow_grids(renderer);
+    }
+
+    renderer->gbuffer.pixels = NULL;
+    renderer->gbuffer.valid = false;
+    renderer->gbuffer_materials = NULL;
+    if (options->gbuffer)
+    {
+        // edge tiles take as much room as the others
+        renderer->gbuffer.pixels = memory_alloc(
+            MEMORY_FRAMEBUFFERS, sizeof(*renderer->gbuffer.pixels)
+                                     * RENDER_TILE_PIXELS
+                                     * tile_columns(image) * tile_rows(image));
+        snapshot_materials(renderer);
+    }
+
+    memset(&renderer->history, 0, sizeof(renderer->history));
+    if (options->reproject)
+    {
+        size_t size = sizeof(*renderer->history.pixels) * image->width
+                      * image->height;
+        renderer->history.pixels = memory_alloc(MEMORY_FRAMEBUFFERS, size);
+        renderer->history.reprojected
+            = memory_alloc(MEMORY_FRAMEBUFFERS, size);
+    }
+
+    // neighbouring tiles see the same objects, and are rendered together
+    size_t columns = tile_columns(image);
+    size_t rows = tile_rows(image);
+    size_t curve_size = 1;
+    while (curve_size < columns || curve_size < rows)
+        curve_size *= 2;
+    renderer->tile_order = memory_alloc(
+        MEMORY_FRAMEBUFFERS, sizeof(*renderer->tile_order) * columns * rows);
+    size_t order_count = 0;
+    for (size_t d = 0; d < curve_size * curve_size; d++)
+    {
+        size_t x, y;
+        hilbert_point(curve_size, d, &x, &y);
+        if (x < columns && y < rows)
+            renderer->tile_order[order_count++] = y * columns + x;
+    }
+    renderer->tile_costs = memory_alloc(
+        MEMORY_FRAMEBUFFERS, sizeof(*renderer->tile_costs) * columns * rows);
+    renderer->tile_costs_valid = false;
+
+    renderer->covered_tiles
+        = memory_alloc(MEMORY_FRAMEBUFFERS, columns * rows);
+    memset(renderer->covered_tiles, 0, columns * rows);
+    renderer->covered_tile_count = 0;
+
+    renderer->tile_deps = NULL;
+    renderer->dirty_tiles = NULL;
+    renderer->rendered_tile_count = 0;
+    renderer->work_item_count = 0;
+    renderer->shadow_rays = 0;
+    renderer->occluder_hits = 0;
+    if (options->track_edits)
+    {
+        size_t tile_count = tile_columns(image) * tile_rows(image);
+        renderer->tile_deps = memory_alloc(
+            MEMORY_FRAMEBUFFERS, sizeof(*renderer->tile_deps) * tile_count);
+        memset(renderer->tile_deps, 0,
+               sizeof(*renderer->tile_deps) * tile_count);
+        // the first frame renders everything
+        renderer->dirty_tiles = memory_alloc(MEMORY_FRAMEBUFFERS, tile_count);
+        memset(renderer->dirty_tiles, 1, tile_count);
+    }
+
+    renderer->ao_cache_shrinker = (struct memory_shrinker){
+        .fn = shrink_ao_cache,
+        .ctx = renderer,
+    };
+    if (options->ambient == AMBIENT_OCCLUSION_CACHED)
+        memory_add_shrinker(&renderer->ao_cache_shrinker);
+}
+
+void renderer_destroy(struct renderer *renderer)
+{
+    if (renderer->owns_scheduler)
+    {
+        scheduler_destroy(renderer->scheduler);
+        free(renderer->scheduler);
+    }
+
+    if (renderer->options.ambient == AMBIENT_OCCLUSION_CACHED)
+        memory_remove_shrinker(&renderer->ao_cache_shrinker);
+    irradiance_cache_destroy(&renderer->ao_cache);
+    pthread_rwlock_destroy(&renderer->ao_cache_lock);
+    photon_maps_destroy(&renderer->photon_maps);
+    if (renderer->shadow_grids != NULL)
+        destroy_shadow_grids(renderer);
+    free(renderer->shadow_grids);
+    memory_free(renderer->gbuffer.pixels);
+    free(renderer->gbuffer_materials);
+    memory_free(renderer->history.pixels);
+    memory_free(renderer->history.reprojected);
+
+    if (renderer->tile_deps != NULL)
+    {
+        size_t tile_count
+            = tile_columns(renderer->image) * tile_rows(renderer->image);
+        for (size_t i = 0; i < tile_count; i++)
+            free(renderer->tile_deps[i].objects);
+    }
+    memory_free(renderer->tile_deps);
+    memory_free(renderer->dirty_tiles);
+    memory_free(renderer->tile_order);
+    memory_free(renderer->tile_costs);
+    memory_free(renderer->covered_tiles);
+}
+
+/*
+** Returns whether camera rays could take another path through glass
+*/
+static bool glass_changed(const struct renderer *renderer)
+{
+    const struct scene *scene = renderer->scene;
+    for (size_t i = 0; i < scene->material_count; i++)
+    {
+        const struct material *old = &renderer->gbuffer_materials[i];
+        const struct material *cur = &scene->materials[i];
+        if (old->kind != MATERIAL_GLASS && cur->kind != MATERIAL_GLASS)
+            continue;
+
+        // the color is part of the throughput
+        if (old->kind != cur->kind || old->ior != cur->ior
+            || old->surface_color.x != cur->surface_color.x
+            || old->surface_color.y != cur->surface_color.y
+            || old->surface_color.z != cur->surface_color.z)
+            return true;
+    }
+    return false;
+}
+
+void renderer_update(struct renderer *renderer, unsigned changes)
+{
+    const struct scene *scene = renderer->scene;
+    const struct render_options *options = &renderer->options;
+
+    if (changes & RENDER_CHANGE_GEOMETRY)
+    {
+        irradiance_cache_destroy(&renderer->ao_cache);
+        irradiance_cache_init(&renderer->ao_cache, options->ao_cache_error,
+                              options->ao_distance / 100,
+                              options->ao_distance);
+    }
+
+    // photons don't depend on the camera
+    unsigned photon_changes = RENDER_CHANGE_LIGHTS | RENDER_CHANGE_MATERIALS
+                              | RENDER_CHANGE_GEOMETRY;
+    if (options->photon_count && (changes & photon_changes))
+    {
+        photon_maps_destroy(&renderer->photon_maps);
+        photon_maps_build(&renderer->photon_maps, scene, options->photon_count,
+                          options->thread_count);
+    }
+
+    if (renderer->shadow_grids != NULL
+        && (changes & (RENDER_CHANGE_LIGHTS | RENDER_CHANGE_GEOMETRY)))
+    {
+        destroy_shadow_grids(renderer);
+        build_shadow_grids(renderer);
+    }
+
+    // colors are only valid from another point of view
+    if (changes & ~RENDER_CHANGE_CAMERA)
+        renderer->history.valid = false;
+
+    if (!options->gbuffer)
+        return;
+
+    if (changes & (RENDER_CHANGE_CAMERA | RENDER_CHANGE_GEOMETRY))
+        renderer->gbuffer.valid = false;
+    else if ((changes & RENDER_CHANGE_MATERIALS) && glass_changed(renderer))
+        renderer->gbuffer.valid = false;
+    snapshot_materials(renderer);
+}
+
+/*
+** Marks the tiles the bounds may cover on screen
+*/
+static void mark_covered_tiles(struct renderer *renderer,
+                               const struct aabb *bounds)
+{
+    const struct rgb_image *image = renderer->image;
+    size_t tiles_x = tile_columns(image);
+    size_t tiles_y = tile_rows(image);
+
+    double min_x = INFINITY, min_y = INFINITY;
+    double max_x = -INFINITY, max_y = -INFINITY;
+    for (int corner = 0; corner < 8; corner++)
+    {
+        struct vec3 point = {
+            corner & 1 ? bounds->max.x : bounds->min.x,
+            corner & 2 ? bounds->max.y : bounds->min.y,
+            corner & 4 ? bounds->max.z : bounds->min.z,
+        };
+        double cam_x, cam_y, depth;
+        // the bounds cross the image plane: anything may be covered
+        if (!camera_project(&renderer->scene->camera, &point, &cam_x, &cam_y,
+                            &depth))
+        {
+            memset(renderer->dirty_tiles, 1, tiles_x * tiles_y);
+            return;
+        }
+
+        min_x = fmin(min_x, (cam_x + 0.5) * image->width);
+        max_x = fmax(max_x, (cam_x + 0.5) * image->width);
+        min_y = fmin(min_y, (cam_y + 0.5) * image->height);
+        max_y = fmax(max_y, (cam_y + 0.5) * image->height);
+    }
+
+    // a pixel of margin, as pixels are cast through their corner
+    min_x = fmax(min_x - 1, 0);
+    min_y = fmax(min_y - 1, 0);
+    max_x = fmin(max_x + 1, image->width - 1);
+    max_y = fmin(max_y + 1, image->height - 1);
+    if (min_x > max_x || min_y > max_y)
+        return;
+
+    for (size_t ty = min_y / RENDER_TILE_SIZE; ty <= max_y / RENDER_TILE_SIZE;
+         ty++)
+        for (size_t tx = min_x / RENDER_TILE_SIZE;
+             tx <= max_x / RENDER_TILE_SIZE; tx++)
+            renderer->dirty_tiles[tiles_x * ty + tx] = 1;
+}
+
+// how finely the volume shadow rays of area lights go through is bounded
+#define SHADOW_HULL_STEPS 16
+
+/*
+** Returns whether an object within bounds may now shadow or occlude the
+** surfaces of the tile
+*/
+static bool receivers_affected(const struct renderer *renderer,
+                               const struct aabb *receivers,
+                               const struct aabb *bounds)
+{
+    const struct scene *scene = renderer->scene;
+    const struct render_options *options = &renderer->options;
+    if (aabb_is_empty(receivers) || aabb_is_empty(bounds))
+        return false;
+
+    // the object is where camera rays hit, or went through glass
+    if (aabb_overlap(receivers, bounds))
+        return true;
+
+    for (size_t l = 0; l < scene->light_count; l++)
+    {
+        const struct light *light = &scene->lights[l];
+        if (light_is_area(light))
+        {
+            // shadow rays stay within the hull of the surfaces and light
+            struct aabb surface = light_bounds(light);
+            if (aabb_hull_overlap(receivers, &surface, bounds,
+                                  SHADOW_HULL_STEPS))
+                return true;
+            continue;
+        }
+
+        struct vec3 to_light = light->direction;
+        vec3_neg(&to_light);
+        if (aabb_sweep_overlap(receivers, &to_light, bounds))
+            return true;
+    }
+
+    if (options->ambient != AMBIENT_CONSTANT)
+    {
+        // cached samples are interpolated up to ao_distance away, and
+        // their rays go up to ao_distance further
+        double reach = options->ao_distance;
+        if (options->ambient == AMBIENT_OCCLUSION_CACHED)
+            reach *= 2;
+        struct aabb rays = *receivers;
+        aabb_grow(&rays, reach);
+        if (aabb_overlap(&rays, bounds))
+            return true;
+    }
+    return false;
+}
+
+void renderer_objects_changed(struct renderer *renderer, const size_t *ids,
+                              size_t count)
+{
+    const struct scene *scene = renderer->scene;
+    const struct rgb_image *image = renderer->image;
+    size_t tile_count = tile_columns(image) * tile_rows(image);
+    renderer_update(renderer, RENDER_CHANGE_GEOMETRY);
+
+    // photons carry light across the whole scene
+    if (renderer->options.photon_count)
+    {
+        memset(renderer->dirty_tiles, 1, tile_count);
+        return;
+    }
+
+    for (size_t c = 0; c < count; c++)
+    {
+        size_t id = ids[c];
+        size_t index = scene_object_index(scene, id);
+        // removed objects only affect the tiles which saw them
+        struct aabb bounds = aabb_empty();
+        if (index != SCENE_NO_OBJECT)
+        {
+            bounds = sphere_bounds(&scene->spheres[index]);
+            mark_covered_tiles(renderer, &bounds);
+        }
+
+        for (size_t t = 0; t < tile_count; t++)
+        {
+            const struct render_tile_deps *deps = &renderer->tile_deps[t];
+            if (renderer->dirty_tiles[t])
+                continue;
+
+            // where the object was, rays which hit it
+            // may now miss it
+            if (deps->overflow
+                || bsearch(&id, deps->objects, deps->object_count,
+                           sizeof(id), id_compare)
+                || receivers_affected(renderer, &deps->receivers, &bounds))
+                renderer->dirty_tiles[t] = 1;
+        }
+    }
+}
+
+struct render_job
+{
+    struct scheduler_job job;
+    struct renderer *renderer;
+    struct perf_counters *perf;
+    // per worker scratch memory
+    struct render_buffers *buffers;
+    size_t tiles_x;
+    // the indices of the tiles to render, in the order of the curve
+    size_t *tiles;
+    // item i renders tiles [items[i], items[i + 1])
+    size_t *items;
+};
+
+static void render_job_tile(struct render_job *job, size_t index,
+                            size_t worker)
+{
+    struct rgb_image *image = job->renderer->image;
+    struct perf_counters *perf = &job->perf[worker];
+    size_t x = (index % job->tiles_x) * RENDER_TILE_SIZE;
+    size_t y = (index / job->tiles_x) * RENDER_TILE_SIZE;
+    struct render_tile tile = {
+        .x = x,
+        .y = y,
+        .width = image->width - x,
+        .height = image->height - y,
+    };
+    if (tile.width > RENDER_TILE_SIZE)
+        tile.width = RENDER_TILE_SIZE;
+    if (tile.height > RENDER_TILE_SIZE)
+        tile.height = RENDER_TILE_SIZE;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct renderer *renderer = job->renderer;
+    struct render_buffers *buffers = &job->buffers[worker];
+    size_t shadow_rays = buffers->shadow_rays;
+    render_tile(renderer, &tile, buffers, perf);
+    // each tile is rendered by a single worker
+    double cost = elapsed_seconds(&start);
+    renderer->tile_costs[index] = cost;
+    if (renderer->options.progress != NULL)
+        progress_tile_done(renderer->options.progress, worker, cost * 1e9,
+                           tile.width * tile.height,
+                           buffers->shadow_rays - shadow_rays);
+    renderer->covered_tiles[index] = 1;
+    if (renderer->dirty_tiles != NULL)
+        renderer->dirty_tiles[index] = 0;
+}
+
+static void render_job_item(void *ctx, size_t index, size_t worker)
+{
+    struct render_job *job = ctx;
+    struct perf_counters *perf = &job->perf[worker];
+
+    // counters measure the thread which opens them
+    if (job->renderer->options.perf && !perf->enabled && !perf->unavailable)
+        perf_counters_open(perf);
+
+    // once cancelled, items left are skipped, and tiles stay dirty
+    const volatile sig_atomic_t *cancel = job->renderer->options.cancel;
+    for (size_t i = job->items[index]; i < job->items[index + 1]; i++)
+    {
+        if (cancel != NULL && *cancel)
+            return;
+        render_job_tile(job, job->tiles[i], worker);
+    }
+}
+
+/*
+** Splits the tiles of the job into items. Until the cost of tiles is
+** known, each gets an item of its own. Afterwards, cheap tiles share items,
+** while expensive ones stay alone. Returns the number of items.
+*/
+static size_t split_items(struct render_job *job, size_t tile_count)
+{
+    const struct renderer *renderer = job->renderer;
+    const double *tile_costs = renderer->tile_costs;
+    job->items = xalloc(sizeof(*job->items) * (tile_count + 1));
+
+    bool costs_valid = renderer->tile_costs_valid;
+    double item_cost = 0;
+    if (costs_valid && tile_count != 0)
+    {
+        for (size_t i = 0; i < tile_count; i++)
+            item_cost += tile_costs[job->tiles[i]];
+        item_cost *= (double)WORK_ITEM_COST / tile_count;
+    }
+
+    size_t item_count = 0;
+    size_t item_start = 0;
+    double cost = 0;
+    for (size_t i = 0; i < tile_count; i++)
+    {
+        double tile_cost = costs_valid ? tile_costs[job->tiles[i]] : 0;
+        // without costs, no tile joins the previous one
+        if (i == 0 || !costs_valid || cost + tile_cost > item_cost
+            || i - item_start == WORK_ITEM_MAX_TILES)
+        {
+            job->items[item_count++] = i;
+            item_start = i;
+            cost = 0;
+        }
+        cost += tile_cost;
+    }
+    job->items[item_count] = tile_count;
+    return item_count;
+}
+
+static void render_job_start(void *ctx)
+{
+    struct render_job *job = ctx;
+    job->buffers = memory_alloc(MEMORY_FRAMEBUFFERS, job->job.memory);
+    for (size_t i = 0; i < job->renderer->options.thread_count; i++)
+    {
+        struct render_buffers *buffers = &job->buffers[i];
+        for (size_t l = 0; l < RENDER_OCCLUDER_LIGHTS; l++)
+            buffers->last_occluders[l] = SCENE_NO_OBJECT;
+        buffers->shadow_rays = 0;
+        buffers->occluder_hits = 0;
+    }
+}
+
+static void render_job_finish(void *ctx)
+{
+    struct render_job *job = ctx;
+    struct renderer *renderer = job->renderer;
+    for (size_t i = 0; i < renderer->options.thread_count; i++)
+    {
+        renderer->shadow_rays += job->buffers[i].shadow_rays;
+        renderer->occluder_hits += job->buffers[i].occluder_hits;
+    }
+    memory_free(job->buffers);
+    job->buffers = NULL;
+}
+
+void render_image_submit(struct renderer *renderer,
+                         struct perf_counters *perf)
+{
+    struct rgb_image *image = renderer->image;
+    size_t thread_count = renderer->options.thread_count;
+
+    struct render_history *history = &renderer->history;
+    history->reprojected_count = 0;
+    renderer->shadow_rays = 0;
+    renderer->occluder_hits = 0;
+    // frames with aovs are traced in full, as reprojection only knows colors
+    if (renderer->options.reproject && history->valid && !renderer->aovs)
+        reproject_history(renderer);
+
+    struct render_job *job = xalloc(sizeof(*job));
+    *job = (struct render_job){
+        .renderer = renderer,
+        .perf = perf,
+        .tiles_x = tile_columns(image),
+    };
+    size_t total_count = job->tiles_x * tile_rows(image);
+
+    // when edits are tracked, only render the tiles they affected. Frames
+    // with aovs are rendered in full, as the aov file starts out empty
+    bool all_tiles = renderer->tile_deps == NULL || renderer->aovs != NULL;
+    job->tiles = xalloc(sizeof(*job->tiles) * total_count);
+    size_t tile_count = 0;
+    for (size_t i = 0; i < total_count; i++)
+    {
+        size_t tile = renderer->tile_order[i];
+        if (all_tiles || renderer->dirty_tiles[tile])
+        {
+            job->tiles[tile_count++] = tile;
+            renderer->covered_tiles[tile] = 0;
+        }
+    }
+    renderer->rendered_tile_count = tile_count;
+    size_t item_count = split_items(job, tile_count);
+    renderer->work_item_count = item_count;
+    if (renderer->options.progress != NULL)
+        progress_frame_start(renderer->options.progress, tile_count);
+
+    // tile buffers are only allocated once the job is admitted. What
+    // renderer_init allocated is not admitted, and may exceed the budget
+    job->job = (struct scheduler_job){
+        .fn = render_job_item,
+        .start = render_job_start,
+        .finish = render_job_finish,
+        .ctx = job,
+        .count = item_count,
+        .memory = sizeof(*job->buffers) * thread_count,
+        .priority = renderer->options.priority,
+        .weight = renderer->options.weight,
+    };
+    renderer->job = job;
+    scheduler_submit(renderer->scheduler, &job->job);
+}
+
+void render_image_wait(struct renderer *renderer)
+{
+    struct render_job *job = renderer->job;
+    struct rgb_image *image = renderer->image;
+    struct render_history *history = &renderer->history;
+    scheduler_wait(renderer->scheduler, &job->job);
+
+    struct perf_counters *perf = job->perf;
+    free(job->tiles);
+    free(job->items);
+    free(job);
+    renderer->job = NULL;
+
+    size_t tile_count = tile_columns(image) * tile_rows(image);
+    renderer->covered_tile_count = 0;
+    for (size_t i = 0; i < tile_count; i++)
+        renderer->covered_tile_count += renderer->covered_tiles[i];
+    bool complete = render_image_complete(renderer);
+
+    // partial frames only measure some of the tiles
+    if (complete && renderer->rendered_tile_count == tile_count)
+        renderer->tile_costs_valid = true;
+
+    // the next frame may be shaded from this one, unless some of its pixels
+    // were not traced
+    if (renderer->options.gbuffer && history->reprojected_count == 0
+        && complete)
+        renderer->gbuffer.valid = true;
+
+    if (renderer->options.reproject)
+    {
+        struct render_history_pixel *pixels = history->pixels;
+        history->pixels = history->reprojected;
+        history->reprojected = pixels;
+        history->valid = complete;
+        history->frame++;
+    }
+
+    // workers open their counters again on the next frame
+    for (size_t i = 0; i < renderer->options.thread_count; i++)
+        perf_counters_close(&perf[i]);
+}
+
+bool render_image_complete(const struct renderer *renderer)
+{
+    const struct rgb_image *image = renderer->image;
+    return renderer->covered_tile_count
+           == tile_columns(image) * tile_rows(image);
+}
+
+void render_coverage_mask(const struct renderer *renderer,
+                          struct rgb_image *mask)
+{
+    const struct rgb_pixel covered = {255, 255, 255};
+    const struct rgb_pixel missing = {0, 0, 0};
+    size_t columns = tile_columns(mask);
+    for (size_t y = 0; y < mask->height; y++)
+        for (size_t x = 0; x < mask->width; x++)
+        {
+            size_t tile = (y / RENDER_TILE_SIZE) * columns
+                          + x / RENDER_TILE_SIZE;
+            rgb_image_set(mask, x, y,
+                          renderer->covered_tiles[tile] ? covered : missing);
+        }
+}
+
+void render_image(struct renderer *renderer, struct perf_counters *perf)
+{
+    render_image_submit(renderer, perf);
+    render_image_wait(renderer);
+}
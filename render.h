@@ -0,0 +1,353 @@
+#pragma once
+
+#include "aabb.h"
+#include "aov.h"
+#include "image.h"
+#include "irradiance_cache.h"
+#include "memory.h"
+#include "object_set.h"
+#include "perf.h"
+#include "photon_map.h"
+#include "progress.h"
+#include "scene.h"
+#include "scheduler.h"
+#include "shadow_grid.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RENDER_TILE_SIZE 16
+#define RENDER_TILE_PIXELS (RENDER_TILE_SIZE * RENDER_TILE_SIZE)
+// camera rays are traced in square packets of this size
+#define RENDER_PACKET_SIZE 8
+// workers remember the last occluder of this many lights, the first ones
+#define RENDER_OCCLUDER_LIGHTS 8
+
+/*
+** A rectangular region of the image, at most RENDER_TILE_SIZE wide and high
+*/
+struct render_tile
+{
+    size_t x;
+    size_t y;
+    size_t width;
+    size_t height;
+};
+
+/*
+** Scratch memory used while rendering a tile, one stage at a time.
+** Each worker owns its own.
+*/
+struct render_buffers
+{
+    struct ray rays[RENDER_TILE_PIXELS];
+    struct intersection intersections[RENDER_TILE_PIXELS];
+    size_t objects[RENDER_TILE_PIXELS];
+    double distances[RENDER_TILE_PIXELS];
+
+    // the light reflected by the shaded surface, by kind
+    struct vec3 ambient[RENDER_TILE_PIXELS];
+    struct light_contribution direct[RENDER_TILE_PIXELS];
+    struct vec3 indirect[RENDER_TILE_PIXELS];
+    // how much of the light leaving the shaded surface reaches the camera,
+    // after going through glass
+    struct vec3 throughputs[RENDER_TILE_PIXELS];
+    // the light reaching the camera
+    struct vec3 colors[RENDER_TILE_PIXELS];
+
+    // the first few shadow samples of an area light, for each pixel
+    struct light_contribution probes[RENDER_TILE_PIXELS];
+    uint8_t probe_visible[RENDER_TILE_PIXELS];
+
+    struct aov_tile aovs;
+
+    // whether the pixel color is reprojected from the previous frame
+    uint8_t reprojected[RENDER_TILE_PIXELS];
+
+    // when edits are tracked, points to hit_set, which records the
+    // objects rays hit. NULL otherwise
+    struct object_set *hits;
+    struct object_set hit_set;
+    // the surfaces hit by camera rays, glass included
+    struct aabb receivers;
+
+    // the index of the last sphere which blocked a shadow ray towards each
+    // light, or SCENE_NO_OBJECT, and how often it blocked the next ones
+    size_t last_occluders[RENDER_OCCLUDER_LIGHTS];
+    size_t shadow_rays;
+    size_t occluder_hits;
+};
+
+/*
+** What a camera ray found, once glass surfaces were followed: all shading
+** needs to know about a pixel.
+*/
+struct render_gbuffer_pixel
+{
+    struct intersection intersection;
+    // the direction of the last segment of the camera ray
+    struct vec3 direction;
+    struct vec3 throughput;
+    double distance;
+    size_t object;
+};
+
+/*
+** The primary hits of the last render, stored tile by tile. As long as the
+** camera, the geometry, and glass materials don't change, frames can be
+** shaded from it without tracing camera rays.
+*/
+struct render_gbuffer
+{
+    struct render_gbuffer_pixel *pixels;
+    bool valid;
+};
+
+/*
+** What a pixel showed, for temporal reprojection
+*/
+struct render_history_pixel
+{
+    struct vec3 point;
+    struct vec3 normal;
+    struct vec3 color;
+    // the distance to the camera, once reprojected
+    double depth;
+    // whether the point can be reprojected to later frames
+    bool valid;
+};
+
+/*
+** The surfaces seen by the previous frame. Before a frame is rendered,
+** they are reprojected through the new camera. Pixels which get a valid
+** surface take its color, and the others are traced.
+*/
+struct render_history
+{
+    // the previous frame, line by line
+    struct render_history_pixel *pixels;
+    // the previous frame seen by the current camera, which then becomes
+    // the history of the next frame
+    struct render_history_pixel *reprojected;
+    bool valid;
+    size_t frame;
+    // how many pixels of the last frame were reprojected
+    size_t reprojected_count;
+};
+
+/*
+** What the pixels of a tile depend on, so that it is only rendered again
+** when an edit may change them
+*/
+struct render_tile_deps
+{
+    // the ids of the objects any ray of the tile hit, sorted. If there
+    // were too many, or a refracted ray escaped the scene, overflow is set,
+    // and any edit affects the tile
+    size_t *objects;
+    size_t object_count;
+    bool overflow;
+    // the surfaces hit by camera rays, which edited objects may now shadow
+    struct aabb receivers;
+};
+
+enum ambient_mode
+{
+    /* constant ambient lighting */
+    AMBIENT_CONSTANT = 0,
+    /* ambient occlusion, interpolated from an irradiance cache */
+    AMBIENT_OCCLUSION_CACHED,
+    /* ambient occlusion, sampled at every pixel */
+    AMBIENT_OCCLUSION_BRUTE,
+};
+
+struct render_options
+{
+    enum ambient_mode ambient;
+    // the number of occlusion rays per ambient occlusion sample
+    size_t ao_samples;
+    // objects further than this don't occlude ambient light
+    double ao_distance;
+    // the maximum interpolation error of the ambient occlusion cache
+    double ao_cache_error;
+
+    // the number of photons traced for global illumination, 0 to disable
+    size_t photon_count;
+
+    size_t thread_count;
+    // if not NULL, tiles are rendered on this pool, which may be shared
+    // with other renderers, and whose thread count replaces thread_count.
+    // Otherwise, the renderer starts a pool of its own
+    struct scheduler *scheduler;
+    // how tiles compete with the jobs of other renderers on the pool
+    unsigned priority;
+    unsigned weight;
+    // whether each worker records hardware performance counters
+    bool perf;
+    // whether primary hits are kept, to shade later frames from
+    bool gbuffer;
+
+    // whether pixels are reprojected from the previous frame when only the
+    // camera moves
+    bool reproject;
+    // reprojected pixels are traced again every this many frames
+    size_t refresh_period;
+
+    // whether tiles record what they depend on, so that only the tiles an
+    // edit affects are rendered again. Every pixel is then traced, and
+    // neither the G-buffer nor reprojection are used
+    bool track_edits;
+
+    // whether shadow rays towards directional lights look up a shadow grid
+    // instead of going through the hierarchy
+    bool shadow_grids;
+
+    // if not NULL, renders stop once it is set, which a signal handler may
+    // do. Tiles already started are finished, and the others are left as
+    // they were
+    const volatile sig_atomic_t *cancel;
+
+    // if not NULL, workers publish their progress there
+    struct progress_page *progress;
+};
+
+#define RENDER_OPTIONS_DEFAULT                                                 \
+    {                                                                          \
+        .ambient = AMBIENT_CONSTANT, .ao_samples = 64, .ao_distance = 10.,     \
+        .ao_cache_error = 0.3, .photon_count = 0, .thread_count = 1,           \
+        .scheduler = NULL, .priority = 0, .weight = 1, .perf = false,          \
+        .gbuffer = false, .reproject = false, .refresh_period = 16,            \
+        .track_edits = false, .shadow_grids = false, .cancel = NULL,           \
+        .progress = NULL,                                                      \
+    }
+
+/*
+** Everything a frame is rendered from. The renderer keeps caches which
+** stay valid as long as the scene doesn't change.
+*/
+struct renderer
+{
+    const struct scene *scene;
+    struct rgb_image *image;
+    // if not NULL, intermediate values are written there as well, as
+    // tiles are done
+    struct aov_file *aovs;
+    struct render_options options;
+
+    // the cache is shared by all workers, and dropped when memory runs low
+    struct irradiance_cache ao_cache;
+    pthread_rwlock_t ao_cache_lock;
+    struct memory_shrinker ao_cache_shrinker;
+
+    struct photon_maps photon_maps;
+
+    // when enabled, one per light, only built for directional lights
+    struct shadow_grid *shadow_grids;
+
+    struct render_gbuffer gbuffer;
+    // the materials the G-buffer was traced with
+    struct material *gbuffer_materials;
+
+    struct render_history history;
+
+    // when edits are tracked, what each tile depends on, and whether the
+    // next frame must render it
+    struct render_tile_deps *tile_deps;
+    uint8_t *dirty_tiles;
+    // tiles are rendered along a Hilbert curve, in work items grouping
+    // tiles of about the same total cost. The cost of each tile is its
+    // render time in the last frame which rendered it
+    size_t *tile_order;
+    double *tile_costs;
+    bool tile_costs_valid;
+
+    // how many tiles the last frame rendered, and in how many work items
+    size_t rendered_tile_count;
+    size_t work_item_count;
+    // whether each tile holds a complete render of the current frame. All
+    // do, unless the render was cancelled
+    uint8_t *covered_tiles;
+    size_t covered_tile_count;
+    // how many shadow rays the last frame traced, and how many of them the
+    // last occluder of their worker blocked
+    size_t shadow_rays;
+    size_t occluder_hits;
+
+    struct scheduler *scheduler;
+    bool owns_scheduler;
+    // the frame being rendered, between render_image_submit and
+    // render_image_wait
+    struct render_job *job;
+};
+
+/*
+** What changed in the scene since the last frame
+*/
+enum render_change
+{
+    RENDER_CHANGE_LIGHTS = 1 << 0,
+    RENDER_CHANGE_MATERIALS = 1 << 1,
+    RENDER_CHANGE_CAMERA = 1 << 2,
+    // the scene must be prepared again beforehand
+    RENDER_CHANGE_GEOMETRY = 1 << 3,
+};
+
+void renderer_init(struct renderer *renderer, const struct scene *scene,
+                   struct rgb_image *image,
+                   const struct render_options *options);
+void renderer_destroy(struct renderer *renderer);
+
+/*
+** Drops whatever the changes made stale: photon maps when anything changes,
+** the ambient occlusion cache when geometry does, shadow grids when lights
+** or geometry do, and the G-buffer when camera rays would now go elsewhere.
+** Lights, and materials other than glass, can change without tracing
+** camera rays again. Only camera moves keep the history used for
+** reprojection.
+*/
+void renderer_update(struct renderer *renderer, unsigned changes);
+
+/*
+** Tells the renderer that objects were added, removed or moved, so that
+** the next frame only renders the tiles they affect: tiles whose rays hit
+** the objects, tiles the objects now cover, and tiles whose surfaces the
+** objects may now shadow or occlude. Objects are given by id. Requires
+** options.track_edits.
+*/
+void renderer_objects_changed(struct renderer *renderer, const size_t *ids,
+                              size_t count);
+
+void render_tile(struct renderer *renderer, const struct render_tile *tile,
+                 struct render_buffers *buffers, struct perf_counters *perf);
+
+/*
+** Renders all tiles of the image, using options.thread_count workers.
+** perf must hold one set of counters per worker. If options.perf is set,
+** each worker opens its own counters when it starts.
+*/
+void render_image(struct renderer *renderer, struct perf_counters *perf);
+
+/*
+** Like render_image, in two halves, so that renderers sharing a scheduler
+** can render at the same time. Nothing about the renderer may change in
+** between.
+*/
+void render_image_submit(struct renderer *renderer,
+                         struct perf_counters *perf);
+void render_image_wait(struct renderer *renderer);
+
+/*
+** Returns whether every tile of the image holds the last frame, which is
+** always the case unless options.cancel was set while rendering it.
+*/
+bool render_image_complete(const struct renderer *renderer);
+
+/*
+** Draws the tiles which hold the last frame in white, and the others in
+** black. The mask must be as large as the image.
+*/
+void render_coverage_mask(const struct renderer *renderer,
+                          struct rgb_image *mask);
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+** A small and fast pseudo random number generator (xorshift64*).
+** Each thread or pixel owns its own state, which makes sampling
+** reproducible regardless of the order in which work is done.
+*/
+struct rng
+{
+    uint64_t state;
+};
+
+static inline uint64_t rng_mix(uint64_t x)
+{
+    // splitmix64 finalizer, turns correlated seeds into unrelated states
+    x += 0x9e3779b97f4a7c15;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+}
+
+static inline void rng_seed(struct rng *rng, uint64_t seed)
+{
+    rng->state = rng_mix(seed);
+    // the state of a xorshift generator must never be zero
+    if (rng->state == 0)
+        rng->state = 1;
+}
+
+static inline uint64_t rng_next(struct rng *rng)
+{
+    uint64_t x = rng->state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    rng->state = x;
+    return x * 0x2545f4914f6cdd1d;
+}
+
+/*
+** Returns a uniformly distributed double in [0, 1)
+*/
+static inline double rng_double(struct rng *rng)
+{
+    return (rng_next(rng) >> 11) * (1. / (UINT64_C(1) << 53));
+}
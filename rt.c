@@ -1,301 +1,637 @@
 #include <err.h>
+#include <errno.h>
+#include <getopt.h>
 #include <math.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "aov.h"
 #include "bmp.h"
 #include "image.h"
+#include "memory.h"
+#include "parallel.h"
+#include "perf.h"
+#include "progress.h"
+#include "render.h"
+#include "scene.h"
+#include "scene_store.h"
+#include "scheduler.h"
+#include "utils.h"
 #include "vec3.h"
 
-struct sphere
+struct rgb_pixel normal_color(const struct vec3 *normal)
 {
-    struct vec3 center;
-    double radius;
-};
+    struct rgb_pixel res;
+    //       -1 => 1
+    // + 1   0 => 2
+    // / 2   0 => 1
+    // * 255 0 => 255
+    //       0 => 255
 
-struct ray
-{
-    struct vec3 source;
-    struct vec3 direction;
-};
+    double nx = (normal->x + 1.) / 2.;
+    double ny = (normal->y + 1.) / 2.;
+    double nz = (normal->z + 1.) / 2.;
+    res.r = nx * 255;
+    res.g = ny * 255;
+    res.b = nz * 255;
+    return res;
+}
 
-struct camera
-{
-    struct vec3 center;
-    struct vec3 forward;
-    struct vec3 up;
+#define USAGE                                                                  \
+    "Usage: [--perf] [--ao[=cache|brute]] [--photons[=COUNT]] "                \
+    "[--threads COUNT] [--aov AOV.exr] [--relight FRAMES] "                  \
+    "[--camera-path FRAMES] [--edit-path FRAMES] [--preview] "               \
+    "[--memory-budget MIB] [--scene-store PATH] [--bvh-cache DIR] "          \
+    "[--lazy-bvh] [--shadow-grid] [--progress PATH] [--area-light] "         \
+    "OUTPUT.bmp"
 
-    double width;
-    double height;
+#define DEFAULT_PHOTON_COUNT 200000
 
-    double focal_distance;
+// the options which change the scene, rather than how it is rendered, and
+// which scene stores must have been written with
+enum scene_option
+{
+    SCENE_OPTION_AREA_LIGHT = 1 << 0,
+    SCENE_OPTION_GLASS = 1 << 1,
 };
 
-double focal_distance_from_fov(double width, double fov_deg)
+static size_t parse_count(const char *arg, const char *what)
 {
-    // convert from degrees to radians
-    double fov_rad = fov_deg * M_PI / (360 / 2);
-    return (width / 2) / tan(fov_rad / 2);
+    char *end;
+    errno = 0;
+    unsigned long long res = strtoull(arg, &end, 10);
+    if (errno != 0 || *end != '\0' || end == arg || res == 0)
+        errx(1, "invalid %s: %s", what, arg);
+    return res;
 }
 
 /*
-** The camera is a physical object in its own right, positioned in space just like
-** any other. When casting a ray, the raytracer must express the coordinates of the
-** starting point of the ray, relative to the image plane defined by the camera.
-**
-** One way to do it is to define the bottom left corner of the image plane to be at
-** (-0.5, 0.5), its center to be at (0, 0), and its top right corner to be at (0.5,
-** 0.5).
-**
-** This way, the camera doesn't have to know about the dimensions of the output
-** image: it just traces rays where asked to.
-**
-**  (x=-0.5, y=0.5)                (x=0.5, y=0.5)
-**        +------------------------------+
-**        |                              |
-**        |              ^ y             |
-**        |              |               |
-**        |              +---> x         |
-**        |            center            |
-**        |                              |
-**        |                              |
-**        +------------------------------+
-** (x=-0.5, y=-0.5)                (x=0.5, y=-0.5)
+** Inserts suffix before the extension of path
 */
-void camera_cast_ray(struct ray *ray, const struct camera *camera, double cam_x,
-                     double cam_y)
+static char *suffix_path(const char *path, const char *suffix)
 {
-    // translate relative position inside the image plane
-    // into absolute position into the image plane.
-    double x_coeff = cam_x * camera->width;
-    double y_coeff = cam_y * camera->height;
-
-    struct vec3 right = vec3_cross(&camera->forward, &camera->up);
-    // right_offset = right * x_coeff
-    struct vec3 right_offset = vec3_mul(&right, x_coeff);
-    // up_offset = up * y_coeff
-    struct vec3 up_offset = vec3_mul(&camera->up, y_coeff);
-    // offset = right_offset + up_offset
-    struct vec3 offset = vec3_add(&right_offset, &up_offset);
-    // ray->source = center + offset
-    ray->source = vec3_add(&camera->center, &offset);
-
-    struct vec3 vantage_point_offset
-        = vec3_mul(&camera->forward, -camera->focal_distance);
-    struct vec3 vantage_point
-        = vec3_add(&vantage_point_offset, &camera->center);
-    ray->direction = vec3_sub(&ray->source, &vantage_point);
-    vec3_normalize(&ray->direction);
+    const char *extension = strrchr(path, '.');
+    if (extension == NULL || strchr(extension, '/') != NULL)
+        extension = path + strlen(path);
+
+    int base_length = extension - path;
+    size_t size = strlen(path) + strlen(suffix) + 1;
+    char *res = xalloc(size);
+    snprintf(res, size, "%.*s%s%s", base_length, path, suffix, extension);
+    return res;
 }
 
-struct intersection
+/*
+** Frames of a sequence are numbered before the extension, so that out.bmp
+** becomes out.0001.bmp. A single frame keeps the path as is.
+*/
+static char *frame_path(const char *path, size_t frame, size_t frame_count)
 {
-    struct vec3 point;
-    struct vec3 normal;
-};
+    if (frame_count == 1)
+        return strdup(path);
+
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%04zu", frame);
+    return suffix_path(path, suffix);
+}
 
-// returns the intersection distance
-double sphere_ray_intersect(struct intersection *intersection,
-                            const struct ray *ray, const struct sphere *sphere)
+/*
+** Images replace any previous file only once complete, so that an
+** interrupted process never leaves a truncated one.
+*/
+static void write_image(struct rgb_image *image, const char *path)
 {
-    struct vec3 hypothenuse = vec3_sub(&sphere->center, &ray->source);
-    double hyp_len = vec3_length(&hypothenuse);
-    double projection = vec3_dot(&hypothenuse, &ray->direction);
-    if (projection < 0)
-        return INFINITY;
-
-    double d = sqrt(hyp_len * hyp_len - projection * projection);
-    if (d > sphere->radius)
-        return INFINITY;
-
-    double radius = sphere->radius;
-    double m = sqrt(radius * radius - d * d);
-    double t0 = projection - m;
-    double t1 = projection + m;
-
-    double t = t0;
-    if (t < 0.)
-        t = t1;
-
-    // intersection point = ray->source + ray->direction * t
-    struct vec3 point_offset = vec3_mul(&ray->direction, t);
-    intersection->point = vec3_add(&ray->source, &point_offset);
-    intersection->normal = vec3_sub(&intersection->point, &sphere->center);
-    vec3_normalize(&intersection->normal);
-    // compute intersection coord / normal
-    return t;
+    char *tmp_path;
+    FILE *fp = replace_file_open(path, &tmp_path);
+    if (fp == NULL)
+        err(1, "failed to create a file next to %s", path);
+    if (bmp_write(image, ppm_from_ppi(80), fp) != 0)
+    {
+        replace_file_abort(fp, tmp_path);
+        err(1, "failed to write %s", path);
+    }
+    if (replace_file_commit(fp, tmp_path, path) != 0)
+        err(1, "failed to write %s", path);
 }
 
-struct rgb_pixel normal_color(const struct vec3 *normal)
+// set by SIGINT and SIGTERM, which stop the render at the next tile
+static volatile sig_atomic_t cancelled;
+
+static void cancel_render(int sig)
 {
-    struct rgb_pixel res;
-    //       -1 => 1
-    // + 1   0 => 2
-    // / 2   0 => 1
-    // * 255 0 => 255
-    //       0 => 255
+    (void)sig;
+    cancelled = 1;
+}
 
-    double nx = (normal->x + 1.) / 2.;
-    double ny = (normal->y + 1.) / 2.;
-    double nz = (normal->z + 1.) / 2.;
-    res.r = nx * 255;
-    res.g = ny * 255;
-    res.b = nz * 255;
-    return res;
+static void handle_cancellation(void)
+{
+    struct sigaction action = {.sa_handler = cancel_render};
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGINT, &action, NULL) != 0
+        || sigaction(SIGTERM, &action, NULL) != 0)
+        err(1, "failed to handle signals");
+}
+
+static double elapsed_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
 }
 
+// previews are this many times smaller than the image, on each side
+#define PREVIEW_SCALE 4
+
 /*
-** The color of a light is encoded inside a float, from 0 to +inf,
-** where 0 is no light, and +inf a lot more light. Unfortunately,
-** regular images can't hold such a huge range, and each color channel
-** is usualy limited to [0,255]. This function does the (lossy) translation
-** by mapping the float [0,1] range to [0,255]
+** Renders the image, and writes it out, along with its aovs. If preview
+** is not NULL, it is rendered at the same time, but goes first, and is
+** written out as soon as it is done. If the render was cancelled, the
+** tiles done so far are written, along with a mask of them. Returns
+** whether the frame is complete.
 */
-static inline uint8_t translate_light_component(double light_comp)
+static bool render_frame(struct renderer *renderer, struct perf_counters *perf,
+                         struct renderer *preview,
+                         struct perf_counters *preview_perf,
+                         const char *output_path, const char *aov_path,
+                         size_t frame, size_t frame_count)
 {
-    if (light_comp < 0.)
-        light_comp = 0.;
-    if (light_comp > 1.)
-        light_comp = 1.;
+    struct rgb_image *image = renderer->image;
+    char *frame_output_path = frame_path(output_path, frame, frame_count);
+
+    // tiles are written to the aov file as they are rendered
+    struct aov_file aov_file;
+    char *frame_aov_path = NULL;
+    renderer->aovs = NULL;
+    if (aov_path != NULL)
+    {
+        frame_aov_path = frame_path(aov_path, frame, frame_count);
+        if (aov_file_open(&aov_file, frame_aov_path, image->width,
+                          image->height))
+            err(1, "failed to open %s", frame_aov_path);
+        renderer->aovs = &aov_file;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    render_image_submit(renderer, perf);
+    if (preview != NULL)
+    {
+        render_image(preview, preview_perf);
+        if (renderer->options.perf)
+            fprintf(stderr, "frame %zu: preview done in %.3fs\n", frame,
+                    elapsed_since(&start));
+
+        char *preview_path = suffix_path(frame_output_path, ".preview");
+        write_image(preview->image, preview_path);
+        free(preview_path);
+    }
+    render_image_wait(renderer);
+    if (renderer->options.perf && preview != NULL)
+        fprintf(stderr, "frame %zu: image done in %.3fs\n", frame,
+                elapsed_since(&start));
+
+    if (renderer->options.perf && renderer->options.reproject)
+        fprintf(stderr, "frame %zu: %zu of %zu pixels reprojected\n", frame,
+                renderer->history.reprojected_count,
+                image->width * image->height);
+    if (renderer->options.perf && renderer->options.track_edits)
+        fprintf(stderr, "frame %zu: %zu tiles rendered\n", frame,
+                renderer->rendered_tile_count);
+    if (renderer->options.perf)
+        fprintf(stderr, "frame %zu: %zu tiles in %zu work items\n", frame,
+                renderer->rendered_tile_count, renderer->work_item_count);
+    if (renderer->options.perf)
+        fprintf(stderr,
+                "frame %zu: %zu of %zu shadow rays blocked by the last "
+                "occluder\n",
+                frame, renderer->occluder_hits, renderer->shadow_rays);
+
+    if (aov_path != NULL && aov_file_close(&aov_file))
+        err(1, "failed to write %s", frame_aov_path);
+    free(frame_aov_path);
+    renderer->aovs = NULL;
+
+    bool complete = render_image_complete(renderer);
+    if (!complete)
+    {
+        struct rgb_image *mask = rgb_image_alloc(image->width, image->height);
+        render_coverage_mask(renderer, mask);
+        char *mask_path = suffix_path(frame_output_path, ".mask");
+        write_image(mask, mask_path);
+        warnx("frame %zu cancelled, %s shows which tiles are done", frame,
+              mask_path);
+        free(mask_path);
+        rgb_image_free(mask);
+    }
+
+    write_image(image, frame_output_path);
+    free(frame_output_path);
+    return complete;
+}
 
-    return light_comp * 255;
+static void rotate_vertical(struct vec3 *v, double angle)
+{
+    double c = cos(angle);
+    double s = sin(angle);
+    struct vec3 prev = *v;
+    v->x = c * prev.x - s * prev.y;
+    v->y = s * prev.x + c * prev.y;
 }
 
 /*
-** Converts an rgb floating point light color to 24 bit rgb.
+** Turns lights around the vertical axis which goes through target
 */
-struct rgb_pixel rgb_color_from_light(const struct vec3 *light)
+static void rotate_lights(struct scene *scene, const struct vec3 *target,
+                          double angle)
 {
-    struct rgb_pixel res;
-    res.r = translate_light_component(light->x);
-    res.g = translate_light_component(light->y);
-    res.b = translate_light_component(light->z);
-    return res;
+    for (size_t i = 0; i < scene->light_count; i++)
+    {
+        struct light *light = &scene->lights[i];
+        if (light->type == LIGHT_DIRECTIONAL)
+        {
+            rotate_vertical(&light->direction, angle);
+            continue;
+        }
+
+        struct vec3 offset = vec3_sub(&light->position, target);
+        rotate_vertical(&offset, angle);
+        light->position = vec3_add(target, &offset);
+        rotate_vertical(&light->edge_u, angle);
+        rotate_vertical(&light->edge_v, angle);
+    }
+}
+
+// camera paths slowly turn around the red sphere
+#define CAMERA_PATH_STEP (M_PI / 360)
+
+static void orbit_camera(struct camera *camera, const struct vec3 *target,
+                         double angle)
+{
+    struct vec3 offset = vec3_sub(&camera->center, target);
+    rotate_vertical(&offset, angle);
+    camera->center = vec3_add(target, &offset);
+    rotate_vertical(&camera->forward, angle);
+    rotate_vertical(&camera->up, angle);
+}
+
+// edit paths slide the red sphere sideways
+#define EDIT_PATH_OBJECT 0
+#define EDIT_PATH_STEP 0.05
+
+static void move_object(struct renderer *renderer, struct scene *scene,
+                        size_t id, double step)
+{
+    struct vec3 center = scene->spheres[scene_object_index(scene, id)].center;
+    center.x += step;
+    scene_move_sphere(scene, id, &center);
+    renderer_objects_changed(renderer, &id, 1);
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc != 2)
-        errx(1, "Usage: OUTPUT.bmp");
+    struct render_options options = RENDER_OPTIONS_DEFAULT;
+    const char *aov_path = NULL;
+    const char *store_path = NULL;
+    const char *bvh_cache = NULL;
+    const char *progress_path = NULL;
+    size_t frame_count = 1;
+    bool camera_path = false;
+    bool edit_path = false;
+    bool preview = false;
+    bool lazy_bvh = false;
+    bool area_light = false;
+    options.thread_count = parallel_default_threads();
+
+    static const struct option long_options[] = {
+        {"perf", no_argument, NULL, 'p'},
+        {"ao", optional_argument, NULL, 'a'},
+        {"photons", optional_argument, NULL, 'g'},
+        {"threads", required_argument, NULL, 'j'},
+        {"aov", required_argument, NULL, 'o'},
+        {"relight", required_argument, NULL, 'r'},
+        {"camera-path", required_argument, NULL, 'c'},
+        {"edit-path", required_argument, NULL, 'e'},
+        {"preview", no_argument, NULL, 'v'},
+        {"memory-budget", required_argument, NULL, 'm'},
+        {"scene-store", required_argument, NULL, 's'},
+        {"bvh-cache", required_argument, NULL, 'b'},
+        {"lazy-bvh", no_argument, NULL, 'l'},
+        {"shadow-grid", no_argument, NULL, 'd'},
+        {"progress", required_argument, NULL, 'P'},
+        {"area-light", no_argument, NULL, 'A'},
+        {0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "pj:", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':
+            options.perf = true;
+            break;
+        case 'g':
+            options.photon_count = DEFAULT_PHOTON_COUNT;
+            if (optarg != NULL)
+                options.photon_count = parse_count(optarg, "photon count");
+            break;
+        case 'j':
+            options.thread_count = parse_count(optarg, "thread count");
+            break;
+        case 'o':
+            aov_path = optarg;
+            break;
+        case 'r':
+            // later frames only move lights, and are shaded from the
+            // primary hits of the first one
+            frame_count = parse_count(optarg, "frame count");
+            options.gbuffer = true;
+            break;
+        case 'c':
+            // consecutive frames see mostly the same surfaces, which are
+            // reprojected rather than traced
+            frame_count = parse_count(optarg, "frame count");
+            camera_path = true;
+            options.reproject = true;
+            break;
+        case 'e':
+            // later frames move a single object, and only render the
+            // tiles it may have changed
+            frame_count = parse_count(optarg, "frame count");
+            edit_path = true;
+            options.track_edits = true;
+            break;
+        case 'm':
+        {
+            // past the budget, caches shrink and renders wait their turn
+            size_t budget = parse_count(optarg, "memory budget");
+            if (budget > SIZE_MAX >> 20)
+                errx(1, "invalid memory budget: %s", optarg);
+            memory_set_budget(budget << 20);
+            break;
+        }
+        case 's':
+            // processes rendering the same scene share a single copy
+            store_path = optarg;
+            break;
+        case 'b':
+            // static scenes skip their build after the first run
+            bvh_cache = optarg;
+            break;
+        case 'l':
+            // only the parts of the scene rays go near get built
+            lazy_bvh = true;
+            break;
+        case 'P':
+            // monitors poll the file while the render runs, see rtstat
+            progress_path = optarg;
+            break;
+        case 'd':
+            // shadow rays towards directional lights look up a single cell
+            options.shadow_grids = true;
+            break;
+        case 'A':
+            // a ground and a rectangle light, which casts soft shadows on it
+            area_light = true;
+            break;
+        case 'v':
+            // a small image is rendered along with each frame, ahead of it
+            preview = true;
+            break;
+        case 'a':
+            if (optarg == NULL || strcmp(optarg, "cache") == 0)
+                options.ambient = AMBIENT_OCCLUSION_CACHED;
+            else if (strcmp(optarg, "brute") == 0)
+                options.ambient = AMBIENT_OCCLUSION_BRUTE;
+            else
+                errx(1, "invalid ambient occlusion mode: %s", optarg);
+            break;
+        default:
+            errx(1, USAGE);
+        }
+    }
+
+    if (argc - optind != 1
+        || camera_path + edit_path + options.gbuffer > 1
+        || (edit_path && store_path != NULL)
+        || (bvh_cache != NULL && store_path != NULL)
+        || (lazy_bvh && (store_path != NULL || bvh_cache != NULL)))
+        errx(1, USAGE);
+    const char *output_path = argv[optind];
 
     struct rgb_image *image = rgb_image_alloc(1920, 1080);
     struct rgb_pixel bg_color = {0};
     rgb_image_clear(image, &bg_color);
 
-    struct sphere spheres[] = {
+    struct material materials[] = {
+        {
+            .surface_color = {0.75, 0.125, 0.125},
+            .diffuse_kn = 0.20,
+            .spec_n = 10,
+            .spec_ks = 0.20,
+        },
+        // glass
+        {
+            .kind = MATERIAL_GLASS,
+            .surface_color = {0.95, 0.95, 0.95},
+            .ior = 1.5,
+        },
+        // the ground
         {
-            .center = {0, 10, 0},
-            .radius = 4,
+            .surface_color = {0.5, 0.5, 0.5},
+            .diffuse_kn = 0.50,
+            .spec_n = 10,
+            .spec_ks = 0.,
         },
     };
 
-    double cam_width = 10;
-    double cam_height = cam_width * image->height / image->width;
-
-    struct camera camera = {
-        .center = {0, 0, 0},
-        .forward = {0, 1, 0},
-        .up = {0, 0, 1},
-        .width = cam_width,
-        .height = cam_height,
-        .focal_distance = focal_distance_from_fov(cam_width, 80),
+    struct sphere spheres[3];
+    size_t sphere_count = 0;
+    spheres[sphere_count++] = (struct sphere){
+        .center = {0, 10, 0},
+        .radius = 4,
+        .material = 0,
     };
-
-    struct vec3 light_color = {1, 1, 0}; // yellow
-    struct vec3 light_direction = {-1, 1, 1};
-    double light_intensity = 5;
-
-    vec3_normalize(&light_direction);
-
-    for (size_t y = 0; y < image->height; y++)
-        for (size_t x = 0; x < image->width; x++)
+    // the glass sphere focuses caustics, which only photons render
+    if (options.photon_count)
+        spheres[sphere_count++] = (struct sphere){
+            .center = {-4, 6, -2.5},
+            .radius = 1.5,
+            .material = 1,
+        };
+    if (area_light)
+        spheres[sphere_count++] = (struct sphere){
+            .center = {0, 10, -1004},
+            .radius = 1000,
+            .material = 2,
+        };
+
+    // the rectangle light comes last, and is left out unless asked for
+    struct light lights[] = {
         {
-            struct ray ray;
+            .type = LIGHT_DIRECTIONAL,
+            .color = {1, 1, 0}, // yellow
+            .direction = {-1, 1, 1},
+            .intensity = 5,
+        },
+        {
+            .type = LIGHT_RECT,
+            .color = {1, 1, 1},
+            .intensity = 200,
+            .position = {-6, 4, 10},
+            .edge_u = {0, 4, 0},
+            .edge_v = {4, 0, 0},
+        },
+    };
 
-            double cam_x = ((double)x / image->width) - 0.5;
-            double cam_y = ((double)y / image->height) - 0.5;
+    size_t light_count = sizeof(lights) / sizeof(lights[0]) - 1;
+    if (area_light)
+    {
+        light_count++;
+        // the ground would block the yellow light, which comes from below
+        lights[0].direction.z = -lights[0].direction.z;
+    }
 
-            camera_cast_ray(&ray, &camera, cam_x, cam_y);
+    for (size_t i = 0; i < light_count; i++)
+        if (lights[i].type == LIGHT_DIRECTIONAL)
+            vec3_normalize(&lights[i].direction);
 
-            struct intersection best_intersection;
-            double best_intersection_dist = INFINITY;
+    double cam_width = 10;
+    double cam_height = cam_width * image->height / image->width;
 
-            for (size_t i = 0; i < sizeof(spheres) / sizeof(spheres[0]); i++)
+    struct scene scene = {
+        .camera =
             {
-                struct intersection intersection;
-                // if there's no intersection between the ray and this object,
-                // skip
-                double intersection_dist
-                    = sphere_ray_intersect(&intersection, &ray, &spheres[i]);
-                if (intersection_dist >= best_intersection_dist)
-                    continue;
-
-                best_intersection_dist = intersection_dist;
-                best_intersection = intersection;
-            }
-
-            // if the intersection distance is infinite, do not shade the pixel
-            if (isinf(best_intersection_dist))
-                continue;
-
-            // a coefficient teaking how much diffuse light to add
-            double diffuse_kn = 0.20;
-            struct vec3 surface_color = {0.75, 0.125, 0.125};
-
-            struct vec3 light = vec3_mul(&light_color, light_intensity);
-            struct vec3 diffuse_light_color
-                = vec3_mul_vec(&light, &surface_color);
-
-            // compute the diffuse lighting contribution by applying the cosine
-            // law
-            double diffuse_intensity
-                = -vec3_dot(&best_intersection.normal, &light_direction);
-            if (diffuse_intensity < 0)
-                diffuse_intensity = 0;
-
-            struct vec3 diffuse_contribution
-                = vec3_mul(&diffuse_light_color, diffuse_intensity * diffuse_kn);
-
-            // compute the specular reflection contribution
-
-            // these two should be material specific, but aren't to keep
-            // things simple
-            // how wide the reflection is
-            double spec_n = 10;
-            // how much the specular reflection contributes
-            double spec_ks = 0.20;
-
-            struct vec3 light_reflection_dir
-                = vec3_reflect(&light_direction, &best_intersection.normal);
-            struct vec3 specular_contribution = {0};
-            // computes how much the reflection goes in the direction of the
-            // camera
-            double light_reflection_proj
-                = -vec3_dot(&light_reflection_dir, &ray.direction);
-            if (light_reflection_proj < 0.0)
-                light_reflection_proj = 0.0;
-            else
-            {
-                double spec_coeff
-                    = pow(light_reflection_proj, spec_n) * spec_ks;
-                specular_contribution = vec3_mul(&light_color, spec_coeff);
-            }
-
-            double ambient_intensity = 0.1;
-            struct vec3 ambient_contribution = vec3_mul(&surface_color, ambient_intensity);
-
-            struct vec3 pix_color = {0};
-            pix_color = vec3_add(&pix_color, &ambient_contribution);
-            pix_color = vec3_add(&pix_color, &diffuse_contribution);
-            pix_color = vec3_add(&pix_color, &specular_contribution);
-            rgb_image_set(image, x, y, rgb_color_from_light(&pix_color));
-        }
+                .center = {0, 0, 0},
+                .forward = {0, 1, 0},
+                .up = {0, 0, 1},
+                .width = cam_width,
+                .height = cam_height,
+                .focal_distance = focal_distance_from_fov(cam_width, 80),
+            },
+        .spheres = spheres,
+        .sphere_count = sphere_count,
+        .materials = materials,
+        .material_count = sizeof(materials) / sizeof(materials[0]),
+        .lights = lights,
+        .light_count = light_count,
+        .ambient_intensity = 0.1,
+        .bvh_cache = bvh_cache,
+        .lazy_bvh = lazy_bvh,
+    };
 
-    FILE *fp = fopen(argv[1], "w");
-    if (fp == NULL)
-        err(1, "failed to open the output file");
+    // the first process to render the scene publishes it for the others,
+    // and maps it back, so that it doesn't keep a copy of its own
+    uint64_t scene_options = (area_light ? SCENE_OPTION_AREA_LIGHT : 0)
+                             | (options.photon_count ? SCENE_OPTION_GLASS : 0);
+    if (store_path == NULL
+        || !scene_store_map(&scene, store_path, scene_options))
+    {
+        scene_prepare(&scene);
+        if (store_path != NULL)
+        {
+            scene_store_write(&scene, store_path, scene_options);
+            scene_release(&scene);
+            if (!scene_store_map(&scene, store_path, scene_options))
+                errx(1, "%s was removed while mapping it", store_path);
+        }
+    }
+
+    // all renders share the same threads
+    struct scheduler scheduler;
+    scheduler_init(&scheduler, options.thread_count);
+    options.scheduler = &scheduler;
+
+    // one set of counters per worker
+    struct perf_counters *perf
+        = xalloc(sizeof(*perf) * options.thread_count);
+    memset(perf, 0, sizeof(*perf) * options.thread_count);
+
+    // an interrupted render still writes the tiles it has
+    handle_cancellation();
+    options.cancel = &cancelled;
+
+    struct progress_page *progress = NULL;
+    if (progress_path != NULL)
+        progress = progress_create(progress_path, options.thread_count,
+                                   frame_count);
+    options.progress = progress;
+
+    struct renderer renderer;
+    renderer_init(&renderer, &scene, image, &options);
+
+    // previews only get direct light, and are never counted
+    struct rgb_image *preview_image = NULL;
+    struct perf_counters *preview_perf = NULL;
+    struct renderer preview_renderer;
+    if (preview)
+    {
+        struct render_options preview_options = RENDER_OPTIONS_DEFAULT;
+        preview_options.scheduler = &scheduler;
+        preview_options.priority = 1;
+        preview_options.cancel = &cancelled;
+        preview_image = rgb_image_alloc(image->width / PREVIEW_SCALE,
+                                        image->height / PREVIEW_SCALE);
+        preview_perf = xalloc(sizeof(*preview_perf) * options.thread_count);
+        memset(preview_perf, 0, sizeof(*preview_perf) * options.thread_count);
+        renderer_init(&preview_renderer, &scene, preview_image,
+                      &preview_options);
+    }
+
+    // lights and the camera turn around the red sphere
+    struct vec3 target = {0, 10, 0};
+    for (size_t frame = 0; frame < frame_count && !cancelled; frame++)
+    {
+        unsigned changes = 0;
+        if (frame > 0 && camera_path)
+        {
+            orbit_camera(&scene.camera, &target, CAMERA_PATH_STEP);
+            changes = RENDER_CHANGE_CAMERA;
+        }
+        else if (frame > 0 && edit_path)
+        {
+            // edits are tracked by renderer_objects_changed
+            move_object(&renderer, &scene, EDIT_PATH_OBJECT, EDIT_PATH_STEP);
+            changes = RENDER_CHANGE_GEOMETRY;
+        }
+        else if (frame > 0)
+        {
+            rotate_lights(&scene, &target, 2 * M_PI / frame_count);
+            changes = RENDER_CHANGE_LIGHTS;
+        }
 
-    return bmp_write(image, ppm_from_ppi(80), fp);
+        if (frame > 0 && !edit_path)
+            renderer_update(&renderer, changes);
+        if (frame > 0 && preview)
+            renderer_update(&preview_renderer, changes);
+        if (!render_frame(&renderer, perf,
+                          preview ? &preview_renderer : NULL, preview_perf,
+                          output_path, aov_path, frame, frame_count))
+            break;
+    }
+
+    if (preview)
+        renderer_destroy(&preview_renderer);
+    renderer_destroy(&renderer);
+    scheduler_destroy(&scheduler);
+    scene_release(&scene);
+    if (progress != NULL)
+        progress_close(progress,
+                       cancelled ? PROGRESS_CANCELLED : PROGRESS_DONE);
+
+    if (options.perf)
+    {
+        perf_counters_report(perf, options.thread_count, stderr);
+        memory_report(stderr);
+    }
+    free(perf);
+    free(preview_perf);
+    rgb_image_free(preview_image);
+    rgb_image_free(image);
+    return cancelled ? 1 : 0;
 }
@@ -0,0 +1,326 @@
+#include <err.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "rng.h"
+#include "scene.h"
+#include "scene_store.h"
+#include "utils.h"
+
+/*
+** Generates scenes of COUNT spheres, and writes them in the format
+** rt --scene-store PATH maps, to measure how building, tracing and threads
+** scale with the size of the scene. Spheres fill the same region whatever
+** their count, and shrink as there are more of them, so that the image
+** stays about as covered. The same seed always gives the same scene.
+**
+**   uniform    centers spread evenly over a cube
+**   clustered  dense gaussian clumps, around cube root of COUNT centers
+**   shell      centers on the surface of a sphere, seen from outside
+**   wall       a thin layer across the view, where each sphere overlaps
+**              about a dozen others
+*/
+
+#define USAGE                                                                  \
+    "Usage: rtgen [-d uniform|clustered|shell|wall] [-n COUNT] [-s SEED] "     \
+    "PATH"
+
+#define MIN_COUNT 1
+#define MAX_COUNT 10000000
+
+// spheres fill a cube of this half size, in front of the camera
+#define REGION_SIZE 8.
+#define REGION_DEPTH 30.
+
+enum distribution
+{
+    DISTRIBUTION_UNIFORM = 0,
+    DISTRIBUTION_CLUSTERED,
+    DISTRIBUTION_SHELL,
+    DISTRIBUTION_WALL,
+    DISTRIBUTION_COUNT,
+};
+
+static const char *const distribution_names[DISTRIBUTION_COUNT] = {
+    [DISTRIBUTION_UNIFORM] = "uniform",
+    [DISTRIBUTION_CLUSTERED] = "clustered",
+    [DISTRIBUTION_SHELL] = "shell",
+    [DISTRIBUTION_WALL] = "wall",
+};
+
+static struct material materials[] = {
+    {
+        .surface_color = {0.75, 0.125, 0.125},
+        .diffuse_kn = 0.20,
+        .spec_n = 10,
+        .spec_ks = 0.20,
+    },
+    {
+        .surface_color = {0.125, 0.5, 0.75},
+        .diffuse_kn = 0.30,
+        .spec_n = 40,
+        .spec_ks = 0.40,
+    },
+    {
+        .surface_color = {0.5, 0.5, 0.5},
+        .diffuse_kn = 0.50,
+        .spec_n = 10,
+        .spec_ks = 0.,
+    },
+    {
+        .kind = MATERIAL_GLASS,
+        .surface_color = {0.95, 0.95, 0.95},
+        .ior = 1.5,
+    },
+};
+
+#define MATERIAL_COUNT (sizeof(materials) / sizeof(materials[0]))
+
+static double uniform(struct rng *rng, double min, double max)
+{
+    return min + (max - min) * rng_double(rng);
+}
+
+// Box-Muller, of which only the first value is kept
+static double gaussian(struct rng *rng, double sigma)
+{
+    double u = 1. - rng_double(rng);
+    double v = rng_double(rng);
+    return sigma * sqrt(-2. * log(u)) * cos(2. * M_PI * v);
+}
+
+static struct vec3 region_point(struct rng *rng, double margin)
+{
+    double size = REGION_SIZE - margin;
+    return (struct vec3){
+        uniform(rng, -size, size),
+        REGION_DEPTH + uniform(rng, -size, size),
+        uniform(rng, -size, size),
+    };
+}
+
+static void generate_uniform(struct sphere *spheres, size_t count,
+                             struct rng *rng)
+{
+    // a quarter of the average distance between centers
+    double radius = REGION_SIZE / 2. / cbrt(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        spheres[i].center = region_point(rng, 0);
+        spheres[i].radius = radius;
+    }
+}
+
+static void generate_clustered(struct sphere *spheres, size_t count,
+                               struct rng *rng)
+{
+    size_t cluster_count = round(cbrt(count));
+    struct vec3 *clusters = xalloc(sizeof(*clusters) * cluster_count);
+    for (size_t i = 0; i < cluster_count; i++)
+        clusters[i] = region_point(rng, REGION_SIZE / 4.);
+
+    // clusters are much smaller than the space between them
+    double sigma = REGION_SIZE / 4. / cbrt(cluster_count);
+    double radius = sigma / 2. / cbrt((double)count / cluster_count);
+    for (size_t i = 0; i < count; i++)
+    {
+        const struct vec3 *cluster = &clusters[rng_next(rng) % cluster_count];
+        spheres[i].center = (struct vec3){
+            cluster->x + gaussian(rng, sigma),
+            cluster->y + gaussian(rng, sigma),
+            cluster->z + gaussian(rng, sigma),
+        };
+        spheres[i].radius = radius;
+    }
+    free(clusters);
+}
+
+static void generate_shell(struct sphere *spheres, size_t count,
+                           struct rng *rng)
+{
+    // a quarter of the average distance between centers on the surface
+    double radius = REGION_SIZE * sqrt(M_PI / count) / 2.;
+    for (size_t i = 0; i < count; i++)
+    {
+        double z = uniform(rng, -1, 1);
+        double angle = uniform(rng, 0, 2. * M_PI);
+        double r = sqrt(1. - z * z);
+        spheres[i].center = (struct vec3){
+            REGION_SIZE * r * cos(angle),
+            REGION_DEPTH + REGION_SIZE * r * sin(angle),
+            REGION_SIZE * z,
+        };
+        spheres[i].radius = radius;
+    }
+}
+
+static void generate_wall(struct sphere *spheres, size_t count,
+                          struct rng *rng)
+{
+    // as large as the average distance between centers
+    double radius = fmin(2. * REGION_SIZE / sqrt(count), REGION_SIZE);
+    for (size_t i = 0; i < count; i++)
+    {
+        spheres[i].center = (struct vec3){
+            uniform(rng, -REGION_SIZE, REGION_SIZE),
+            REGION_DEPTH + uniform(rng, -radius, radius) / 4.,
+            uniform(rng, -REGION_SIZE, REGION_SIZE),
+        };
+        spheres[i].radius = radius;
+    }
+}
+
+static void generate(struct sphere *spheres, size_t count,
+                     enum distribution distribution, uint64_t seed)
+{
+    struct rng rng;
+    rng_seed(&rng, seed);
+    switch (distribution)
+    {
+    case DISTRIBUTION_UNIFORM:
+        generate_uniform(spheres, count, &rng);
+        break;
+    case DISTRIBUTION_CLUSTERED:
+        generate_clustered(spheres, count, &rng);
+        break;
+    case DISTRIBUTION_SHELL:
+        generate_shell(spheres, count, &rng);
+        break;
+    case DISTRIBUTION_WALL:
+        generate_wall(spheres, count, &rng);
+        break;
+    case DISTRIBUTION_COUNT:
+        abort();
+    }
+
+    // materials come from a separate sequence, which keeps the geometry of
+    // each seed whatever the number of materials
+    rng_seed(&rng, ~seed);
+    for (size_t i = 0; i < count; i++)
+        spheres[i].material = rng_next(&rng) % MATERIAL_COUNT;
+}
+
+static enum distribution parse_distribution(const char *name)
+{
+    for (size_t i = 0; i < DISTRIBUTION_COUNT; i++)
+        if (strcmp(name, distribution_names[i]) == 0)
+            return i;
+    errx(1, "invalid distribution: %s", name);
+}
+
+static unsigned long long parse_number(const char *arg, const char *what)
+{
+    char *end;
+    errno = 0;
+    unsigned long long res = strtoull(arg, &end, 0);
+    if (errno != 0 || *arg == '\0' || *arg == '-' || *end != '\0')
+        errx(1, "invalid %s: %s", what, arg);
+    return res;
+}
+
+static double elapsed_seconds(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    enum distribution distribution = DISTRIBUTION_UNIFORM;
+    size_t count = 100000;
+    uint64_t seed = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:n:s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            distribution = parse_distribution(optarg);
+            break;
+        case 'n':
+            count = parse_number(optarg, "sphere count");
+            if (count < MIN_COUNT || count > MAX_COUNT)
+                errx(1, "sphere count must be between %d and %d",
+                     MIN_COUNT, MAX_COUNT);
+            break;
+        case 's':
+            seed = parse_number(optarg, "seed");
+            break;
+        default:
+            errx(1, USAGE);
+        }
+    }
+    if (argc - optind != 1)
+        errx(1, USAGE);
+    const char *path = argv[optind];
+
+    struct sphere *spheres = xalloc(sizeof(*spheres) * count);
+    generate(spheres, count, distribution, seed);
+
+    // shadows towards the directional light go through --shadow-grid, and
+    // the rectangle light casts soft shadows
+    struct light lights[] = {
+        {
+            .type = LIGHT_DIRECTIONAL,
+            .color = {1, 1, 1},
+            .direction = {-1, 1, 1},
+            .intensity = 5,
+        },
+        {
+            .type = LIGHT_RECT,
+            .color = {1, 1, 1},
+            .intensity = 200,
+            .position = {-6, 4, 10},
+            .edge_u = {0, 4, 0},
+            .edge_v = {4, 0, 0},
+        },
+    };
+    vec3_normalize(&lights[0].direction);
+
+    // rt renders 1920x1080 images, with the region in the middle
+    double cam_width = 10;
+    double cam_height = cam_width * 1080 / 1920;
+
+    struct scene scene = {
+        .camera =
+            {
+                .center = {0, 0, 0},
+                .forward = {0, 1, 0},
+                .up = {0, 0, 1},
+                .width = cam_width,
+                .height = cam_height,
+                .focal_distance = focal_distance_from_fov(cam_width, 80),
+            },
+        .spheres = spheres,
+        .sphere_count = count,
+        .materials = materials,
+        .material_count = MATERIAL_COUNT,
+        .lights = lights,
+        .light_count = sizeof(lights) / sizeof(lights[0]),
+        .ambient_intensity = 0.1,
+    };
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    scene_prepare(&scene);
+    double build_time = elapsed_seconds(&start);
+    // the scene has its own copy
+    free(spheres);
+
+    // rt's scene options only add to its own scene, and can't apply here
+    scene_store_write(&scene, path, 0);
+    printf("%s: %zu spheres, %s, seed %llu, hierarchy built in %.3fs\n",
+           path, count, distribution_names[distribution],
+           (unsigned long long)seed, build_time);
+    scene_release(&scene);
+    return 0;
+}
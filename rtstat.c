@@ -0,0 +1,125 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "progress.h"
+
+/*
+** Prints the progress of a render started with --progress PATH, once, or
+** every INTERVAL seconds until the render stops.
+*/
+
+#define USAGE "Usage: rtstat [-i INTERVAL] PATH"
+
+static const char *const state_names[] = {
+    [PROGRESS_RUNNING] = "running",
+    [PROGRESS_DONE] = "done",
+    [PROGRESS_CANCELLED] = "cancelled",
+};
+
+static double seconds(uint64_t ns)
+{
+    return ns / 1e9;
+}
+
+static void print_progress(const struct progress_page *page)
+{
+    // counters are read one at a time, as workers update them
+    uint32_t state = __atomic_load_n(&page->state, __ATOMIC_ACQUIRE);
+    uint64_t frames = __atomic_load_n(&page->frames_started, __ATOMIC_RELAXED);
+    uint64_t done = __atomic_load_n(&page->tiles_done, __ATOMIC_RELAXED);
+    uint64_t total = __atomic_load_n(&page->tiles_total, __ATOMIC_RELAXED);
+    uint64_t camera_rays
+        = __atomic_load_n(&page->camera_rays, __ATOMIC_RELAXED);
+    uint64_t shadow_rays
+        = __atomic_load_n(&page->shadow_rays, __ATOMIC_RELAXED);
+    uint64_t frame_start
+        = __atomic_load_n(&page->frame_start_ns, __ATOMIC_RELAXED);
+
+    // once stopped, time stops with the last update
+    uint64_t now = progress_now_ns();
+    if (state != PROGRESS_RUNNING)
+        now = __atomic_load_n(&page->updated_ns, __ATOMIC_RELAXED);
+    double elapsed = seconds(now - page->start_ns);
+    double frame_elapsed = seconds(now - frame_start);
+
+    const char *state_name = "unknown";
+    if (state < sizeof(state_names) / sizeof(state_names[0]))
+        state_name = state_names[state];
+    printf("pid %lu, %s, frame %lu of %lu, %.1fs elapsed\n",
+           (unsigned long)page->pid, state_name, (unsigned long)frames,
+           (unsigned long)page->frame_count, elapsed);
+
+    printf("%-14s %lu of %lu", "tiles", (unsigned long)done,
+           (unsigned long)total);
+    if (done != 0 && done < total && state == PROGRESS_RUNNING)
+        printf(", %.1fs left", frame_elapsed * (total - done) / done);
+    printf("\n");
+
+    if (frame_elapsed > 0)
+        printf("%-14s %.3g camera, %.3g shadow\n", "rays/s",
+               camera_rays / frame_elapsed, shadow_rays / frame_elapsed);
+
+    printf("%-14s", "memory (MiB)");
+    uint64_t memory_total = 0;
+    for (size_t i = 0; i < MEMORY_CATEGORY_COUNT; i++)
+    {
+        uint64_t used = __atomic_load_n(&page->memory[i], __ATOMIC_RELAXED);
+        memory_total += used;
+        printf(" %s %.2f,", memory_category_name(i), used / 1048576.);
+    }
+    printf(" total %.2f\n", memory_total / 1048576.);
+
+    printf("%-14s", "busy");
+    size_t thread_count = page->thread_count;
+    if (thread_count > PROGRESS_MAX_THREADS)
+        thread_count = PROGRESS_MAX_THREADS;
+    for (size_t i = 0; i < thread_count; i++)
+    {
+        uint64_t busy = __atomic_load_n(&page->busy_ns[i], __ATOMIC_RELAXED);
+        printf(" %3.0f%%", elapsed > 0 ? 100 * seconds(busy) / elapsed : 0);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    double interval = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "i:")) != -1)
+    {
+        char *end;
+        switch (opt)
+        {
+        case 'i':
+            interval = strtod(optarg, &end);
+            if (*end != '\0' || !(interval > 0))
+                errx(1, "invalid interval: %s", optarg);
+            break;
+        default:
+            errx(1, USAGE);
+        }
+    }
+    if (argc - optind != 1)
+        errx(1, USAGE);
+
+    const char *path = argv[optind];
+    const struct progress_page *page = progress_map(path);
+    if (page == NULL)
+        errx(1, "%s: no render progress", path);
+
+    print_progress(page);
+    while (interval > 0
+           && __atomic_load_n(&page->state, __ATOMIC_ACQUIRE)
+                  == PROGRESS_RUNNING)
+    {
+        usleep(interval * 1e6);
+        printf("\n");
+        print_progress(page);
+    }
+    progress_unmap(page);
+    return 0;
+}
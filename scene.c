@@ -0,0 +1,367 @@
+#include "scene.h"
+
+#include "bvh_cache.h"
+#include "memory.h"
+#include "scene_store.h"
+#include "utils.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct sort_key
+{
+    uint64_t code;
+    size_t index;
+};
+
+static int sort_key_compare(const void *a, const void *b)
+{
+    const struct sort_key *ka = a;
+    const struct sort_key *kb = b;
+    if (ka->code != kb->code)
+        return ka->code < kb->code ? -1 : 1;
+    // keep the original order of identical codes
+    return (ka->index > kb->index) - (ka->index < kb->index);
+}
+
+/*
+** Returns the order of spheres [first, first + count) along a Morton curve:
+** the i-th sphere of the curve is first + order[i].
+*/
+static uint32_t *sphere_order(const struct scene *scene, size_t first,
+                              size_t count)
+{
+    uint64_t *codes = xalloc(sizeof(*codes) * count);
+    bvh_morton_codes(codes, scene->spheres + first, count);
+
+    struct sort_key *keys = xalloc(sizeof(*keys) * count);
+    for (size_t i = 0; i < count; i++)
+        keys[i] = (struct sort_key){codes[i], i};
+    qsort(keys, count, sizeof(*keys), sort_key_compare);
+    free(codes);
+
+    uint32_t *res = xalloc(sizeof(*res) * count);
+    for (size_t i = 0; i < count; i++)
+        res[i] = keys[i].index;
+    free(keys);
+    return res;
+}
+
+/*
+** Sorting composes with any previous order, so that ids always refer to the
+** order the scene was first given in.
+*/
+static void reorder_spheres(struct scene *scene, size_t first, size_t count,
+                            const uint32_t *order)
+{
+    struct sphere *sorted = xalloc(sizeof(*sorted) * count);
+    size_t *ids = xalloc(sizeof(*ids) * count);
+    for (size_t i = 0; i < count; i++)
+    {
+        sorted[i] = scene->spheres[first + order[i]];
+        ids[i] = scene->object_ids[first + order[i]];
+        scene->object_indices[ids[i]] = first + i;
+    }
+    memcpy(scene->spheres + first, sorted, sizeof(*sorted) * count);
+    memcpy(scene->object_ids + first, ids, sizeof(*ids) * count);
+    free(ids);
+    free(sorted);
+}
+
+static void sort_spheres(struct scene *scene, size_t first, size_t count)
+{
+    uint32_t *order = sphere_order(scene, first, count);
+    reorder_spheres(scene, first, count, order);
+    free(order);
+}
+
+static void sort_materials(struct scene *scene)
+{
+    size_t count = scene->material_count;
+    const size_t unused = (size_t)-1;
+    size_t *new_indices = xalloc(sizeof(*new_indices) * count);
+    for (size_t i = 0; i < count; i++)
+        new_indices[i] = unused;
+
+    // number materials in the order spheres use them
+    size_t next = 0;
+    for (size_t i = 0; i < scene->sphere_count; i++)
+    {
+        size_t index = scene->spheres[i].material;
+        if (new_indices[index] == unused)
+            new_indices[index] = next++;
+    }
+    for (size_t index = 0; index < count; index++)
+        if (new_indices[index] == unused)
+            new_indices[index] = next++;
+
+    struct material *sorted = xalloc(sizeof(*sorted) * count);
+    size_t *ids = xalloc(sizeof(*ids) * count);
+    for (size_t index = 0; index < count; index++)
+    {
+        size_t new_index = new_indices[index];
+        sorted[new_index] = scene->materials[index];
+        ids[new_index] = scene->material_ids[index];
+        scene->material_indices[ids[new_index]] = new_index;
+    }
+    memcpy(scene->materials, sorted, sizeof(*sorted) * count);
+    memcpy(scene->material_ids, ids, sizeof(*ids) * count);
+    free(ids);
+    free(sorted);
+
+    for (size_t i = 0; i < scene->sphere_count; i++)
+    {
+        struct sphere *sphere = &scene->spheres[i];
+        sphere->material = new_indices[sphere->material];
+    }
+    free(new_indices);
+}
+
+static size_t *identity_map(size_t count)
+{
+    size_t *res = memory_alloc(MEMORY_SCENE, sizeof(*res) * count);
+    for (size_t i = 0; i < count; i++)
+        res[i] = i;
+    return res;
+}
+
+/*
+** Rebuilds the hierarchy of the spheres added since the last full build
+*/
+static void build_added(struct scene *scene)
+{
+    size_t first = scene->bvh.count;
+    size_t count = scene->sphere_count - first;
+    sort_spheres(scene, first, count);
+    bvh_destroy(&scene->added);
+    bvh_build(&scene->added, scene->spheres, first, count);
+}
+
+static void build_all(struct scene *scene)
+{
+    size_t count = scene->sphere_count;
+    sort_spheres(scene, 0, count);
+    bvh_destroy(&scene->bvh);
+    if (scene->lazy_bvh)
+        bvh_build_lazy(&scene->bvh, scene->spheres, 0, count);
+    else
+        bvh_build(&scene->bvh, scene->spheres, 0, count);
+    bvh_destroy(&scene->added);
+    bvh_build(&scene->added, scene->spheres, count, 0);
+}
+
+/*
+** Like build_all, but reuses the hierarchy and order of spheres from an
+** earlier run on the same geometry, and saves them otherwise.
+*/
+static void build_all_cached(struct scene *scene)
+{
+    size_t count = scene->sphere_count;
+    bvh_destroy(&scene->bvh);
+    bvh_destroy(&scene->added);
+    bvh_build(&scene->added, scene->spheres, count, 0);
+
+    uint64_t key = bvh_cache_key(scene->spheres, count);
+    const uint32_t *cached_order;
+    if (bvh_cache_load(&scene->bvh, &cached_order, scene->bvh_cache, key, 0,
+                       count))
+    {
+        reorder_spheres(scene, 0, count, cached_order);
+        return;
+    }
+
+    uint32_t *order = sphere_order(scene, 0, count);
+    reorder_spheres(scene, 0, count, order);
+    bvh_build(&scene->bvh, scene->spheres, 0, count);
+    bvh_cache_store(&scene->bvh, order, scene->bvh_cache, key);
+    free(order);
+}
+
+void scene_prepare(struct scene *scene)
+{
+    size_t sphere_count = scene->sphere_count;
+    size_t material_count = scene->material_count;
+    if (scene->object_ids == NULL)
+    {
+        struct sphere *spheres
+            = memory_alloc(MEMORY_SCENE, sizeof(*spheres) * sphere_count);
+        memcpy(spheres, scene->spheres, sizeof(*spheres) * sphere_count);
+        scene->spheres = spheres;
+        scene->sphere_capacity = sphere_count;
+
+        scene->object_ids = identity_map(sphere_count);
+        scene->object_indices = identity_map(sphere_count);
+        scene->object_id_count = sphere_count;
+        scene->object_id_capacity = sphere_count;
+        scene->material_ids = identity_map(material_count);
+        scene->material_indices = identity_map(material_count);
+    }
+
+    if (scene->bvh_cache != NULL && scene->sphere_count > 0)
+        build_all_cached(scene);
+    else
+        build_all(scene);
+    sort_materials(scene);
+}
+
+void scene_release(struct scene *scene)
+{
+    if (scene->store != NULL)
+    {
+        scene_store_unmap(scene);
+        return;
+    }
+
+    bvh_destroy(&scene->bvh);
+    bvh_destroy(&scene->added);
+    if (scene->object_ids != NULL)
+        memory_free(scene->spheres);
+    memory_free(scene->object_ids);
+    memory_free(scene->object_indices);
+    memory_free(scene->material_ids);
+    memory_free(scene->material_indices);
+}
+
+static size_t grow_capacity(size_t capacity)
+{
+    return capacity < 16 ? 16 : 2 * capacity;
+}
+
+size_t scene_add_sphere(struct scene *scene, const struct sphere *sphere)
+{
+    // arrays only get their new capacity once all of them have it
+    if (scene->object_id_count == scene->object_id_capacity)
+    {
+        size_t capacity = grow_capacity(scene->object_id_capacity);
+        size_t *object_indices
+            = memory_realloc(scene->object_indices, MEMORY_SCENE,
+                             sizeof(*object_indices) * capacity);
+        if (object_indices == NULL)
+            return SCENE_NO_OBJECT;
+        scene->object_indices = object_indices;
+        scene->object_id_capacity = capacity;
+    }
+    if (scene->sphere_count == scene->sphere_capacity)
+    {
+        size_t capacity = grow_capacity(scene->sphere_capacity);
+        struct sphere *spheres = memory_realloc(
+            scene->spheres, MEMORY_SCENE, sizeof(*spheres) * capacity);
+        if (spheres == NULL)
+            return SCENE_NO_OBJECT;
+        scene->spheres = spheres;
+        size_t *object_ids = memory_realloc(
+            scene->object_ids, MEMORY_SCENE, sizeof(*object_ids) * capacity);
+        if (object_ids == NULL)
+            return SCENE_NO_OBJECT;
+        scene->object_ids = object_ids;
+        scene->sphere_capacity = capacity;
+    }
+
+    size_t id = scene->object_id_count++;
+    size_t index = scene->sphere_count++;
+    scene->spheres[index] = *sphere;
+    scene->spheres[index].material = scene->material_indices[sphere->material];
+    scene->object_ids[index] = id;
+    scene->object_indices[id] = index;
+
+    if (scene->sphere_count - scene->bvh.count > SCENE_MAX_ADDED)
+        build_all(scene);
+    else
+        build_added(scene);
+    return id;
+}
+
+void scene_remove_sphere(struct scene *scene, size_t id)
+{
+    size_t index = scene->object_indices[id];
+    if (index == SCENE_NO_OBJECT)
+        return;
+    size_t last = --scene->sphere_count;
+    scene->object_indices[id] = SCENE_NO_OBJECT;
+
+    // fill the hole with the last sphere, which keeps its id
+    if (index != last)
+    {
+        size_t last_id = scene->object_ids[last];
+        scene->spheres[index] = scene->spheres[last];
+        scene->object_ids[index] = last_id;
+        scene->object_indices[last_id] = index;
+    }
+
+    if (index >= scene->bvh.count)
+    {
+        build_added(scene);
+        return;
+    }
+
+    // the last sphere came from the added ones, or from the end of the
+    // hierarchy, which then stops covering it
+    if (last >= scene->bvh.count)
+        build_added(scene);
+    else
+        bvh_remove_last(&scene->bvh, scene->spheres);
+    if (index != last)
+        bvh_refit(&scene->bvh, scene->spheres, index);
+
+    if (bvh_degradation(&scene->bvh) > SCENE_MAX_DEGRADATION)
+        build_all(scene);
+}
+
+void scene_move_sphere(struct scene *scene, size_t id,
+                       const struct vec3 *center)
+{
+    size_t index = scene->object_indices[id];
+    if (index == SCENE_NO_OBJECT)
+        return;
+    scene->spheres[index].center = *center;
+    if (index >= scene->bvh.count)
+    {
+        bvh_refit(&scene->added, scene->spheres, index);
+        return;
+    }
+
+    bvh_refit(&scene->bvh, scene->spheres, index);
+    if (bvh_degradation(&scene->bvh) > SCENE_MAX_DEGRADATION)
+        build_all(scene);
+}
+
+double scene_intersect(const struct scene *scene, const struct ray *ray,
+                       struct intersection *intersection, size_t *object,
+                       struct object_set *hits)
+{
+    double best_distance
+        = bvh_intersect(&scene->bvh, scene->spheres, ray, object, hits);
+    size_t added_object;
+    double added_distance = bvh_intersect(&scene->added, scene->spheres, ray,
+                                          &added_object, hits);
+    if (added_distance < best_distance)
+    {
+        best_distance = added_distance;
+        *object = added_object;
+    }
+
+    if (!isinf(best_distance))
+        sphere_ray_intersect(intersection, ray, &scene->spheres[*object]);
+    return best_distance;
+}
+
+void scene_intersect_packet(const struct scene *scene,
+                            struct bvh_packet *packet,
+                            struct object_set *hits)
+{
+    for (size_t r = 0; r < packet->count; r++)
+        packet->distances[r] = INFINITY;
+    bvh_intersect_packet(&scene->bvh, scene->spheres, packet, hits);
+    bvh_intersect_packet(&scene->added, scene->spheres, packet, hits);
+}
+
+bool scene_occluded(const struct scene *scene, const struct ray *ray,
+                    double max_distance, size_t *occluder,
+                    struct object_set *hits)
+{
+    return bvh_occluded(&scene->bvh, scene->spheres, ray, max_distance,
+                        occluder, hits)
+           || bvh_occluded(&scene->added, scene->spheres, ray, max_distance,
+                           occluder, hits);
+}
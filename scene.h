@@ -0,0 +1,147 @@
+#pragma once
+
+#include "bvh.h"
+#include "camera.h"
+#include "light.h"
+#include "shading.h"
+#include "sphere.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// the index of removed objects
+#define SCENE_NO_OBJECT ((size_t)-1)
+// beyond this many added spheres, the whole hierarchy is built again
+#define SCENE_MAX_ADDED 1024
+// once moves made the hierarchy this much looser, it is built again
+#define SCENE_MAX_DEGRADATION 2.
+
+struct scene
+{
+    struct camera camera;
+
+    struct sphere *spheres;
+    size_t sphere_count;
+
+    struct material *materials;
+    size_t material_count;
+
+    struct light *lights;
+    size_t light_count;
+
+    double ambient_intensity;
+
+    // if not NULL, a directory where scene_prepare saves the hierarchies
+    // it builds, and looks for them first
+    const char *bvh_cache;
+    // otherwise, whether hierarchies are built as rays first reach their
+    // nodes, rather than up front
+    bool lazy_bvh;
+
+    // built by scene_prepare
+    struct bvh bvh;
+    // spheres added since then follow the others, and get a small
+    // hierarchy of their own, built again on each addition
+    struct bvh added;
+    // scene_prepare copies the spheres, so that there is room to add more
+    size_t sphere_capacity;
+
+    // spheres and materials are moved around by scene_prepare. These map
+    // their current index to their id, the index they were given with, and
+    // back. Added spheres get new ids, which are never reused: removed ids
+    // map to SCENE_NO_OBJECT
+    size_t *object_ids;
+    size_t *object_indices;
+    size_t object_id_count;
+    size_t object_id_capacity;
+    size_t *material_ids;
+    size_t *material_indices;
+
+    // set by scene_store_map, when all but the lights are in a read-only
+    // mapping, which cannot be edited
+    void *store;
+    size_t store_size;
+};
+
+/*
+** Sorts spheres along a Morton curve of their centers, so that spheres
+** close in space are close in memory, then builds the acceleration
+** structure over them. Materials are sorted by first use, so that nearby
+** spheres also share nearby materials. Must be called once the scene is
+** complete, and before rendering. Spheres are copied the first time, and
+** the scene then owns them. Calling it again rebuilds everything, which
+** the edit functions below avoid. Ids keep referring to the order the
+** scene was first given in.
+*/
+void scene_prepare(struct scene *scene);
+
+/*
+** Frees what scene_prepare allocated. The materials and lights belong to
+** the caller. Unmaps scenes mapped by scene_store_map.
+*/
+void scene_release(struct scene *scene);
+
+/*
+** Edits a prepared scene, and updates the acceleration structure locally.
+** Added spheres use a material id, and get a new object id, or
+** SCENE_NO_OBJECT if there is no memory left for them. Removing a
+** sphere moves the last one into its place. Ids must be below
+** object_id_count, and removing or moving one which was already removed
+** does nothing. Moving a sphere refits the hierarchy, which is built
+** again once it gets too loose.
+*/
+size_t scene_add_sphere(struct scene *scene, const struct sphere *sphere);
+void scene_remove_sphere(struct scene *scene, size_t id);
+void scene_move_sphere(struct scene *scene, size_t id,
+                       const struct vec3 *center);
+
+/*
+** Returns the index the object was given with.
+*/
+static inline size_t scene_object_id(const struct scene *scene,
+                                     size_t object)
+{
+    return scene->object_ids ? scene->object_ids[object] : object;
+}
+
+/*
+** Returns the current index of an object, or SCENE_NO_OBJECT if it was
+** removed.
+*/
+static inline size_t scene_object_index(const struct scene *scene, size_t id)
+{
+    return scene->object_indices ? scene->object_indices[id] : id;
+}
+
+static inline const struct material *scene_material(const struct scene *scene,
+                                                    size_t object)
+{
+    return &scene->materials[scene->spheres[object].material];
+}
+
+/*
+** Finds the closest object hit by the ray. Returns the distance to the
+** intersection, or INFINITY if nothing was hit. When something is hit,
+** intersection and object are filled in. If hits is not NULL, the
+** objects hit on the way are added to it.
+*/
+double scene_intersect(const struct scene *scene, const struct ray *ray,
+                       struct intersection *intersection, size_t *object,
+                       struct object_set *hits);
+
+/*
+** Finds the closest object hit by each ray of the packet, whose distances
+** and objects are filled in, like scene_intersect.
+*/
+void scene_intersect_packet(const struct scene *scene,
+                            struct bvh_packet *packet,
+                            struct object_set *hits);
+
+/*
+** Returns whether anything blocks the ray before max_distance, and stores
+** the index of the blocking sphere in occluder. If hits is not NULL, it is
+** added to it as well.
+*/
+bool scene_occluded(const struct scene *scene, const struct ray *ray,
+                    double max_distance, size_t *occluder,
+                    struct object_set *hits);
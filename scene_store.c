@@ -0,0 +1,327 @@
+#include "scene_store.h"
+
+#include "memory.h"
+#include "utils.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SCENE_STORE_MAGIC "rt-scene"
+#define SCENE_STORE_VERSION 2
+// sections start on cache lines
+#define SCENE_STORE_ALIGN 64
+
+enum store_section_kind
+{
+    SECTION_SPHERES = 0,
+    SECTION_MATERIALS,
+    SECTION_LIGHTS,
+    SECTION_NODES,
+    SECTION_LEAVES,
+    SECTION_ADDED_NODES,
+    SECTION_ADDED_LEAVES,
+    SECTION_OBJECT_IDS,
+    SECTION_OBJECT_INDICES,
+    SECTION_MATERIAL_IDS,
+    SECTION_MATERIAL_INDICES,
+    SECTION_COUNT,
+};
+
+// structures are stored as they are in memory, and only fit the same build
+static const size_t element_sizes[SECTION_COUNT] = {
+    [SECTION_SPHERES] = sizeof(struct sphere),
+    [SECTION_MATERIALS] = sizeof(struct material),
+    [SECTION_LIGHTS] = sizeof(struct light),
+    [SECTION_NODES] = sizeof(struct bvh_node),
+    [SECTION_LEAVES] = sizeof(uint32_t),
+    [SECTION_ADDED_NODES] = sizeof(struct bvh_node),
+    [SECTION_ADDED_LEAVES] = sizeof(uint32_t),
+    [SECTION_OBJECT_IDS] = sizeof(size_t),
+    [SECTION_OBJECT_INDICES] = sizeof(size_t),
+    [SECTION_MATERIAL_IDS] = sizeof(size_t),
+    [SECTION_MATERIAL_INDICES] = sizeof(size_t),
+};
+
+struct store_section
+{
+    uint64_t offset;
+    uint64_t count;
+    uint64_t element_size;
+};
+
+struct store_bvh
+{
+    uint64_t first;
+    uint64_t count;
+    double area;
+    double built_area;
+};
+
+struct store_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t section_count;
+    struct camera camera;
+    double ambient_intensity;
+    uint64_t object_id_count;
+    uint64_t options;
+    struct store_bvh bvh;
+    struct store_bvh added;
+    struct store_section sections[SECTION_COUNT];
+};
+
+static struct store_bvh store_bvh(const struct bvh *bvh)
+{
+    return (struct store_bvh){
+        .first = bvh->first,
+        .count = bvh->count,
+        .area = bvh->area,
+        .built_area = bvh->built_area,
+    };
+}
+
+void scene_store_write(const struct scene *scene, const char *path,
+                       uint64_t options)
+{
+    const void *data[SECTION_COUNT] = {
+        [SECTION_SPHERES] = scene->spheres,
+        [SECTION_MATERIALS] = scene->materials,
+        [SECTION_LIGHTS] = scene->lights,
+        [SECTION_NODES] = scene->bvh.nodes,
+        [SECTION_LEAVES] = scene->bvh.leaves,
+        [SECTION_ADDED_NODES] = scene->added.nodes,
+        [SECTION_ADDED_LEAVES] = scene->added.leaves,
+        [SECTION_OBJECT_IDS] = scene->object_ids,
+        [SECTION_OBJECT_INDICES] = scene->object_indices,
+        [SECTION_MATERIAL_IDS] = scene->material_ids,
+        [SECTION_MATERIAL_INDICES] = scene->material_indices,
+    };
+    const size_t counts[SECTION_COUNT] = {
+        [SECTION_SPHERES] = scene->sphere_count,
+        [SECTION_MATERIALS] = scene->material_count,
+        [SECTION_LIGHTS] = scene->light_count,
+        [SECTION_NODES] = scene->bvh.node_count,
+        [SECTION_LEAVES] = scene->bvh.count,
+        [SECTION_ADDED_NODES] = scene->added.node_count,
+        [SECTION_ADDED_LEAVES] = scene->added.count,
+        [SECTION_OBJECT_IDS] = scene->sphere_count,
+        [SECTION_OBJECT_INDICES] = scene->object_id_count,
+        [SECTION_MATERIAL_IDS] = scene->material_count,
+        [SECTION_MATERIAL_INDICES] = scene->material_count,
+    };
+
+    struct store_header header = {
+        .version = SCENE_STORE_VERSION,
+        .section_count = SECTION_COUNT,
+        .camera = scene->camera,
+        .ambient_intensity = scene->ambient_intensity,
+        .object_id_count = scene->object_id_count,
+        .options = options,
+        .bvh = store_bvh(&scene->bvh),
+        .added = store_bvh(&scene->added),
+    };
+    memcpy(header.magic, SCENE_STORE_MAGIC, sizeof(header.magic));
+
+    size_t offset = align_up(sizeof(header), SCENE_STORE_ALIGN);
+    for (size_t i = 0; i < SECTION_COUNT; i++)
+    {
+        header.sections[i] = (struct store_section){
+            .offset = offset,
+            .count = counts[i],
+            .element_size = element_sizes[i],
+        };
+        offset = align_up(offset + counts[i] * element_sizes[i],
+                          SCENE_STORE_ALIGN);
+    }
+
+    char *tmp_path;
+    FILE *fp = replace_file_open(path, &tmp_path);
+    if (fp == NULL)
+        err(1, "failed to create a file next to %s", path);
+    bool failed = fwrite(&header, sizeof(header), 1, fp) != 1;
+    for (size_t i = 0; i < SECTION_COUNT && !failed; i++)
+    {
+        if (counts[i] == 0)
+            continue;
+        failed = fseek(fp, header.sections[i].offset, SEEK_SET) != 0
+                 || fwrite(data[i], element_sizes[i], counts[i], fp)
+                        != counts[i];
+    }
+    // pad the last section, so that sections never run past the end
+    if (failed || fflush(fp) != 0 || ftruncate(fileno(fp), offset) != 0)
+    {
+        replace_file_abort(fp, tmp_path);
+        err(1, "failed to write %s", path);
+    }
+    if (replace_file_commit(fp, tmp_path, path) != 0)
+        err(1, "failed to write %s", path);
+}
+
+/*
+** Finds a section of the file, after checking it holds what this build
+** expects.
+*/
+static void *store_section(void *store, size_t store_size,
+                           const struct store_header *header,
+                           enum store_section_kind kind, const char *path)
+{
+    const struct store_section *section = &header->sections[kind];
+    if (section->element_size != element_sizes[kind]
+        || section->offset % SCENE_STORE_ALIGN != 0
+        || section->offset > store_size
+        || section->count > (store_size - section->offset)
+                                / element_sizes[kind])
+        errx(1, "%s: invalid scene store section %d", path, kind);
+    return (char *)store + section->offset;
+}
+
+static struct bvh map_bvh(const struct store_bvh *stored, void *nodes,
+                          size_t node_count, void *leaves)
+{
+    return (struct bvh){
+        .nodes = nodes,
+        .node_count = node_count,
+        .first = stored->first,
+        .count = stored->count,
+        .leaves = leaves,
+        .area = stored->area,
+        .built_area = stored->built_area,
+    };
+}
+
+/*
+** Checks that the materials of spheres, and the maps between ids and
+** indices, stay within their arrays.
+*/
+static bool store_indices_valid(void *const sections[SECTION_COUNT],
+                                size_t sphere_count, size_t material_count,
+                                size_t object_id_count)
+{
+    const struct sphere *spheres = sections[SECTION_SPHERES];
+    const size_t *object_ids = sections[SECTION_OBJECT_IDS];
+    for (size_t i = 0; i < sphere_count; i++)
+        if (spheres[i].material >= material_count
+            || object_ids[i] >= object_id_count)
+            return false;
+
+    // removed objects have no index
+    const size_t *object_indices = sections[SECTION_OBJECT_INDICES];
+    for (size_t i = 0; i < object_id_count; i++)
+        if (object_indices[i] >= sphere_count
+            && object_indices[i] != SCENE_NO_OBJECT)
+            return false;
+
+    const size_t *material_ids = sections[SECTION_MATERIAL_IDS];
+    const size_t *material_indices = sections[SECTION_MATERIAL_INDICES];
+    for (size_t i = 0; i < material_count; i++)
+        if (material_ids[i] >= material_count
+            || material_indices[i] >= material_count)
+            return false;
+    return true;
+}
+
+bool scene_store_map(struct scene *scene, const char *path,
+                     uint64_t options)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        if (errno == ENOENT)
+            return false;
+        err(1, "failed to open %s", path);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        err(1, "failed to stat %s", path);
+    size_t store_size = st.st_size;
+    if (store_size < sizeof(struct store_header))
+        errx(1, "%s: truncated scene store", path);
+
+    void *store = mmap(NULL, store_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (store == MAP_FAILED)
+        err(1, "failed to map %s", path);
+    close(fd);
+
+    const struct store_header *header = store;
+    if (memcmp(header->magic, SCENE_STORE_MAGIC, sizeof(header->magic)) != 0
+        || header->version != SCENE_STORE_VERSION
+        || header->section_count != SECTION_COUNT)
+        errx(1, "%s: not a scene store, or from another version", path);
+    if (header->options != options)
+        errx(1, "%s: scene store written with other scene options", path);
+
+    void *sections[SECTION_COUNT];
+    for (size_t i = 0; i < SECTION_COUNT; i++)
+        sections[i] = store_section(store, store_size, header, i, path);
+    const struct store_section *counts = header->sections;
+
+    // spheres are indexed by the hierarchies, and by the maps
+    size_t sphere_count = counts[SECTION_SPHERES].count;
+    size_t material_count = counts[SECTION_MATERIALS].count;
+    if (header->bvh.first != 0 || header->added.first != header->bvh.count
+        || header->bvh.count + header->added.count != sphere_count
+        || counts[SECTION_LEAVES].count != header->bvh.count
+        || counts[SECTION_ADDED_LEAVES].count != header->added.count
+        || counts[SECTION_OBJECT_IDS].count != sphere_count
+        || counts[SECTION_OBJECT_INDICES].count != header->object_id_count
+        || counts[SECTION_MATERIAL_IDS].count != material_count
+        || counts[SECTION_MATERIAL_INDICES].count != material_count)
+        errx(1, "%s: inconsistent scene store", path);
+
+    struct bvh bvh = map_bvh(&header->bvh, sections[SECTION_NODES],
+                             counts[SECTION_NODES].count,
+                             sections[SECTION_LEAVES]);
+    struct bvh added = map_bvh(&header->added, sections[SECTION_ADDED_NODES],
+                               counts[SECTION_ADDED_NODES].count,
+                               sections[SECTION_ADDED_LEAVES]);
+    if (!bvh_valid(&bvh) || !bvh_valid(&added)
+        || !store_indices_valid(sections, sphere_count, material_count,
+                                header->object_id_count))
+        errx(1, "%s: invalid scene store", path);
+
+    // the only part which may change
+    size_t light_count = counts[SECTION_LIGHTS].count;
+    struct light *lights
+        = memory_alloc(MEMORY_SCENE, sizeof(*lights) * light_count);
+    memcpy(lights, sections[SECTION_LIGHTS], sizeof(*lights) * light_count);
+
+    *scene = (struct scene){
+        .camera = header->camera,
+        .spheres = sections[SECTION_SPHERES],
+        .sphere_count = sphere_count,
+        .materials = sections[SECTION_MATERIALS],
+        .material_count = material_count,
+        .lights = lights,
+        .light_count = light_count,
+        .ambient_intensity = header->ambient_intensity,
+        .bvh = bvh,
+        .added = added,
+        .sphere_capacity = sphere_count,
+        .object_ids = sections[SECTION_OBJECT_IDS],
+        .object_indices = sections[SECTION_OBJECT_INDICES],
+        .object_id_count = header->object_id_count,
+        .object_id_capacity = header->object_id_count,
+        .material_ids = sections[SECTION_MATERIAL_IDS],
+        .material_indices = sections[SECTION_MATERIAL_INDICES],
+        .store = store,
+        .store_size = store_size,
+    };
+    return true;
+}
+
+void scene_store_unmap(struct scene *scene)
+{
+    memory_free(scene->lights);
+    munmap(scene->store, scene->store_size);
+    scene->store = NULL;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "scene.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+** A prepared scene, along with its hierarchies, laid out in a single file
+** which processes rendering the same scene map read-only, rather than each
+** holding a copy. Sections are found by their offset from the start of the
+** file, and nodes refer to each other by index, so that the file works
+** wherever it is mapped. Files in /dev/shm are held in shared memory.
+*/
+
+/*
+** Writes a prepared scene. The file is written next to path, then renamed
+** over it, so that processes never map part of a scene. options are the
+** flags of the writer which shaped the scene, whose meaning is up to it.
+*/
+void scene_store_write(const struct scene *scene, const char *path,
+                       uint64_t options);
+
+/*
+** Points the scene into a file written by scene_store_write. Returns false
+** if there is no such file, and exits if it was written with other
+** options, as the scene would not be the one asked for. Lights are copied,
+** so that they can still change, but the rest of the scene may not be
+** edited. scene_release unmaps the file.
+*/
+bool scene_store_map(struct scene *scene, const char *path,
+                     uint64_t options);
+
+/*
+** Called by scene_release for mapped scenes.
+*/
+void scene_store_unmap(struct scene *scene);
@@ -0,0 +1,192 @@
+#include "scheduler.h"
+#include "memory.h"
+#include "utils.h"
+
+#include <err.h>
+#include <math.h>
+#include <stdlib.h>
+
+struct scheduler_worker
+{
+    struct scheduler *scheduler;
+    size_t id;
+};
+
+/*
+** Admits the job if its memory fits, along with that of the jobs admitted
+** before it which didn't start yet.
+*/
+static void admit_job(struct scheduler *scheduler, struct scheduler_job *job)
+{
+    if (job->admitted || !memory_fits(scheduler->reserved + job->memory))
+        return;
+    job->admitted = true;
+    scheduler->reserved += job->memory;
+}
+
+static bool job_admissible(const struct scheduler *scheduler,
+                           const struct scheduler_job *job)
+{
+    // a job larger than the budget still runs, alone
+    return job->started || job->admitted || scheduler->running == 0;
+}
+
+/*
+** Picks the job to take an item from: the highest priority first, then
+** the one which used the least of its share. Jobs which don't fit in
+** memory yet are passed over.
+*/
+static struct scheduler_job *pick_job(struct scheduler *scheduler)
+{
+    struct scheduler_job *best = NULL;
+    for (struct scheduler_job *job = scheduler->jobs; job != NULL;
+         job = job->next_job)
+    {
+        if (best != NULL
+            && (job->priority < best->priority
+                || (job->priority == best->priority
+                    && job->pass >= best->pass)))
+            continue;
+        if (job_admissible(scheduler, job))
+            best = job;
+    }
+
+    if (best != NULL && !best->started)
+    {
+        if (best->admitted)
+            scheduler->reserved -= best->memory;
+        best->started = true;
+        scheduler->running++;
+        if (best->start != NULL)
+            best->start(best->ctx);
+    }
+    return best;
+}
+
+static void unlink_job(struct scheduler *scheduler, struct scheduler_job *job)
+{
+    struct scheduler_job **link = &scheduler->jobs;
+    while (*link != job)
+        link = &(*link)->next_job;
+    *link = job->next_job;
+}
+
+static void *scheduler_worker_run(void *arg)
+{
+    struct scheduler_worker *worker = arg;
+    struct scheduler *scheduler = worker->scheduler;
+
+    pthread_mutex_lock(&scheduler->lock);
+    while (!scheduler->shutdown)
+    {
+        struct scheduler_job *job = pick_job(scheduler);
+        if (job == NULL)
+        {
+            pthread_cond_wait(&scheduler->work, &scheduler->lock);
+            continue;
+        }
+
+        size_t index = job->next++;
+        job->pass += 1. / job->weight;
+        // once all items are started, the job only waits for completion
+        if (job->next == job->count)
+            unlink_job(scheduler, job);
+        pthread_mutex_unlock(&scheduler->lock);
+
+        job->fn(job->ctx, index, worker->id);
+
+        pthread_mutex_lock(&scheduler->lock);
+        if (++job->done == job->count)
+        {
+            if (job->finish != NULL)
+                job->finish(job->ctx);
+            scheduler->running--;
+            // waiting jobs may fit now
+            for (struct scheduler_job *other = scheduler->jobs;
+                 other != NULL; other = other->next_job)
+                if (!other->started)
+                    admit_job(scheduler, other);
+            pthread_cond_broadcast(&scheduler->work);
+            pthread_cond_broadcast(&scheduler->done);
+        }
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+    free(worker);
+    return NULL;
+}
+
+void scheduler_init(struct scheduler *scheduler, size_t thread_count)
+{
+    pthread_mutex_init(&scheduler->lock, NULL);
+    pthread_cond_init(&scheduler->work, NULL);
+    pthread_cond_init(&scheduler->done, NULL);
+    scheduler->jobs = NULL;
+    scheduler->running = 0;
+    scheduler->reserved = 0;
+    scheduler->shutdown = false;
+    scheduler->thread_count = thread_count;
+    scheduler->threads = xalloc(sizeof(*scheduler->threads) * thread_count);
+
+    for (size_t i = 0; i < thread_count; i++)
+    {
+        struct scheduler_worker *worker = xalloc(sizeof(*worker));
+        worker->scheduler = scheduler;
+        worker->id = i;
+        int rc = pthread_create(&scheduler->threads[i], NULL,
+                                scheduler_worker_run, worker);
+        if (rc != 0)
+            errx(1, "failed to create a worker thread");
+    }
+}
+
+void scheduler_destroy(struct scheduler *scheduler)
+{
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->shutdown = true;
+    pthread_cond_broadcast(&scheduler->work);
+    pthread_mutex_unlock(&scheduler->lock);
+
+    for (size_t i = 0; i < scheduler->thread_count; i++)
+        pthread_join(scheduler->threads[i], NULL);
+    free(scheduler->threads);
+    pthread_cond_destroy(&scheduler->done);
+    pthread_cond_destroy(&scheduler->work);
+    pthread_mutex_destroy(&scheduler->lock);
+}
+
+void scheduler_submit(struct scheduler *scheduler, struct scheduler_job *job)
+{
+    job->admitted = false;
+    job->started = false;
+    job->next = 0;
+    job->done = 0;
+    if (job->weight == 0)
+        job->weight = 1;
+    if (job->count == 0)
+        return;
+
+    pthread_mutex_lock(&scheduler->lock);
+    // start level with the jobs of the same priority, so that the new job
+    // neither waits for them nor gets the pool to itself
+    job->pass = INFINITY;
+    for (struct scheduler_job *other = scheduler->jobs; other != NULL;
+         other = other->next_job)
+        if (other->priority == job->priority)
+            job->pass = fmin(job->pass, other->pass);
+    if (isinf(job->pass))
+        job->pass = 0;
+
+    admit_job(scheduler, job);
+    job->next_job = scheduler->jobs;
+    scheduler->jobs = job;
+    pthread_cond_broadcast(&scheduler->work);
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+void scheduler_wait(struct scheduler *scheduler, struct scheduler_job *job)
+{
+    pthread_mutex_lock(&scheduler->lock);
+    while (job->done < job->count)
+        pthread_cond_wait(&scheduler->done, &scheduler->lock);
+    pthread_mutex_unlock(&scheduler->lock);
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+** Runs the items of several jobs at once on a single pool of threads.
+** Workers pick items one at a time, from the job with the highest
+** priority. Jobs of the same priority share the pool in proportion to
+** their weight. As jobs are only picked between items, a new high
+** priority job preempts others as soon as their current items are done.
+**
+** Jobs declare how much memory they need while they run. A job only
+** starts once that fits in the memory budget, or nothing else runs, so
+** that jobs which don't fit wait in line. Whether it fits is checked when
+** the job is submitted, then each time another job finishes, as checking
+** may shrink the caches of running jobs. Only the memory which start
+** allocates is admitted: what callers allocate beforehand, such as the
+** images and buffers a renderer keeps between frames, is allocated
+** whatever the budget, and only delays the jobs which come after it.
+*/
+struct scheduler
+{
+    pthread_mutex_t lock;
+    // signaled when a job is submitted, or the pool shuts down
+    pthread_cond_t work;
+    // signaled when a job completes
+    pthread_cond_t done;
+    // the jobs with items left to start
+    struct scheduler_job *jobs;
+    // how many jobs started, and are not done yet
+    size_t running;
+    // the memory of jobs admitted, but not started yet
+    size_t reserved;
+    bool shutdown;
+
+    pthread_t *threads;
+    size_t thread_count;
+};
+
+/*
+** fn(ctx, index, worker) is called for each index in [0, count). worker is
+** in [0, thread_count), and identifies the thread running the item, so
+** that callers can use per thread buffers without locking.
+*/
+typedef void (*scheduler_fn)(void *ctx, size_t index, size_t worker);
+
+struct scheduler_job
+{
+    scheduler_fn fn;
+    // if not NULL, called with the scheduler locked, before the first item
+    // and after the last one. start allocates the memory of the job, and
+    // finish frees it
+    void (*start)(void *ctx);
+    void (*finish)(void *ctx);
+    void *ctx;
+    size_t count;
+    // how much memory start allocates
+    size_t memory;
+    // higher priority jobs run first
+    unsigned priority;
+    // the share of the pool among jobs of the same priority, at least 1
+    unsigned weight;
+
+    // owned by the scheduler
+    struct scheduler_job *next_job;
+    bool admitted;
+    bool started;
+    size_t next;
+    size_t done;
+    // how much of the pool the job used, scaled down by its weight
+    double pass;
+};
+
+/*
+** Starts thread_count worker threads, which wait for jobs.
+*/
+void scheduler_init(struct scheduler *scheduler, size_t thread_count);
+
+/*
+** Waits for the workers to finish their current items, then stops them.
+** Jobs left are abandoned.
+*/
+void scheduler_destroy(struct scheduler *scheduler);
+
+/*
+** Queues the job, which must stay alive until scheduler_wait returns.
+*/
+void scheduler_submit(struct scheduler *scheduler, struct scheduler_job *job);
+
+/*
+** Returns once all items of the job are done.
+*/
+void scheduler_wait(struct scheduler *scheduler, struct scheduler_job *job);
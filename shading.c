@@ -0,0 +1,93 @@
+#include "shading.h"
+
+#include <math.h>
+#include <stdbool.h>
+
+struct vec3 shade_ambient(const struct material *material,
+                          double ambient_intensity)
+{
+    return vec3_mul(&material->surface_color, ambient_intensity);
+}
+
+struct light_contribution shade_light(const struct intersection *intersection,
+                                      const struct ray *ray,
+                                      const struct material *material,
+                                      const struct light *light,
+                                      const struct light_sample *sample)
+{
+    struct vec3 light_color
+        = vec3_mul(&light->color, light->intensity * sample->attenuation);
+    struct vec3 diffuse_light_color
+        = vec3_mul_vec(&light_color, &material->surface_color);
+
+    // compute the diffuse lighting contribution by applying the cosine
+    // law
+    double diffuse_intensity
+        = -vec3_dot(&intersection->normal, &sample->direction);
+    if (diffuse_intensity < 0)
+        diffuse_intensity = 0;
+
+    struct vec3 diffuse_contribution = vec3_mul(
+        &diffuse_light_color, diffuse_intensity * material->diffuse_kn);
+
+    // compute the specular reflection contribution
+    struct vec3 light_reflection_dir
+        = vec3_reflect(&sample->direction, &intersection->normal);
+    struct vec3 specular_contribution = {0};
+    // computes how much the reflection goes in the direction of the
+    // camera
+    double light_reflection_proj
+        = -vec3_dot(&light_reflection_dir, &ray->direction);
+    if (light_reflection_proj < 0.0)
+        light_reflection_proj = 0.0;
+    else
+    {
+        double spec_coeff = pow(light_reflection_proj, material->spec_n)
+                            * material->spec_ks * sample->attenuation;
+        specular_contribution = vec3_mul(&light->color, spec_coeff);
+    }
+
+    return (struct light_contribution){
+        .diffuse = diffuse_contribution,
+        .specular = specular_contribution,
+    };
+}
+
+double fresnel_schlick(double cos_incident, double ior)
+{
+    double r0 = (1. - ior) / (1. + ior);
+    r0 *= r0;
+    return r0 + (1. - r0) * pow(1. - cos_incident, 5);
+}
+
+// how far scattered rays start from the surface, to avoid self intersection
+#define SCATTER_EPSILON 1e-6
+
+void glass_scatter(struct ray *ray, const struct intersection *intersection,
+                   const struct material *material, double u)
+{
+    // flip the normal and the ratio of indices when leaving the object
+    struct vec3 normal = intersection->normal;
+    double eta = 1. / material->ior;
+    if (vec3_dot(&ray->direction, &normal) > 0)
+    {
+        vec3_neg(&normal);
+        eta = material->ior;
+    }
+
+    struct vec3 direction;
+    double cos_incident = -vec3_dot(&ray->direction, &normal);
+    bool reflect = u < fresnel_schlick(cos_incident, material->ior);
+    if (reflect || !vec3_refract(&direction, &ray->direction, &normal, eta))
+    {
+        ray->direction = vec3_reflect(&ray->direction, &normal);
+        struct vec3 offset = vec3_mul(&normal, SCATTER_EPSILON);
+        ray->source = vec3_add(&intersection->point, &offset);
+        return;
+    }
+
+    vec3_normalize(&direction);
+    ray->direction = direction;
+    struct vec3 offset = vec3_mul(&normal, -SCATTER_EPSILON);
+    ray->source = vec3_add(&intersection->point, &offset);
+}
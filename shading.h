@@ -0,0 +1,81 @@
+#pragma once
+
+#include "light.h"
+#include "ray.h"
+
+enum material_kind
+{
+    /* an opaque surface, shaded with the phong model */
+    MATERIAL_PHONG = 0,
+    /*
+    ** a perfectly smooth dielectric, such as glass, which reflects and
+    ** refracts light without scattering it, tinted by surface_color
+    */
+    MATERIAL_GLASS,
+};
+
+struct material
+{
+    enum material_kind kind;
+    struct vec3 surface_color;
+    // a coefficient teaking how much diffuse light to add
+    double diffuse_kn;
+    // how wide the reflection is
+    double spec_n;
+    // how much the specular reflection contributes
+    double spec_ks;
+    // MATERIAL_GLASS only: the index of refraction
+    double ior;
+};
+
+/*
+** Schlick's approximation of the fraction of light reflected by a
+** dielectric, given the cosine of the incident angle.
+*/
+double fresnel_schlick(double cos_incident, double ior);
+
+/*
+** Continues a ray through a glass surface. u is a uniform random number in
+** [0, 1]: the ray is reflected if u is below the fresnel reflectance, and
+** refracted otherwise, unless it is totally reflected. Passing 1 always
+** refracts. The resulting ray starts slightly off the surface.
+*/
+void glass_scatter(struct ray *ray, const struct intersection *intersection,
+                   const struct material *material, double u);
+
+/*
+** The light reflected by a surface regardless of direct lighting.
+*/
+struct vec3 shade_ambient(const struct material *material,
+                          double ambient_intensity);
+
+struct light_contribution
+{
+    struct vec3 diffuse;
+    struct vec3 specular;
+};
+
+static inline void light_contribution_add(struct light_contribution *self,
+                                          const struct light_contribution *o)
+{
+    self->diffuse = vec3_add(&self->diffuse, &o->diffuse);
+    self->specular = vec3_add(&self->specular, &o->specular);
+}
+
+static inline void light_contribution_scale(struct light_contribution *self,
+                                            double coeff)
+{
+    self->diffuse = vec3_mul(&self->diffuse, coeff);
+    self->specular = vec3_mul(&self->specular, coeff);
+}
+
+/*
+** Computes the light reflected towards the ray source by a surface point,
+** from a single light sample, split into diffuse and specular
+** contributions. Occlusion is up to the caller.
+*/
+struct light_contribution shade_light(const struct intersection *intersection,
+                                      const struct ray *ray,
+                                      const struct material *material,
+                                      const struct light *light,
+                                      const struct light_sample *sample);
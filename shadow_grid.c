@@ -0,0 +1,184 @@
+#include "shadow_grid.h"
+
+#include "memory.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+// about this many cells per sphere, so that most cells list few spheres
+#define SHADOW_GRID_CELLS_PER_SPHERE 2
+// large spheres are listed in every cell they overlap
+#define SHADOW_GRID_MAX_CELLS (1 << 18)
+
+static size_t cell_coord(double value, double min, double cell_size,
+                         size_t size)
+{
+    double coord = floor((value - min) / cell_size);
+    if (!(coord > 0))
+        return 0;
+    if (coord >= size)
+        return size - 1;
+    return coord;
+}
+
+/*
+** The range of cells covered by the projection of a sphere, inclusive.
+*/
+struct cell_range
+{
+    size_t min_x;
+    size_t min_y;
+    size_t max_x;
+    size_t max_y;
+};
+
+static struct cell_range sphere_cells(const struct shadow_grid *grid,
+                                      const struct sphere *sphere)
+{
+    double u = vec3_dot(&sphere->center, &grid->u_axis);
+    double v = vec3_dot(&sphere->center, &grid->v_axis);
+    double r = sphere->radius;
+    return (struct cell_range){
+        .min_x = cell_coord(u - r, grid->min_u, grid->cell_size, grid->width),
+        .min_y = cell_coord(v - r, grid->min_v, grid->cell_size, grid->height),
+        .max_x = cell_coord(u + r, grid->min_u, grid->cell_size, grid->width),
+        .max_y = cell_coord(v + r, grid->min_v, grid->cell_size, grid->height),
+    };
+}
+
+static int entry_compare(const void *a, const void *b)
+{
+    const struct shadow_grid_entry *entry_a = a;
+    const struct shadow_grid_entry *entry_b = b;
+    if (entry_a->depth != entry_b->depth)
+        return entry_a->depth < entry_b->depth ? -1 : 1;
+    return (entry_a->sphere > entry_b->sphere)
+           - (entry_a->sphere < entry_b->sphere);
+}
+
+/*
+** The grid covers the projected centers, and its cells are square
+*/
+static void size_grid(struct shadow_grid *grid, const struct sphere *spheres,
+                      size_t count)
+{
+    double min_u = INFINITY, min_v = INFINITY;
+    double max_u = -INFINITY, max_v = -INFINITY;
+    for (size_t i = 0; i < count; i++)
+    {
+        double u = vec3_dot(&spheres[i].center, &grid->u_axis);
+        double v = vec3_dot(&spheres[i].center, &grid->v_axis);
+        min_u = fmin(min_u, u);
+        min_v = fmin(min_v, v);
+        max_u = fmax(max_u, u);
+        max_v = fmax(max_v, v);
+    }
+
+    double target = count * SHADOW_GRID_CELLS_PER_SPHERE;
+    if (target > SHADOW_GRID_MAX_CELLS)
+        target = SHADOW_GRID_MAX_CELLS;
+    double extent_u = max_u - min_u;
+    double extent_v = max_v - min_v;
+    double cell_size = sqrt(extent_u * extent_v / target);
+    // centers on a line get a single row
+    if (cell_size <= 0)
+        cell_size = fmax(extent_u, extent_v) / target;
+
+    grid->min_u = min_u;
+    grid->min_v = min_v;
+    grid->cell_size = cell_size;
+    grid->width = 1;
+    grid->height = 1;
+    if (cell_size <= 0)
+        return;
+    grid->width = fmin(extent_u / cell_size + 1, target);
+    grid->height = fmin(extent_v / cell_size + 1, target);
+}
+
+void shadow_grid_build(struct shadow_grid *grid, const struct vec3 *direction,
+                       const struct sphere *spheres, size_t count)
+{
+    *grid = (struct shadow_grid){.direction = *direction};
+    if (count == 0)
+        return;
+
+    vec3_orthonormal_basis(direction, &grid->u_axis, &grid->v_axis);
+    size_grid(grid, spheres, count);
+
+    size_t cell_count = grid->width * grid->height;
+    grid->cells = memory_alloc(MEMORY_ACCELERATION,
+                               sizeof(*grid->cells) * (cell_count + 1));
+    for (size_t i = 0; i <= cell_count; i++)
+        grid->cells[i] = 0;
+
+    // count the entries of each cell, after the one before
+    for (size_t i = 0; i < count; i++)
+    {
+        struct cell_range range = sphere_cells(grid, &spheres[i]);
+        for (size_t y = range.min_y; y <= range.max_y; y++)
+            for (size_t x = range.min_x; x <= range.max_x; x++)
+                grid->cells[y * grid->width + x + 1]++;
+    }
+    for (size_t i = 0; i < cell_count; i++)
+        grid->cells[i + 1] += grid->cells[i];
+
+    // cells[i] goes from the start of cell i to its end while filling
+    grid->entries = memory_alloc(
+        MEMORY_ACCELERATION, sizeof(*grid->entries) * grid->cells[cell_count]);
+    for (size_t i = 0; i < count; i++)
+    {
+        const struct sphere *sphere = &spheres[i];
+        struct shadow_grid_entry entry = {
+            .depth = vec3_dot(&sphere->center, direction) - sphere->radius,
+            .sphere = i,
+        };
+        struct cell_range range = sphere_cells(grid, sphere);
+        for (size_t y = range.min_y; y <= range.max_y; y++)
+            for (size_t x = range.min_x; x <= range.max_x; x++)
+                grid->entries[grid->cells[y * grid->width + x]++] = entry;
+    }
+    for (size_t i = cell_count; i > 0; i--)
+        grid->cells[i] = grid->cells[i - 1];
+    grid->cells[0] = 0;
+
+    for (size_t i = 0; i < cell_count; i++)
+        qsort(grid->entries + grid->cells[i],
+              grid->cells[i + 1] - grid->cells[i], sizeof(*grid->entries),
+              entry_compare);
+}
+
+void shadow_grid_destroy(struct shadow_grid *grid)
+{
+    memory_free(grid->cells);
+    memory_free(grid->entries);
+}
+
+bool shadow_grid_occluded(const struct shadow_grid *grid,
+                          const struct sphere *spheres, const struct ray *ray,
+                          size_t *occluder, struct object_set *hits)
+{
+    if (grid->cells == NULL)
+        return false;
+
+    double u = vec3_dot(&ray->source, &grid->u_axis);
+    double v = vec3_dot(&ray->source, &grid->v_axis);
+    size_t x = cell_coord(u, grid->min_u, grid->cell_size, grid->width);
+    size_t y = cell_coord(v, grid->min_v, grid->cell_size, grid->height);
+    size_t cell = y * grid->width + x;
+
+    // the ray goes towards the light, to lower depths
+    double depth = vec3_dot(&ray->source, &grid->direction);
+    for (size_t i = grid->cells[cell]; i < grid->cells[cell + 1]; i++)
+    {
+        const struct shadow_grid_entry *entry = &grid->entries[i];
+        if (entry->depth > depth)
+            break;
+        if (isinf(sphere_ray_distance(ray, &spheres[entry->sphere])))
+            continue;
+        if (hits != NULL)
+            object_set_add(hits, entry->sphere);
+        *occluder = entry->sphere;
+        return true;
+    }
+    return false;
+}
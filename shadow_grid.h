@@ -0,0 +1,63 @@
+#pragma once
+
+#include "object_set.h"
+#include "ray.h"
+#include "sphere.h"
+#include "vec3.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+** The spheres of a scene, seen from a directional light. Shadow rays
+** towards such a light are all parallel, so that a ray can only hit the
+** spheres whose projection on the plane across the light covers its
+** source. Projections are binned in a uniform grid over that plane, and
+** each cell lists the spheres it overlaps, from the nearest to the light.
+** Testing a shadow ray then takes a single cell, and stops at the first
+** sphere which lies entirely behind its source.
+**
+** Spheres and points outside the grid go to its border cells, which keeps
+** lookups exact however few cells the grid has.
+*/
+
+struct shadow_grid_entry
+{
+    // the depth along the light of the side of the sphere facing it
+    double depth;
+    size_t sphere;
+};
+
+struct shadow_grid
+{
+    // the direction light travels in, and two axes across it
+    struct vec3 direction;
+    struct vec3 u_axis;
+    struct vec3 v_axis;
+
+    double min_u;
+    double min_v;
+    double cell_size;
+    size_t width;
+    size_t height;
+
+    // the entries of cell i are [cells[i], cells[i + 1])
+    size_t *cells;
+    struct shadow_grid_entry *entries;
+};
+
+/*
+** Builds the grid of spheres [0, count) for a light travelling in
+** direction, which must be normalized.
+*/
+void shadow_grid_build(struct shadow_grid *grid, const struct vec3 *direction,
+                       const struct sphere *spheres, size_t count);
+void shadow_grid_destroy(struct shadow_grid *grid);
+
+/*
+** Like scene_occluded, for a ray going against the light direction, up to
+** the light.
+*/
+bool shadow_grid_occluded(const struct shadow_grid *grid,
+                          const struct sphere *spheres, const struct ray *ray,
+                          size_t *occluder, struct object_set *hits);
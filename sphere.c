@@ -0,0 +1,43 @@
+#include "sphere.h"
+
+#include <math.h>
+
+double sphere_ray_distance(const struct ray *ray, const struct sphere *sphere)
+{
+    struct vec3 hypothenuse = vec3_sub(&sphere->center, &ray->source);
+    double hyp_len = vec3_length(&hypothenuse);
+    double projection = vec3_dot(&hypothenuse, &ray->direction);
+    // rays starting inside the sphere always hit it
+    if (projection < 0 && hyp_len > sphere->radius)
+        return INFINITY;
+
+    double d = sqrt(hyp_len * hyp_len - projection * projection);
+    if (d > sphere->radius)
+        return INFINITY;
+
+    double radius = sphere->radius;
+    double m = sqrt(radius * radius - d * d);
+    double t0 = projection - m;
+    double t1 = projection + m;
+
+    double t = t0;
+    if (t < 0.)
+        t = t1;
+    return t;
+}
+
+double sphere_ray_intersect(struct intersection *intersection,
+                            const struct ray *ray, const struct sphere *sphere)
+{
+    double t = sphere_ray_distance(ray, sphere);
+    if (isinf(t))
+        return t;
+
+    // intersection point = ray->source + ray->direction * t
+    struct vec3 point_offset = vec3_mul(&ray->direction, t);
+    intersection->point = vec3_add(&ray->source, &point_offset);
+    intersection->normal = vec3_sub(&intersection->point, &sphere->center);
+    vec3_normalize(&intersection->normal);
+    // compute intersection coord / normal
+    return t;
+}
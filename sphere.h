@@ -0,0 +1,28 @@
+#pragma once
+
+#include "aabb.h"
+#include "ray.h"
+
+#include <stddef.h>
+
+struct sphere
+{
+    struct vec3 center;
+    double radius;
+    // the index of the sphere material inside the scene
+    size_t material;
+};
+
+// returns the intersection distance, or INFINITY
+double sphere_ray_distance(const struct ray *ray, const struct sphere *sphere);
+
+// returns the intersection distance
+double sphere_ray_intersect(struct intersection *intersection,
+                            const struct ray *ray, const struct sphere *sphere);
+
+static inline struct aabb sphere_bounds(const struct sphere *sphere)
+{
+    struct aabb res = {sphere->center, sphere->center};
+    aabb_grow(&res, sphere->radius);
+    return res;
+}
@@ -1,5 +1,11 @@
 #include "utils.h"
+
+#include <errno.h>
+#include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 __attribute__((malloc)) void *xalloc(size_t size)
 {
@@ -8,3 +14,58 @@ __attribute__((malloc)) void *xalloc(size_t size)
         abort();
     return res;
 }
+
+FILE *replace_file_open(const char *path, char **tmp_path)
+{
+    size_t tmp_size = strlen(path) + sizeof(".XXXXXX");
+    *tmp_path = xalloc(tmp_size);
+    snprintf(*tmp_path, tmp_size, "%s.XXXXXX", path);
+    int fd = mkstemp(*tmp_path);
+    if (fd == -1)
+    {
+        free(*tmp_path);
+        *tmp_path = NULL;
+        return NULL;
+    }
+
+    // files are created private, but other users may read them once done
+    FILE *res = NULL;
+    if (fchmod(fd, 0644) == 0)
+        res = fdopen(fd, "w");
+    if (res == NULL)
+    {
+        int error = errno;
+        close(fd);
+        replace_file_abort(NULL, *tmp_path);
+        *tmp_path = NULL;
+        errno = error;
+    }
+    return res;
+}
+
+int replace_file_commit(FILE *fp, char *tmp_path, const char *path)
+{
+    // writes which failed without the caller noticing left an error
+    bool failed = ferror(fp);
+    if (fclose(fp) != 0)
+        failed = true;
+    else if (failed)
+        errno = EIO;
+    if (failed || rename(tmp_path, path) != 0)
+    {
+        replace_file_abort(NULL, tmp_path);
+        return -1;
+    }
+    free(tmp_path);
+    return 0;
+}
+
+void replace_file_abort(FILE *fp, char *tmp_path)
+{
+    int error = errno;
+    if (fp != NULL)
+        fclose(fp);
+    unlink(tmp_path);
+    free(tmp_path);
+    errno = error;
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdio.h>
 
 #define STATIC_ASSERT(Name, X)                                                 \
     struct __assert_##Name                                                     \
@@ -15,3 +16,24 @@ static inline size_t align_up(size_t x, size_t alignment)
 }
 
 __attribute__((malloc)) void *xalloc(size_t size);
+
+/*
+** Files are written under a temporary name next to their path, and renamed
+** over it once complete, so that readers never see part of one. Returns
+** the temporary file, whose name is stored in tmp_path, or NULL with errno
+** set if it can't be created.
+*/
+FILE *replace_file_open(const char *path, char **tmp_path);
+
+/*
+** Closes the temporary file, and moves it to path. Returns -1 with errno
+** set if either fails, or an earlier write to fp did, in which case the
+** temporary file is removed.
+*/
+int replace_file_commit(FILE *fp, char *tmp_path, const char *path);
+
+/*
+** Closes and removes the temporary file, keeping errno, for writes which
+** failed half way. fp may be NULL.
+*/
+void replace_file_abort(FILE *fp, char *tmp_path);
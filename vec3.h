@@ -1,6 +1,7 @@
 #pragma once
 
 #include <math.h>
+#include <stdbool.h>
 
 struct vec3
 {
@@ -88,6 +89,64 @@ static inline struct vec3 vec3_reflect(const struct vec3 *incident_dir,
     return vec3_add(incident_dir, &corrector);
 }
 
+/*
+** Computes the refraction of a vector through a surface, given the normal
+** on the side of the incident vector, and the ratio of the indices of
+** refraction (incident side / other side). Returns false if the vector is
+** totally reflected instead.
+*/
+static inline bool vec3_refract(struct vec3 *res,
+                                const struct vec3 *incident_dir,
+                                const struct vec3 *normal, double eta)
+{
+    double cos_i = -vec3_dot(incident_dir, normal);
+    double sin2_t = eta * eta * (1. - cos_i * cos_i);
+    if (sin2_t > 1.)
+        return false;
+
+    double cos_t = sqrt(1. - sin2_t);
+    struct vec3 incident_part = vec3_mul(incident_dir, eta);
+    struct vec3 normal_part = vec3_mul(normal, eta * cos_i - cos_t);
+    *res = vec3_add(&incident_part, &normal_part);
+    return true;
+}
+
+/*
+** Builds two unit vectors, perpendicular to each other and to normal
+*/
+static inline void vec3_orthonormal_basis(const struct vec3 *normal,
+                                          struct vec3 *u_axis,
+                                          struct vec3 *v_axis)
+{
+    struct vec3 helper = {1, 0, 0};
+    if (fabs(normal->x) > 0.9)
+        helper = (struct vec3){0, 1, 0};
+    *u_axis = vec3_cross(normal, &helper);
+    vec3_normalize(u_axis);
+    *v_axis = vec3_cross(normal, u_axis);
+}
+
+/*
+** Maps (u, v) in [0, 1)^2 to a direction of the hemisphere around normal,
+** such that uniform (u, v) give a cosine weighted distribution.
+*/
+static inline struct vec3 vec3_cosine_sample(const struct vec3 *normal,
+                                             double u, double v)
+{
+    struct vec3 u_axis;
+    struct vec3 v_axis;
+    vec3_orthonormal_basis(normal, &u_axis, &v_axis);
+
+    // project a uniform disk sample onto the hemisphere
+    double r = sqrt(u);
+    double phi = 2 * M_PI * v;
+    struct vec3 x_offset = vec3_mul(&u_axis, r * cos(phi));
+    struct vec3 y_offset = vec3_mul(&v_axis, r * sin(phi));
+    struct vec3 z_offset = vec3_mul(normal, sqrt(1 - u));
+    struct vec3 res = vec3_add(&x_offset, &y_offset);
+    return vec3_add(&res, &z_offset);
+}
+
 static inline void vec3_update_min_components(struct vec3 *self,
                                               const struct vec3 *o)
 {